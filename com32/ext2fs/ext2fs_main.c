@@ -30,34 +30,67 @@
  * Sample module to exercise EXT2FS library
  *
  * Usage: ext2fs.c32 /dev/hd[a-z][1-9] cmd cmd-options
+ *        ext2fs.c32 /dev/hd[a-z][1-9] batch script-file
+ *
+ * The same source also builds as a Linux program (see host/Makefile)
+ * which works on a filesystem image and reports how long the command
+ * took, so the library can be benchmarked outside of SYSLINUX.
  */
 
 #include <stdio.h>
 #include <string.h>
+#if defined(HAVE_SYSLINUX_BUILD)
 #include <console.h>
+#else
+#include <sys/time.h>
+#endif /* defined(HAVE_SYSLINUX_BUILD) */
 #include "ext2fs_utils.h"
 
 ext2_filsys current_fs = NULL;
 ext2_ino_t root, cwd;
 char *c32_name = NULL;
 
+#if defined(HAVE_SYSLINUX_BUILD)
+#define DEV_NAME	"/dev/hdb1"
+#define IO_MANAGER	syslinux_io_manager
+#else
+#define DEV_NAME	"disk.img"
+#define IO_MANAGER	unix_io_manager
+#endif /* defined(HAVE_SYSLINUX_BUILD) */
+
 static void usage(void)
 {
+#if defined(HAVE_SYSLINUX_BUILD)
   printf("Usage: %s /dev/hd[a-z][1-9] cmd cmd-options\n", c32_name);
+#else
+  printf("Usage: %s image-file cmd cmd-options\n", c32_name);
+#endif /* defined(HAVE_SYSLINUX_BUILD) */
   printf("examples:\n");
-  printf(" %s /dev/hdb1 cat /root/file.txt\n", c32_name);
-  printf(" %s /dev/hdb1 cp /root/file.txt /root/newfile.txt\n", c32_name);
-  printf(" %s /dev/hdb1 ls /boot\n", c32_name);
-  printf(" %s /dev/hdb1 mkdir /foo\n", c32_name);
-  printf(" %s /dev/hdb1 rm /root/file.txt\n", c32_name);
+  printf(" %s " DEV_NAME " cat /root/file.txt\n", c32_name);
+  printf(" %s " DEV_NAME " cp /root/file.txt /root/newfile.txt\n", c32_name);
+  printf(" %s " DEV_NAME " ls /boot\n", c32_name);
+  printf(" %s " DEV_NAME " mkdir /foo\n", c32_name);
+  printf(" %s " DEV_NAME " rm /root/file.txt\n", c32_name);
+  printf(" %s " DEV_NAME " scancmp 0\n", c32_name);
+  printf(" %s " DEV_NAME " batch /boot/commands.txt\n", c32_name);
+  printf("A batch script holds one command per line ('-' reads stdin).\n");
 }
 
 /*
  * load_bitmaps() need for writes
+ *
+ * The filesystem is opened with EXT2_FLAG_LAZY_BITMAPS, so this only
+ * sets the bitmaps up; each group's bitmap block is read the first
+ * time the group is looked at.
  */
+static int bitmaps_loaded = 0;
+
 static int load_bitmaps(void)
 {
   errcode_t ret = 0;
+
+  if (bitmaps_loaded)
+    return 0;
   printf("Loading bitmaps...\n");
   ret = ext2fs_read_inode_bitmap(current_fs);
   if (ret) {
@@ -71,9 +104,227 @@ static int load_bitmaps(void)
     return (int)ret;
   }
 
+  bitmaps_loaded = 1;
   return 0;
 }
 
+#if !defined(HAVE_SYSLINUX_BUILD)
+/*
+ * report_timing() - elapsed time and I/O volume of one command
+ */
+static void report_timing(const char *cmd, struct timeval *start)
+{
+  struct timeval end;
+  io_stats stats = NULL;
+  double secs;
+
+  gettimeofday(&end, NULL);
+  secs = (end.tv_sec - start->tv_sec) +
+    (end.tv_usec - start->tv_usec) / 1000000.0;
+
+  printf("'%s' took %.6f seconds\n", cmd, secs);
+  if (current_fs->io->manager->get_stats &&
+      !current_fs->io->manager->get_stats(current_fs->io, &stats) && stats) {
+    printf("  %llu bytes read (%.2f MB/s), %llu bytes written\n",
+	   stats->bytes_read,
+	   secs > 0 ? stats->bytes_read / secs / 1048576.0 : 0.0,
+	   stats->bytes_written);
+  }
+}
+#endif /* !defined(HAVE_SYSLINUX_BUILD) */
+
+/*
+ * run_command() - run one command; argv[0] is the command name
+ *
+ * Sets *write_changes when the command changed the filesystem.
+ */
+static int run_command(int argc, char *argv[], int *write_changes)
+{
+  int ret = 0;
+  char *buf = NULL;
+  char *cmd_string = argv[0];
+  ext2_off_t size = 0;
+
+  if (argc < 2) {
+    printf("ERR: '%s' missing argument\n", cmd_string);
+    return -1;
+  }
+
+  if (!strcmp(cmd_string, "cat")) {
+    /*
+     * cat
+     */
+    printf("Displaying '%s' file..\n", argv[1]);
+    ret = load_file(argv[1], &buf, &size);
+    if (ret) {
+      printf("ERR: Can't cat '%s' (ret=%d)\n", argv[1], ret);
+    } else {
+      printf("'%s' is %d bytes\n", argv[1], size);
+      for (unsigned int i = 0; i < size; i++) {
+	printf("%c", buf[i]);
+      }
+      free(buf);
+    }
+  } else if (!strcmp(cmd_string, "cp")) {
+    /*
+     * cp
+     */
+    if (argc != 3) {
+      printf("ERR: '%s' missing target name\n", cmd_string);
+      return -1;
+    }
+    printf("Copying '%s' to '%s'\n", argv[1], argv[2]);
+    ret = load_bitmaps();
+    if (ret) {
+      printf("ERR: Could not copy '%s' (ret=%d)\n", argv[1], ret);
+      return ret;
+    }
+    /*
+     * TODO: don't hardcode file mode
+     */
+    ret = copy_file(argv[1], argv[2],
+		    (LINUX_S_IFREG | LINUX_S_IRWXU |
+		     LINUX_S_IRGRP | LINUX_S_IXGRP |
+		     LINUX_S_IROTH | LINUX_S_IXOTH));
+    if (ret) {
+      printf("ERR: Can't copy '%s' to '%s' (ret=%d)\n",
+	     argv[1], argv[2], ret);
+    } else {
+      *write_changes = 1;
+      printf("'%s' has been copied to '%s'\n", argv[1], argv[2]);
+    }
+  } else if (!strcmp(cmd_string, "ls")) {
+    /*
+     * ls
+     */
+    printf("Displaying '%s' dir..\n", argv[1]);
+    display_dir(argv[1]);
+  } else if (!strcmp(cmd_string, "mkdir")) {
+    /*
+     * mkdir
+     */
+    printf("Making '%s' dir..\n", argv[1]);
+    ret = load_bitmaps();
+    if (ret) {
+      printf("ERR: Could not mkdir '%s' (ret=%d)\n", argv[1], ret);
+      return ret;
+    }
+    ret = mkdir(argv[1]);
+    if (ret) {
+      printf("ERR: Could not mkdir '%s' (ret=%d)\n", argv[1], ret);
+    } else {
+      *write_changes = 1;
+      printf("Created '%s'\n", argv[1]);
+    }
+  } else if (!strcmp(cmd_string, "rm")) {
+    /*
+     * rm 
+     */
+    printf("Removing '%s' file..\n", argv[1]);
+    ret = load_bitmaps();
+    if (ret) {
+      printf("ERR: Could not rm '%s' (ret=%d)\n", argv[1], ret);
+      return ret;
+    }
+    ret = delete_file(argv[1]);
+    if (ret) {
+      printf("ERR: Could not delete '%s' (ret=%d)\n", argv[1], ret);
+    } else {
+      *write_changes = 1;
+      printf("'%s' has been deleted\n", argv[1]);
+    }
+  } else if (!strcmp(cmd_string, "scancmp")) {
+    /*
+     * scancmp: check the batched inode scan against the classic one
+     */
+    printf("Comparing inode scans (%s blocks buffer)..\n", argv[1]);
+    ret = scan_compare(atoi(argv[1]));
+    if (ret) {
+      printf("ERR: Inode scans don't match (ret=%d)\n", ret);
+    } else {
+      printf("Inode scans match\n");
+    }
+  } else {
+    printf("ERR: Unknown command '%s'\n", cmd_string);
+    ret = -1;
+  }
+
+  return ret;
+}
+
+#define BATCH_LINE_LEN	1024
+#define BATCH_MAX_ARGS	8
+
+/*
+ * run_batch() - run the commands in a script, one per line
+ *
+ * The filesystem stays open across commands, so the bitmaps are
+ * loaded at most once and everything is flushed once when it is
+ * closed.  Blank lines and lines starting with '#' are skipped.
+ * A line longer than BATCH_LINE_LEN - 1 characters, or with more
+ * than BATCH_MAX_ARGS words, is an error.
+ * Stops at the first command that fails; the changes made by the
+ * commands before it are still written.
+ */
+static int run_batch(const char *script, int *write_changes)
+{
+  FILE *f;
+  char line[BATCH_LINE_LEN];
+  char *args[BATCH_MAX_ARGS];
+  char *p;
+  int nargs, lineno = 0, ret = 0;
+  size_t len;
+  int c;
+
+  if (!strcmp(script, "-")) {
+    f = stdin;
+  } else {
+    f = fopen(script, "r");
+    if (!f) {
+      printf("ERR: Can't open script '%s'\n", script);
+      return -1;
+    }
+  }
+
+  while (fgets(line, sizeof line, f)) {
+    lineno++;
+
+    /* Don't run the pieces of a line that didn't fit */
+    len = strlen(line);
+    if (len == sizeof line - 1 && line[len - 1] != '\n') {
+      c = getc(f);
+      if (c != EOF && c != '\n') {
+	printf("ERR: '%s' line %d is too long, stopping\n", script, lineno);
+	ret = -1;
+	break;
+      }
+    }
+
+    nargs = 0;
+    for (p = strtok(line, " \t\r\n"); p && nargs < BATCH_MAX_ARGS;
+	 p = strtok(NULL, " \t\r\n"))
+      args[nargs++] = p;
+    if (!nargs || args[0][0] == '#')
+      continue;
+    if (p) {
+      printf("ERR: '%s' line %d has too many arguments, stopping\n",
+	     script, lineno);
+      ret = -1;
+      break;
+    }
+
+    ret = run_command(nargs, args, write_changes);
+    if (ret) {
+      printf("ERR: '%s' line %d failed, stopping\n", script, lineno);
+      break;
+    }
+  }
+
+  if (f != stdin)
+    fclose(f);
+  return ret;
+}
+
 /*
  * main()
  */
@@ -81,15 +332,16 @@ int main(int argc, char *argv[])
 {
   int read_only = 0; // NB: file reads require write access flag
   int write_changes = 0;
-  int ret = 0;
-  char *buf = NULL;
   char *dev_string = NULL;
   char *cmd_string = NULL;
   ext2_filsys fs;
-  ext2_off_t size = 0;
   errcode_t retval = 0;
+#if defined(HAVE_SYSLINUX_BUILD)
   
   openconsole(&dev_stdcon_r, &dev_stdcon_w);
+#else
+  struct timeval start;
+#endif /* defined(HAVE_SYSLINUX_BUILD) */
   c32_name = argv[0];
 
   if (argc > 3) {
@@ -97,8 +349,9 @@ int main(int argc, char *argv[])
     cmd_string = argv[2];
 
     retval = ext2fs_open(dev_string,
-			 (read_only ? 0 : EXT2_FLAG_RW),
-			 0, 0, syslinux_io_manager, &fs);
+			 (read_only ? 0 : EXT2_FLAG_RW) |
+			 EXT2_FLAG_LAZY_BITMAPS,
+			 0, 0, IO_MANAGER, &fs);
     if (retval) {
       printf("ERR: Can't open '%s' (ret=%d)\n", dev_string, (int)retval);
       return -1;
@@ -112,107 +365,18 @@ int main(int argc, char *argv[])
 	     dev_string, 
 	     current_fs->flags & EXT2_FLAG_RW ? "Read/Write" : "Read Only");
 
-      if (!strcmp(cmd_string, "cat")) {
-	/*
-	 * cat
-	 */
-	write_changes = 0;
-	printf("Displaying '%s' file..\n", argv[3]);
-	ret = load_file(argv[3], &buf, &size);
-	if (ret) {
-	  printf("ERR: Can't cat '%s' (ret=%d)\n", argv[3], ret);
-	} else {
-	  printf("'%s' is %d bytes\n", argv[3], size);
-	  for (unsigned int i = 0; i < size; i++) {
-	    printf("%c", buf[i]);
-	  }
-	  free(buf);
-	}
-      } else if (!strcmp(cmd_string, "cp")) {
-	/*
-	 * cp
-	 */
-	if (argc !=5) {
-	  printf("ERR: '%s' missing target name\n", cmd_string);
-	} else {
-	  printf("Copying '%s' to '%s'\n", argv[3], argv[4]);
-	  ret = load_bitmaps();
-	  if (ret) {
-	    write_changes = 0;
-	    printf("ERR: Could not copy '%s' (ret=%d)\n", argv[3], ret);
-	    goto close_filesys;
-	  }
-	  ret = load_file(argv[3], &buf, &size);
-	  if (ret) {
-	    printf("ERR: Can't load '%s' (ret=%d)\n", argv[3], ret);
-	  } else {
-	    /*
-	     * TODO: don't hardcode file mode
-	     */
-	    ret = write_file(argv[4], buf, &size, 
-			     (LINUX_S_IFREG | LINUX_S_IRWXU |
-			      LINUX_S_IRGRP | LINUX_S_IXGRP |
-			      LINUX_S_IROTH | LINUX_S_IXOTH));
-	    free(buf);
-	    if (ret) {
-	      write_changes = 0;
-	      printf("ERR: Can't write '%s' (ret=%d)\n", argv[4], ret);
-	    } else {
-	      write_changes = 1;
-	      printf("'%s' has been copied to '%s'\n", argv[4], argv[3]);
-	    }
-	  }
-	}
-      } else if (!strcmp(cmd_string, "ls")) {
-	/*
-	 * ls
-	 */
-	printf("Displaying '%s' dir..\n", argv[3]);
+#if !defined(HAVE_SYSLINUX_BUILD)
+      gettimeofday(&start, NULL);
+#endif /* !defined(HAVE_SYSLINUX_BUILD) */
+
+      if (!strcmp(cmd_string, "batch"))
+	(void) run_batch(argv[3], &write_changes);
+      else if (run_command(argc - 2, argv + 2, &write_changes))
 	write_changes = 0;
-	display_dir(argv[3]);
-      } else if (!strcmp(cmd_string, "mkdir")) {
-	/*
-	 * mkdir
-	 */
-	printf("Making '%s' dir..\n", argv[3]);
-	ret = load_bitmaps();
-	if (ret) {
-	  write_changes = 0;
-	  printf("ERR: Could not mkdir '%s' (ret=%d)\n", argv[3], ret);
-	  goto close_filesys;
-	}
-	ret = mkdir(argv[3]);
-	if (ret) {
-	  write_changes = 0;
-	  printf("ERR: Could not mkdir '%s' (ret=%d)\n", argv[3], ret);
-	} else {
-	  write_changes = 1;
-	  printf("Created '%s'\n", argv[3]);
-	}
-      } else if (!strcmp(cmd_string, "rm")) {
-	/*
-	 * rm 
-	 */
-	printf("Removing '%s' file..\n", argv[3]);
-	ret = load_bitmaps();
-	if (ret) {
-	  write_changes = 0;
-	  printf("ERR: Could not rm '%s' (ret=%d)\n", argv[3], ret);
-	  goto close_filesys;
-	}
-	ret = delete_file(argv[3]);
-	if (ret) {
-	  write_changes = 0;
-	  printf("ERR: Could not delete '%s' (ret=%d)\n", argv[3], ret);
-	} else {
-	  write_changes = 1;
-	  printf("'%s' has been deleted\n", argv[3]);
-	}
-      } else {
-	printf("ERR: Unknown command '%s'\n", cmd_string);
-      }
 
-    close_filesys:
+#if !defined(HAVE_SYSLINUX_BUILD)
+      report_timing(cmd_string, &start);
+#endif /* !defined(HAVE_SYSLINUX_BUILD) */
       retval = close_fs(write_changes);
       if (retval) {
 	printf("ERR: could not close filesytem!\n");
@@ -227,4 +391,3 @@ int main(int argc, char *argv[])
  
   return 0;
 }
-
@@ -32,8 +32,12 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 #include "ext2fs_utils.h"
 
+/* Size of the buffer copy_file() moves data through */
+#define COPY_WINDOW	(1024 * 1024)
+
 extern ext2_filsys	current_fs;
 extern ext2_ino_t	root, cwd;
 
@@ -115,29 +119,30 @@ static int write_inode(ext2_ino_t ino, struct ext2_inode *inode)
 int close_fs(int write_changes)
 {
   int retval = 0;
+#if defined(HAVE_SYSLINUX_BUILD)
+  struct syslinux_cache_stats stats;
+#endif /* defined(HAVE_SYSLINUX_BUILD) */
   
   printf("Closing Filesystem...Changes will %s written to disk.\n", 
 	 write_changes ? "be" : "NOT be");
 
-  if (write_changes) {
-    if (current_fs->flags & EXT2_FLAG_IB_DIRTY) {
-      printf("Syncing inode_bitmap...\n");
-      retval = ext2fs_write_inode_bitmap(current_fs);
-      if (retval) {
-	printf("ERR: ext2fs_write_inode_bitmap (retval=%d)", retval);
-	goto close_fail;
-      }
+  /* Both bitmaps in one pass, so their blocks are written in disk order */
+  if (write_changes &&
+      (current_fs->flags & (EXT2_FLAG_IB_DIRTY | EXT2_FLAG_BB_DIRTY))) {
+    printf("Syncing bitmaps...\n");
+    retval = ext2fs_write_bitmaps(current_fs);
+    if (retval) {
+      printf("ERR: ext2fs_write_bitmaps (retval=%d)", retval);
+      goto close_fail;
     }
+  }
 
-    if (current_fs->flags & EXT2_FLAG_BB_DIRTY) {
-      printf("Syncing block_bitmap...\n");
-      retval = ext2fs_write_block_bitmap(current_fs);
-      if (retval) {
-	printf("ERR: ext2fs_write_block_bitmap (retval=%d)", retval);
-	goto close_fail;
-      }
-    }
+#if defined(HAVE_SYSLINUX_BUILD)
+  if (!syslinux_get_cache_stats(current_fs->io, &stats)) {
+    printf("Block cache: %lu hits, %lu misses, %lu writebacks\n",
+	   stats.hits, stats.misses, stats.writebacks);
   }
+#endif /* defined(HAVE_SYSLINUX_BUILD) */
 
   retval = ext2fs_close(current_fs);
   if (retval) {
@@ -294,18 +299,17 @@ int load_file(const char *filename, char **contents, ext2_off_t *size)
 }
 
 /*
- * write_file()
+ * create_file()
+ *
+ * Allocate and link a new, empty inode for filename.
  */
-int write_file(const char *filename, char *contents, 
-	       ext2_off_t *size, __u16 i_mode)
+static int create_file(const char *filename, ext2_off_t size,
+		       __u16 i_mode, ext2_ino_t *ino)
 {
-  int got = 0;
   int len = 0;
-  unsigned int written = 0;
   char *ptr = NULL;
   char *pathname = NULL;
   char *name = NULL;
-  ext2_file_t e2_file;
   ext2_ino_t newfile;
   ext2_ino_t parent;
   errcode_t retval;
@@ -351,14 +355,14 @@ int write_file(const char *filename, char *contents,
 			    pathname, &ino);
       if (retval) {
 	printf("ERR: \"%s\" does not exist\n", pathname);
-	return retval;
+	goto create_fail;
       }
       
       /* make sure parent is a directory */
       retval = ext2fs_check_directory(current_fs, ino);
       if (retval) {
 	printf("ERR: \"%s\" is not a directory\n", pathname);
-	return retval;
+	goto create_fail;
       }
       parent = ino;
     }
@@ -372,7 +376,7 @@ int write_file(const char *filename, char *contents,
   retval = ext2fs_new_inode(current_fs, parent, 010755, 0, &newfile);
   if (retval) {
     printf("ERR: ext2fs_new_inode() failed (retval=%d)\n", (int)retval);
-    return retval;
+    goto create_fail;
   }
   printf("Allocated inode: %u\n", newfile);
 
@@ -382,14 +386,14 @@ int write_file(const char *filename, char *contents,
     retval = ext2fs_expand_dir(current_fs, parent);
     if (retval) {
       printf("ERR: ext2fs_expand_dir failed (retval=%d)\n", (int)retval);
-      return retval;
+      goto create_fail;
     }
     retval = ext2fs_link(current_fs, parent, name, newfile, EXT2_FT_REG_FILE);
   }
 
   if (retval) {
     printf("ERR: ext2fs_link failed (retval=%d)\n", (int)retval);
-    return retval;
+    goto create_fail;
   }
 
   if (ext2fs_test_inode_bitmap(current_fs->inode_map, newfile)) {
@@ -408,7 +412,7 @@ int write_file(const char *filename, char *contents,
     current_fs->now ? current_fs->now : time(0);
 
   inode.i_links_count = 1;
-  inode.i_size = *size;
+  inode.i_size = size;
 
   if (current_fs->super->s_feature_incompat & EXT3_FEATURE_INCOMPAT_EXTENTS) {
     inode.i_flags |= EXT4_EXTENTS_FL;
@@ -418,9 +422,35 @@ int write_file(const char *filename, char *contents,
   retval = ext2fs_write_new_inode(current_fs, newfile, &inode);
   if (retval) {
     printf("ERR: ext2fs_write_new_inode failed (retval=%d)\n", (int)retval);
-    return retval;
+    goto create_fail;
   }
 
+  *ino = newfile;
+
+ create_fail:
+  free(pathname);
+
+  return retval;
+
+}
+
+/*
+ * write_file()
+ */
+int write_file(const char *filename, char *contents, 
+	       ext2_off_t *size, __u16 i_mode)
+{
+  int got = 0;
+  unsigned int written = 0;
+  char *ptr = NULL;
+  ext2_file_t e2_file;
+  ext2_ino_t newfile;
+  errcode_t retval;
+
+  retval = create_file(filename, *size, i_mode, &newfile);
+  if (retval)
+    return retval;
+
   /* open file for writes */
   retval = ext2fs_file_open(current_fs, newfile,
 			    EXT2_FILE_WRITE, &e2_file);
@@ -451,7 +481,94 @@ int write_file(const char *filename, char *contents,
  write_fail:
   (void) ext2fs_file_close(e2_file);
 
-  free(pathname);
+  return retval;
+}
+
+/*
+ * copy_file()
+ *
+ * Copy src to a new file dst a window at a time, so the file never
+ * has to fit in memory.  Whole blocks go straight between the device
+ * and the window, and the destination is allocated in runs.
+ */
+int copy_file(const char *src, const char *dst, __u16 i_mode)
+{
+  unsigned int got = 0;
+  unsigned int written = 0;
+  char *buf = NULL;
+  char *ptr = NULL;
+  ext2_ino_t ino = 0;
+  ext2_ino_t newfile;
+  ext2_file_t in_file;
+  ext2_file_t out_file;
+  ext2_off_t size;
+  errcode_t retval;
+
+  retval = ext2fs_namei(current_fs, EXT2_ROOT_INO, EXT2_ROOT_INO, 
+			src, &ino);
+  if (retval) {
+    printf("ERR: Can't resolve file %s (ret=%d)\n", src, (int)retval);
+    return retval;
+  }
+
+  retval = ext2fs_file_open(current_fs, ino, 0, &in_file);
+  if (retval) {
+    printf("ERR: Can't open %s (ret=%d)\n", src, (int)retval);
+    return retval;
+  }
+  size = ext2fs_file_get_size(in_file);
+
+  printf("filename: %s (inode=%d) is %ld bytes\n", 
+	 src, ino, (long int)size);
+
+  buf = malloc(COPY_WINDOW);
+  if (!buf) {
+    printf("ERR: can't malloc buffer\n");
+    retval = -1;
+    goto copy_fail;
+  }
+
+  retval = create_file(dst, size, i_mode, &newfile);
+  if (retval)
+    goto copy_fail;
+
+  retval = ext2fs_file_open(current_fs, newfile,
+			    EXT2_FILE_WRITE, &out_file);
+  if (retval) {
+    printf("ERR: ext2fs_file_open failed (retval=%d)\n", (int)retval);
+    goto copy_fail;
+  }
+
+  while (size > 0) {
+    retval = ext2fs_file_read(in_file, buf,
+			      size < COPY_WINDOW ? size : COPY_WINDOW, &got);
+    if (retval) {
+      printf("ERR: Can't read %s (retval=%d)\n", src, (int)retval);
+      break;
+    }
+    if (!got) {
+      printf("ERR: Unexpected end of %s\n", src);
+      retval = -1;
+      break;
+    }
+    size -= got;
+
+    for (ptr = buf; got > 0; ptr += written, got -= written) {
+      retval = ext2fs_file_write(out_file, ptr, got, &written);
+      if (retval) {
+	printf("ERR: ext2fs_file_write failed (retval=%d)\n", (int)retval);
+	break;
+      }
+    }
+    if (retval)
+      break;
+  }
+
+  (void) ext2fs_file_close(out_file);
+
+ copy_fail:
+  (void) ext2fs_file_close(in_file);
+  free(buf);
 
   return retval;
 }
@@ -632,3 +749,104 @@ int delete_file(const char *filename)
 
   return 0;
 }
+
+struct scan_compare_data {
+  ext2_inode_scan classic;
+  ext2_ino_t count;
+  int mismatches;
+};
+
+/*
+ * scan_compare_callback()
+ *
+ * Steps the classic scan along with each batch handed out by
+ * ext2fs_inode_scan_batch(); both have to see the same inodes.
+ */
+static errcode_t scan_compare_callback(ext2_filsys fs EXT2FS_ATTR((unused)),
+				       ext2_ino_t ino,
+				       struct ext2_inode *inodes, int num,
+				       void *priv_data)
+{
+  struct scan_compare_data *data = priv_data;
+  struct ext2_inode inode;
+  ext2_ino_t classic_ino;
+  errcode_t retval;
+  int i;
+
+  for (i = 0; i < num; i++, ino++) {
+    do {
+      retval = ext2fs_get_next_inode(data->classic, &classic_ino, &inode);
+    } while (retval == EXT2_ET_BAD_BLOCK_IN_INODE_TABLE);
+    if (retval) {
+      printf("ERR: classic scan failed at inode %u (ret=%d)\n",
+	     ino, (int)retval);
+      return retval;
+    }
+    if (classic_ino != ino) {
+      printf("ERR: batch scan has inode %u, classic scan %u\n",
+	     ino, classic_ino);
+      return EXT2_ET_NEXT_INODE_READ;
+    }
+    if (memcmp(&inodes[i], &inode, sizeof inode)) {
+      printf("ERR: inode %u differs between the scans\n", ino);
+      data->mismatches++;
+    }
+    data->count++;
+  }
+  return 0;
+}
+
+/*
+ * scan_compare()
+ *
+ * Check ext2fs_inode_scan_batch() against ext2fs_get_next_inode(),
+ * both with an inode buffer of buffer_blocks blocks (0 for the
+ * default).
+ */
+int scan_compare(int buffer_blocks)
+{
+  struct scan_compare_data data;
+  struct ext2_inode inode;
+  ext2_inode_scan scan;
+  ext2_ino_t ino;
+  errcode_t retval;
+
+  memset(&data, 0, sizeof data);
+  retval = ext2fs_open_inode_scan(current_fs, buffer_blocks, &data.classic);
+  if (retval) {
+    printf("ERR: Can't open inode scan (ret=%d)\n", (int)retval);
+    return retval;
+  }
+  retval = ext2fs_open_inode_scan(current_fs, buffer_blocks, &scan);
+  if (retval) {
+    printf("ERR: Can't open inode scan (ret=%d)\n", (int)retval);
+    ext2fs_close_inode_scan(data.classic);
+    return retval;
+  }
+
+  retval = ext2fs_inode_scan_batch(scan, scan_compare_callback, &data);
+  if (retval == EXT2_ET_BAD_BLOCK_IN_INODE_TABLE)
+    retval = 0;
+  if (retval) {
+    printf("ERR: batch scan failed (ret=%d)\n", (int)retval);
+    goto out;
+  }
+
+  /* The classic scan must have nothing left over */
+  do {
+    retval = ext2fs_get_next_inode(data.classic, &ino, &inode);
+  } while (retval == EXT2_ET_BAD_BLOCK_IN_INODE_TABLE);
+  if (!retval && ino) {
+    printf("ERR: classic scan has inode %u past the batch scan\n", ino);
+    retval = EXT2_ET_NEXT_INODE_READ;
+  }
+  if (!retval && data.mismatches)
+    retval = EXT2_ET_NEXT_INODE_READ;
+
+  printf("%u inodes scanned, %d differ\n", data.count, data.mismatches);
+
+ out:
+  ext2fs_close_inode_scan(scan);
+  ext2fs_close_inode_scan(data.classic);
+  return retval;
+}
@@ -41,10 +41,12 @@ int load_file(const char *filename, char **contents,
 	      ext2_off_t *size);
 int write_file(const char *filename, char *contents, 
 	       ext2_off_t *size, __u16 i_mode);
+int copy_file(const char *src, const char *dst, __u16 i_mode);
 int close_fs(int write_changes);
 int mkdir(char *dirname);
 int delete_file(const char *filename);
 int is_dir(const char *filename);
 void display_dir(const char *name);
+int scan_compare(int buffer_blocks);
 
 #endif /* UTIL_H */
@@ -0,0 +1,181 @@
+/*
+ * crcbench.c
+ *
+ * Host check and benchmark for the slice-by-8 CRCs: ext2fs_crc16()
+ * (group descriptor checksums) and the btrfs CRC32C in the core,
+ * including its SSE4.2 path when the CPU has one.  Every
+ * implementation is compared against a bitwise reference on random
+ * buffers, lengths and alignments, then timed on 1 MiB buffers
+ * against the plain byte-at-a-time table loop.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, Inc., 53 Temple Place Ste 330,
+ * Boston MA 02111-1307, USA; either version 2 of the License, or
+ * (at your option) any later version; incorporated herein by reference.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <cpuid.h>
+
+/* The library and core sources are built in, statics and all */
+#include "../../gpllib/e2fsprogs/lib/ext2fs/crc16.c"
+
+/*
+ * crc32c.c is core code; stand in for the com32 headers it uses.
+ * The headers are still found (on the -idirafter path) but their
+ * guards keep them out.
+ */
+#define _DPRINTF_H
+#define _COM32_H
+#define _CPU_H
+#define dprintf(...)	((void)0)
+#define EFLAGS_ID	0x00200000
+
+static bool cpu_has_eflag(uint32_t flag)
+{
+	(void)flag;
+	return true;
+}
+
+static uint32_t cpuid_eax(uint32_t level)
+{
+	unsigned int a, b, c, d;
+
+	__cpuid(level, a, b, c, d);
+	return a;
+}
+
+static uint32_t cpuid_ecx(uint32_t level)
+{
+	unsigned int a, b, c, d;
+
+	__cpuid(level, a, b, c, d);
+	return c;
+}
+
+#include "../../../core/fs/btrfs/crc32c.c"
+
+#define BENCH_LEN	(1024 * 1024)
+#define BENCH_ROUNDS	200
+
+/* Bitwise references */
+static crc16_t ref_crc16(crc16_t crc, const unsigned char *p, size_t len)
+{
+	int i;
+
+	while (len--) {
+		crc ^= *p++;
+		for (i = 0; i < 8; i++)
+			crc = (crc >> 1) ^ ((crc & 1) ? 0xa001 : 0);
+	}
+	return crc;
+}
+
+static uint32_t ref_crc32c(uint32_t crc, const unsigned char *p, size_t len)
+{
+	int i;
+
+	while (len--) {
+		crc ^= *p++;
+		for (i = 0; i < 8; i++)
+			crc = (crc >> 1) ^ ((crc & 1) ? CRC32C_POLY : 0);
+	}
+	return crc;
+}
+
+/* The byte-at-a-time loop the slice-by-8 code replaced */
+static uint32_t crc32c_bytes(uint32_t crc, const char *data, size_t length)
+{
+	const uint8_t *p = (const uint8_t *)data;
+
+	while (length--)
+		crc = crc32c_table[0][(uint8_t)(crc ^ *p++)] ^ (crc >> 8);
+	return crc;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int check(const unsigned char *buf)
+{
+	unsigned int n, off, len;
+	int bad = 0;
+
+	for (n = 0; n < 20000; n++) {
+		off = rand() % 64;
+		len = rand() % 4096;
+
+		if (ext2fs_crc16(n, buf + off, len) !=
+		    ref_crc16(n & 0xffff, buf + off, len))
+			bad++;
+		if (crc32c_sb8(n, (const char *)buf + off, len) !=
+		    ref_crc32c(n, buf + off, len))
+			bad++;
+		if (crc32c_fn == crc32c_sse42 &&
+		    crc32c_sse42(n, (const char *)buf + off, len) !=
+		    ref_crc32c(n, buf + off, len))
+			bad++;
+	}
+	return bad;
+}
+
+#define BENCH(name, expr)						\
+	do {								\
+		double t0 = now(), dt;					\
+		unsigned int crc = 0, r;				\
+									\
+		for (r = 0; r < BENCH_ROUNDS; r++)			\
+			crc = (expr);					\
+		dt = now() - t0;					\
+		printf("  %-24s %8.0f MB/s  (%08x)\n", name,		\
+		       BENCH_ROUNDS * (BENCH_LEN / 1048576.0) / dt, crc); \
+	} while (0)
+
+int main(void)
+{
+	unsigned char *buf;
+	unsigned int i;
+	int bad;
+
+	buf = malloc(BENCH_LEN + 64);
+	if (!buf)
+		return 1;
+	srand(1);
+	for (i = 0; i < BENCH_LEN + 64; i++)
+		buf[i] = rand();
+
+	btrfs_init_crc32c();
+	ext2fs_crc16(0, buf, 0);	/* Build the tables */
+	printf("crc16 slice-by-8 self-test: %s\n",
+	       crc16_sb8_state > 0 ? "ok" : "FAILED");
+	printf("crc32c: using %s\n",
+	       crc32c_fn == crc32c_sse42 ? "SSE4.2" : "slice-by-8");
+
+	bad = check(buf);
+	printf("reference check: %s\n", bad ? "FAILED" : "ok");
+
+	printf("%d x %d KiB:\n", BENCH_ROUNDS, BENCH_LEN / 1024);
+	BENCH("crc16 byte loop", crc16_bytes(crc, buf, BENCH_LEN));
+	BENCH("crc16 slice-by-8", crc16_sb8_update(crc, buf, BENCH_LEN));
+	BENCH("crc32c byte loop",
+	      crc32c_bytes(crc, (const char *)buf, BENCH_LEN));
+	BENCH("crc32c slice-by-8",
+	      crc32c_sb8(crc, (const char *)buf, BENCH_LEN));
+	if (crc32c_fn == crc32c_sse42)
+		BENCH("crc32c SSE4.2",
+		      crc32c_sse42(crc, (const char *)buf, BENCH_LEN));
+
+	free(buf);
+	return bad || crc16_sb8_state < 0;
+}
@@ -16,6 +16,9 @@
 #define _UTIL_H_
 
 #include <com32.h>
+#include <disk/geom.h>
 
 int int13_retry(const com32sys_t * inreg, com32sys_t * outreg);
+int xfer_sectors(const struct driveinfo *, void *, const unsigned long int,
+		 const int, int);
 #endif /* _UTIL_H_ */
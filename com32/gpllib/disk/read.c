@@ -77,73 +77,18 @@ int dev_read(int drive, void *buf, unsigned long int lba, int sectors)
  * @lba:		Position to read
  * @sectors:		Number of sectors to read
  *
+ * Large requests are split into as few BIOS calls as the BIOS and our
+ * bounce buffer allow (see xfer_sectors()).
+ *
  * Return the number of sectors read on success or -1 on failure.
  * errno_disk contains the error number.
  **/
 int read_sectors(struct driveinfo *drive_info, void *data,
 		 const unsigned long int lba, const int sectors)
 {
-    com32sys_t inreg, outreg;
-    struct ebios_dapa *dapa = __com32.cs_bounce;
-    void *buf = (char *)__com32.cs_bounce + sectors * SECTOR;
-    char *bufp = data;
-
 #if 0
     printf("%s data=%p lba=%d count=%d\n", __FUNCTION__, data, lba, sectors);
 #endif    
 
-#if 0    
-    if (get_drive_parameters(drive_info) == -1)
-	return -1;
-#endif
-
-    memset(&inreg, 0, sizeof inreg);
-
-    if (drive_info->ebios) {
-	dapa->len = sizeof(*dapa);
-	dapa->count = sectors;
-	dapa->off = OFFS(buf);
-	dapa->seg = SEG(buf);
-	dapa->lba = lba;
-
-	inreg.esi.w[0] = OFFS(dapa);
-	inreg.ds = SEG(dapa);
-	inreg.edx.b[0] = drive_info->disk;
-	inreg.eax.b[1] = 0x42;	/* Extended read */
-    } else {
-	unsigned int c, h, s;
-
-	if (!drive_info->cbios) {	// XXX errno
-	    /* We failed to get the geometry */
-	    if (lba)
-		return -1;	/* Can only read MBR */
-
-	    s = 1;
-	    h = 0;
-	    c = 0;
-	} else
-	    lba_to_chs(drive_info, lba, &s, &h, &c);
-
-	// XXX errno
-	if (s > 63 || h > 256 || c > 1023)
-	    return -1;
-
-	inreg.eax.w[0] = 0x0201;	/* Read one sector */
-	inreg.ecx.b[1] = c & 0xff;
-	inreg.ecx.b[0] = s + (c >> 6);
-	inreg.edx.b[1] = h;
-	inreg.edx.b[0] = drive_info->disk;
-	inreg.ebx.w[0] = OFFS(buf);
-	inreg.es = SEG(buf);
-    }
-
-    /* Perform the read */
-    if (int13_retry(&inreg, &outreg)) {
-	errno_disk = outreg.eax.b[1];
-	return -1;		/* Give up */
-    }
-
-    memcpy(bufp, buf, sectors * SECTOR);
-
-    return sectors;
+    return xfer_sectors(drive_info, data, lba, sectors, 0);
 }
@@ -13,12 +13,25 @@
  * ----------------------------------------------------------------------- */
 
 #include <com32.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <disk/common.h>
+#include <disk/errno_disk.h>
 #include <disk/geom.h>
+#include <disk/util.h>
 
 #define MAX_NB_RETRIES 6
 
+/*
+ * Many BIOSes refuse EDD transfers of more than 127 sectors, so that
+ * is the most we ask for in one call.
+ */
+#define EDD_MAX_SECTORS 127
+
+/* Conventional memory, addressable by the BIOS as SEG:OFFS */
+#define LOWMEM_END 0xa0000
+
 /**
  * int13_retry - int13h with error handling
  * @inreg:	int13h function parameters
@@ -43,3 +56,129 @@ int int13_retry(const com32sys_t * inreg, com32sys_t * outreg)
     /* If we get here: error */
     return -1;
 }
+
+/*
+ * Sectors per track, as lba_to_chs() sees it
+ */
+static unsigned int chs_sectors_per_track(const struct driveinfo *drive_info)
+{
+    if (drive_info->edd_params.sectors_per_track > 0 &&
+	drive_info->edd_params.heads > 0)
+	return drive_info->edd_params.sectors_per_track;
+    return drive_info->legacy_sectors_per_track;
+}
+
+/**
+ * xfer_sectors - read or write sectors with as few int13h calls as possible
+ * @drive_info:		driveinfo struct describing the disk
+ * @data:		Buffer to read into or write from
+ * @lba:		Position to start at
+ * @sectors:		Number of sectors to transfer
+ * @write:		Non-zero to write, zero to read
+ *
+ * The request is split into chunks no larger than EDD_MAX_SECTORS, or
+ * than the rest of the track when we have to fall back to C/H/S.  A
+ * chunk whose buffer lies in conventional memory (and doesn't cross a
+ * 64K boundary) is handed to the BIOS as is; anything else goes
+ * through __com32.cs_bounce, behind the EDD packet.
+ *
+ * Return the number of sectors transferred on success or -1 on failure.
+ * errno_disk contains the error number.
+ **/
+int xfer_sectors(const struct driveinfo *drive_info, void *data,
+		 const unsigned long int lba, const int sectors, int write)
+{
+    com32sys_t inreg, outreg;
+    struct ebios_dapa *dapa = __com32.cs_bounce;
+    char *bounce = (char *)__com32.cs_bounce + SECTOR;
+    int bounce_max = (__com32.cs_bounce_size - SECTOR) / SECTOR;
+    char *bufp = data;
+    unsigned long int cur = lba;
+    int left = sectors;
+
+    if (bounce_max > EDD_MAX_SECTORS)
+	bounce_max = EDD_MAX_SECTORS;
+
+    while (left > 0) {
+	unsigned int c = 0, h = 0, s = 1;
+	uintptr_t addr = (uintptr_t) bufp;
+	int count = left;
+	char *buf;
+
+	if (count > EDD_MAX_SECTORS)
+	    count = EDD_MAX_SECTORS;
+
+	if (!drive_info->ebios) {
+	    if (!drive_info->cbios) {	// XXX errno
+		/* We failed to get the geometry */
+		if (cur)
+		    return -1;	/* Can only access the MBR */
+		count = 1;
+	    } else {
+		lba_to_chs(drive_info, cur, &s, &h, &c);
+		/* Multi-sector C/H/S transfers stop at the end of the track */
+		if (count > (int)(chs_sectors_per_track(drive_info) - s + 1))
+		    count = chs_sectors_per_track(drive_info) - s + 1;
+	    }
+
+	    // XXX errno
+	    if (s > 63 || h > 256 || c > 1023)
+		return -1;
+	}
+
+	/* Can the BIOS DMA straight to/from the caller's buffer? */
+	if (addr + SECTOR <= LOWMEM_END &&
+	    (addr & 0xffff) + SECTOR <= 0x10000) {
+	    if (addr + count * SECTOR > LOWMEM_END)
+		count = (LOWMEM_END - addr) / SECTOR;
+	    if ((addr & 0xffff) + count * SECTOR > 0x10000)
+		count = (0x10000 - (addr & 0xffff)) / SECTOR;
+	    buf = bufp;
+	} else {
+	    if (count > bounce_max)
+		count = bounce_max;
+	    buf = bounce;
+	    if (write)
+		memcpy(buf, bufp, count * SECTOR);
+	}
+
+	memset(&inreg, 0, sizeof inreg);
+
+	if (drive_info->ebios) {
+	    dapa->len = sizeof(*dapa);
+	    dapa->count = count;
+	    dapa->off = OFFS(buf);
+	    dapa->seg = SEG(buf);
+	    dapa->lba = cur;
+
+	    inreg.esi.w[0] = OFFS(dapa);
+	    inreg.ds = SEG(dapa);
+	    inreg.edx.b[0] = drive_info->disk;
+	    inreg.eax.b[1] = write ? 0x43 : 0x42;	/* Extended write/read */
+	} else {
+	    inreg.eax.b[0] = count;
+	    inreg.eax.b[1] = write ? 0x03 : 0x02;	/* Write/Read sectors */
+	    inreg.ecx.b[1] = c & 0xff;
+	    inreg.ecx.b[0] = s + (c >> 6);
+	    inreg.edx.b[1] = h;
+	    inreg.edx.b[0] = drive_info->disk;
+	    inreg.ebx.w[0] = OFFS(buf);
+	    inreg.es = SEG(buf);
+	}
+
+	/* Perform the transfer */
+	if (int13_retry(&inreg, &outreg)) {
+	    errno_disk = outreg.eax.b[1];
+	    return -1;		/* Give up */
+	}
+
+	if (!write && buf != bufp)
+	    memcpy(bufp, buf, count * SECTOR);
+
+	bufp += count * SECTOR;
+	cur += count;
+	left -= count;
+    }
+
+    return sectors;
+}
@@ -55,61 +55,11 @@ int dev_write(int drive, const void *buf, unsigned long int lba, int sectors)
 int write_sectors(const struct driveinfo *drive_info, const unsigned long int lba,
 		  const void *data, const int size)
 {
-    com32sys_t inreg, outreg;
-    struct ebios_dapa *dapa = __com32.cs_bounce;
-    void *buf = (char *)__com32.cs_bounce + (size * SECTOR);
-
     if (get_drive_parameters((struct driveinfo *)drive_info) == -1) {
       return -1;
     }
 
-    memcpy(buf, data, (size * SECTOR));
-    memset(&inreg, 0, sizeof inreg);
-
-    if (drive_info->ebios) {
-	dapa->len = sizeof(*dapa);
-	dapa->count = size;
-	dapa->off = OFFS(buf);
-	dapa->seg = SEG(buf);
-	dapa->lba = lba;
-
-	inreg.esi.w[0] = OFFS(dapa);
-	inreg.ds = SEG(dapa);
-	inreg.edx.b[0] = drive_info->disk;
-	inreg.eax.w[0] = 0x4300;	/* Extended write */
-    } else {
-	unsigned int c, h, s;
-
-	if (!drive_info->cbios) {	// XXX errno
-	    /* We failed to get the geometry */
-	    if (lba)
-		return -1;	/* Can only write MBR */
-
-	    s = 1;
-	    h = 0;
-	    c = 0;
-	} else
-	    lba_to_chs(drive_info, lba, &s, &h, &c);
-
-	// XXX errno
-	if (s > 63 || h > 256 || c > 1023)
-	    return -1;
-
-	inreg.eax.w[0] = 0x0301;	/* Write one sector */
-	inreg.ecx.b[1] = c & 0xff;
-	inreg.ecx.b[0] = s + (c >> 6);
-	inreg.edx.b[1] = h;
-	inreg.edx.b[0] = drive_info->disk;
-	inreg.ebx.w[0] = OFFS(buf);
-	inreg.es = SEG(buf);
-    }
-
-    /* Perform the write */
-    if (int13_retry(&inreg, &outreg)) {
-	errno_disk = outreg.eax.b[1];
-	return -1;		/* Give up */
-    } else
-	return size;
+    return xfer_sectors(drive_info, (void *)data, lba, size, 1);
 }
 
 /**
@@ -26,14 +26,32 @@
 #include "ext2_fs.h"
 #include "ext2fs.h"
 
+/*
+ * Mark the part of [blk, blk+num) which lies inside [first, last]
+ */
+static void mark_group_range(ext2fs_block_bitmap map, blk_t first,
+			     blk_t last, blk_t blk, blk_t num)
+{
+	blk_t	end;
+
+	if (!blk || !num || blk > last || blk + num - 1 < first)
+		return;
+	end = blk + num - 1;
+	if (blk < first)
+		blk = first;
+	if (end > last)
+		end = last;
+	ext2fs_mark_block_bitmap_range(map, blk, end - blk + 1);
+}
+
 /*
  * Check for uninit block bitmaps and deal with them appropriately
  */
 static void check_block_uninit(ext2_filsys fs, ext2fs_block_bitmap map,
 			  dgrp_t group)
 {
-	blk_t		i;
-	blk_t		blk, super_blk, old_desc_blk, new_desc_blk;
+	blk_t		first, last;
+	blk_t		super_blk, old_desc_blk, new_desc_blk;
 	int		old_desc_blocks;
 
 	if (!(EXT2_HAS_RO_COMPAT_FEATURE(fs->super,
@@ -41,8 +59,11 @@ static void check_block_uninit(ext2_filsys fs, ext2fs_block_bitmap map,
 	    !(fs->group_desc[group].bg_flags & EXT2_BG_BLOCK_UNINIT))
 		return;
 
-	blk = (group * fs->super->s_blocks_per_group) +
+	first = (group * fs->super->s_blocks_per_group) +
 		fs->super->s_first_data_block;
+	last = first + fs->super->s_blocks_per_group - 1;
+	if (last > ext2fs_get_block_bitmap_end(map))
+		last = ext2fs_get_block_bitmap_end(map);
 
 	ext2fs_super_and_bgd_loc(fs, group, &super_blk,
 				 &old_desc_blk, &new_desc_blk, 0);
@@ -53,21 +74,18 @@ static void check_block_uninit(ext2_filsys fs, ext2fs_block_bitmap map,
 	else
 		old_desc_blocks = fs->desc_blocks + fs->super->s_reserved_gdt_blocks;
 
-	for (i=0; i < fs->super->s_blocks_per_group; i++, blk++) {
-		if ((blk == super_blk) ||
-		    (old_desc_blk && old_desc_blocks &&
-		     (blk >= old_desc_blk) &&
-		     (blk < old_desc_blk + old_desc_blocks)) ||
-		    (new_desc_blk && (blk == new_desc_blk)) ||
-		    (blk == fs->group_desc[group].bg_block_bitmap) ||
-		    (blk == fs->group_desc[group].bg_inode_bitmap) ||
-		    (blk >= fs->group_desc[group].bg_inode_table &&
-		     (blk < fs->group_desc[group].bg_inode_table
-		      + fs->inode_blocks_per_group)))
-			ext2fs_fast_mark_block_bitmap(map, blk);
-		else
-			ext2fs_fast_unmark_block_bitmap(map, blk);
-	}
+	ext2fs_unmark_block_bitmap_range(map, first, last - first + 1);
+	mark_group_range(map, first, last, super_blk, 1);
+	mark_group_range(map, first, last, old_desc_blk, old_desc_blocks);
+	mark_group_range(map, first, last, new_desc_blk, 1);
+	mark_group_range(map, first, last,
+			 fs->group_desc[group].bg_block_bitmap, 1);
+	mark_group_range(map, first, last,
+			 fs->group_desc[group].bg_inode_bitmap, 1);
+	mark_group_range(map, first, last,
+			 fs->group_desc[group].bg_inode_table,
+			 fs->inode_blocks_per_group);
+
 	fs->group_desc[group].bg_flags &= ~EXT2_BG_BLOCK_UNINIT;
 	ext2fs_group_desc_csum_set(fs, group);
 }
@@ -78,16 +96,14 @@ static void check_block_uninit(ext2_filsys fs, ext2fs_block_bitmap map,
 static void check_inode_uninit(ext2_filsys fs, ext2fs_inode_bitmap map,
 			  dgrp_t group)
 {
-	ext2_ino_t	i, ino;
-
 	if (!(EXT2_HAS_RO_COMPAT_FEATURE(fs->super,
 					 EXT4_FEATURE_RO_COMPAT_GDT_CSUM)) ||
 	    !(fs->group_desc[group].bg_flags & EXT2_BG_INODE_UNINIT))
 		return;
 
-	ino = (group * fs->super->s_inodes_per_group) + 1;
-	for (i=0; i < fs->super->s_inodes_per_group; i++, ino++)
-		ext2fs_fast_unmark_inode_bitmap(map, ino);
+	ext2fs_unmark_inode_bitmap_range(map,
+			(group * fs->super->s_inodes_per_group) + 1,
+			fs->super->s_inodes_per_group);
 
 	fs->group_desc[group].bg_flags &= ~EXT2_BG_INODE_UNINIT;
 	check_block_uninit(fs, fs->block_map, group);
@@ -104,8 +120,9 @@ errcode_t ext2fs_new_inode(ext2_filsys fs, ext2_ino_t dir,
 			   ext2fs_inode_bitmap map, ext2_ino_t *ret)
 {
 	ext2_ino_t	dir_group = 0;
-	ext2_ino_t	i;
+	ext2_ino_t	i, end;
 	ext2_ino_t	start_inode;
+	dgrp_t		group, count;
 
 	EXT2_CHECK_MAGIC(fs, EXT2_ET_MAGIC_EXT2FS_FILSYS);
 
@@ -124,32 +141,37 @@ errcode_t ext2fs_new_inode(ext2_filsys fs, ext2_ino_t dir,
 		return EXT2_ET_INODE_ALLOC_FAIL;
 	i = start_inode;
 
-	do {
-		if (((i - 1) % EXT2_INODES_PER_GROUP(fs->super)) == 0)
-			check_inode_uninit(fs, map, (i - 1) /
-					   EXT2_INODES_PER_GROUP(fs->super));
-
-		if (!ext2fs_fast_test_inode_bitmap(map, i))
-			break;
-		i++;
+	/*
+	 * Search a group at a time; the starting group is visited
+	 * twice so the part below start_inode is covered on wrap.
+	 */
+	for (count = 0; count <= fs->group_desc_count; count++) {
+		group = (i - 1) / EXT2_INODES_PER_GROUP(fs->super);
+		check_inode_uninit(fs, map, group);
+
+		end = (group + 1) * EXT2_INODES_PER_GROUP(fs->super);
+		if (end > fs->super->s_inodes_count)
+			end = fs->super->s_inodes_count;
+		if (!ext2fs_find_first_zero_inode_bitmap(map, i, end, &i)) {
+			*ret = i;
+			return 0;
+		}
+		i = end + 1;
 		if (i > fs->super->s_inodes_count)
 			i = EXT2_FIRST_INODE(fs->super);
-	} while (i != start_inode);
-
-	if (ext2fs_test_inode_bitmap(map, i))
-		return EXT2_ET_INODE_ALLOC_FAIL;
-	*ret = i;
-	return 0;
+	}
+	return EXT2_ET_INODE_ALLOC_FAIL;
 }
 
 /*
- * Stupid algorithm --- we now just search forward starting from the
- * goal.  Should put in a smarter one someday....
+ * Search forward from the goal a block group at a time for the
+ * first free block.
  */
 errcode_t ext2fs_new_block(ext2_filsys fs, blk_t goal,
 			   ext2fs_block_bitmap map, blk_t *ret)
 {
-	blk_t	i;
+	blk_t	i, end;
+	dgrp_t	group, count;
 
 	EXT2_CHECK_MAGIC(fs, EXT2_ET_MAGIC_EXT2FS_FILSYS);
 
@@ -160,24 +182,28 @@ errcode_t ext2fs_new_block(ext2_filsys fs, blk_t goal,
 	if (!goal || (goal >= fs->super->s_blocks_count))
 		goal = fs->super->s_first_data_block;
 	i = goal;
-	check_block_uninit(fs, map,
-			   (i - fs->super->s_first_data_block) /
-			   EXT2_BLOCKS_PER_GROUP(fs->super));
-	do {
-		if (((i - fs->super->s_first_data_block) %
-		     EXT2_BLOCKS_PER_GROUP(fs->super)) == 0)
-			check_block_uninit(fs, map,
-					   (i - fs->super->s_first_data_block) /
-					   EXT2_BLOCKS_PER_GROUP(fs->super));
 
-		if (!ext2fs_fast_test_block_bitmap(map, i)) {
+	/*
+	 * The goal's group is visited twice so the part below the
+	 * goal is covered on wrap.
+	 */
+	for (count = 0; count <= fs->group_desc_count; count++) {
+		group = (i - fs->super->s_first_data_block) /
+			EXT2_BLOCKS_PER_GROUP(fs->super);
+		check_block_uninit(fs, map, group);
+
+		end = fs->super->s_first_data_block +
+			(group + 1) * EXT2_BLOCKS_PER_GROUP(fs->super) - 1;
+		if (end >= fs->super->s_blocks_count)
+			end = fs->super->s_blocks_count - 1;
+		if (!ext2fs_find_first_zero_block_bitmap(map, i, end, &i)) {
 			*ret = i;
 			return 0;
 		}
-		i++;
+		i = end + 1;
 		if (i >= fs->super->s_blocks_count)
 			i = fs->super->s_first_data_block;
-	} while (i != goal);
+	}
 	return EXT2_ET_BLOCK_ALLOC_FAIL;
 }
 
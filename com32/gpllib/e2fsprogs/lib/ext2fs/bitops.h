@@ -121,6 +121,26 @@ extern int ext2fs_test_block_bitmap_range(ext2fs_block_bitmap bitmap,
 					  blk_t block, int num);
 extern __u32 ext2fs_get_generic_bitmap_start(ext2fs_generic_bitmap bitmap);
 extern __u32 ext2fs_get_generic_bitmap_end(ext2fs_generic_bitmap bitmap);
+extern void ext2fs_mark_inode_bitmap_range(ext2fs_inode_bitmap bitmap,
+					   ext2_ino_t inode, int num);
+extern void ext2fs_unmark_inode_bitmap_range(ext2fs_inode_bitmap bitmap,
+					     ext2_ino_t inode, int num);
+extern errcode_t ext2fs_find_first_zero_generic_bitmap(ext2fs_generic_bitmap bitmap,
+						       __u32 start, __u32 end,
+						       __u32 *out);
+extern errcode_t ext2fs_find_first_set_generic_bitmap(ext2fs_generic_bitmap bitmap,
+						      __u32 start, __u32 end,
+						      __u32 *out);
+extern errcode_t ext2fs_find_first_zero_block_bitmap(ext2fs_block_bitmap bitmap,
+						     blk_t start, blk_t end,
+						     blk_t *out);
+extern errcode_t ext2fs_find_first_set_block_bitmap(ext2fs_block_bitmap bitmap,
+						    blk_t start, blk_t end,
+						    blk_t *out);
+extern errcode_t ext2fs_find_first_zero_inode_bitmap(ext2fs_inode_bitmap bitmap,
+						     ext2_ino_t start,
+						     ext2_ino_t end,
+						     ext2_ino_t *out);
 
 /*
  * The inline routines themselves...
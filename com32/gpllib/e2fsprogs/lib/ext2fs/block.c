@@ -446,6 +446,8 @@ errcode_t ext2fs_block_iterate2(ext2_filsys fs,
 				if (ret & BLOCK_ABORT)
 					break;
 			}
+			if (ret & BLOCK_ABORT)
+				break;
 		}
 
 	extent_errout:
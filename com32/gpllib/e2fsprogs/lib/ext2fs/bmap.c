@@ -317,6 +317,219 @@ done:
 	return retval;
 }
 
+/*
+ * Find the array of block pointers that maps logical block block of a
+ * block mapped file: the direct pointers in the inode, or the
+ * indirect block holding it, which is read into block_buf.  *entries
+ * points at the entry for block and *nr is the number of entries from
+ * there to the end of the array.  If an indirect block on the way is
+ * missing, *entries is NULL and *nr is the number of blocks in the
+ * hole it leaves, from block on.
+ */
+static errcode_t ind_block_entries(ext2_filsys fs, struct ext2_inode *inode,
+				   char *block_buf, blk64_t block,
+				   blk_t **entries, blk64_t *nr, int *swab)
+{
+	blk64_t		addr_per_block = fs->blocksize >> 2;
+	blk64_t		span;
+	blk_t		b;
+	int		levels;
+	errcode_t	retval;
+
+	*entries = NULL;
+	*swab = 0;
+	if (block < EXT2_NDIR_BLOCKS) {
+		*entries = inode->i_block + block;
+		*nr = EXT2_NDIR_BLOCKS - block;
+		return 0;
+	}
+
+	block -= EXT2_NDIR_BLOCKS;
+	span = addr_per_block;
+	b = inode_bmap(inode, EXT2_IND_BLOCK);
+	levels = 1;
+	if (block >= span) {
+		block -= span;
+		span *= addr_per_block;
+		b = inode_bmap(inode, EXT2_DIND_BLOCK);
+		levels = 2;
+		if (block >= span) {
+			block -= span;
+			span *= addr_per_block;
+			b = inode_bmap(inode, EXT2_TIND_BLOCK);
+			levels = 3;
+			if (block >= span) {
+				*nr = ~(blk_t)0;	/* Past the end */
+				return 0;
+			}
+		}
+	}
+
+	/* span is the number of blocks mapped under b */
+	for (;;) {
+		if (!b) {
+			*nr = span - block;
+			return 0;
+		}
+		retval = io_channel_read_blk(fs->io, b, 1, block_buf);
+		if (retval)
+			return retval;
+		if (--levels == 0)
+			break;
+		span /= addr_per_block;
+		b = ((blk_t *) block_buf)[block / span];
+#ifdef WORDS_BIGENDIAN
+		b = ext2fs_swab32(b);
+#endif
+		block %= span;
+	}
+
+	*entries = (blk_t *) block_buf + block;
+	*nr = addr_per_block - block;
+#ifdef WORDS_BIGENDIAN
+	*swab = 1;
+#endif
+	return 0;
+}
+
+/*
+ * Map a run of logical blocks starting at block.  *phys_blk is set
+ * to the physical block backing block (0 for a hole), and *ret_count
+ * to the number of blocks, at most max_count, from block on which
+ * are physically contiguous and have the same BMAP_RET_UNINIT state,
+ * or for a hole, the number of blocks up to the next mapped one.
+ */
+errcode_t ext2fs_bmap_run(ext2_filsys fs, ext2_ino_t ino,
+			  struct ext2_inode *inode, char *block_buf,
+			  blk64_t block, blk_t max_count,
+			  int *ret_flags, blk64_t *phys_blk,
+			  blk_t *ret_count)
+{
+	struct ext2_inode inode_buf;
+	ext2_extent_handle_t handle;
+	struct ext2fs_extent extent;
+	blk64_t		next, nr, i;
+	blk_t		count = 1;
+	blk_t		*entries;
+	char		*buf = 0;
+	int		flags = 0, next_flags, swab;
+	errcode_t	retval;
+
+	*ret_count = 0;
+	*phys_blk = 0;
+	if (ret_flags)
+		*ret_flags = 0;
+	if (!max_count)
+		return 0;
+
+	if (!inode) {
+		retval = ext2fs_read_inode(fs, ino, &inode_buf);
+		if (retval)
+			return retval;
+		inode = &inode_buf;
+	}
+
+	if (!(inode->i_flags & EXT4_EXTENTS_FL)) {
+		/*
+		 * Block mapped files: read each indirect block on the
+		 * way once, and scan its entries while the blocks stay
+		 * contiguous.
+		 */
+		if (!block_buf) {
+			retval = ext2fs_get_mem(fs->blocksize, &buf);
+			if (retval)
+				return retval;
+			block_buf = buf;
+		}
+		count = 0;
+		while (count < max_count) {
+			retval = ind_block_entries(fs, inode, block_buf,
+						   block + count, &entries,
+						   &nr, &swab);
+			if (retval)
+				goto ind_done;
+			if (nr > max_count - count)
+				nr = max_count - count;
+			for (i = 0; i < nr; i++, count++) {
+				next = entries ? entries[i] : 0;
+#ifdef WORDS_BIGENDIAN
+				if (swab)
+					next = ext2fs_swab32(next);
+#endif
+				if (!count)
+					*phys_blk = next;
+				else if (*phys_blk ? (next != *phys_blk + count)
+					 : next)
+					goto ind_done;
+			}
+		}
+	ind_done:
+		if (buf)
+			ext2fs_free_mem(&buf);
+		if (retval)
+			return retval;
+		*ret_count = count;
+		return 0;
+	}
+
+	retval = ext2fs_extent_open2(fs, ino, inode, &handle);
+	if (retval)
+		return retval;
+
+	retval = ext2fs_extent_goto(handle, block);
+	if (retval) {
+		if (retval != EXT2_ET_EXTENT_NOT_FOUND)
+			goto done;
+		/*
+		 * A hole: the handle is left on the extent before it
+		 * (or after it, if the hole is at the start of the file).
+		 */
+		retval = 0;
+		count = max_count;
+		if (ext2fs_extent_get(handle, EXT2_EXTENT_CURRENT, &extent))
+			goto hole;
+		if (extent.e_lblk <= block &&
+		    ext2fs_extent_get(handle, EXT2_EXTENT_NEXT_LEAF, &extent))
+			goto hole;
+		if (extent.e_lblk > block && extent.e_lblk - block < count)
+			count = extent.e_lblk - block;
+	hole:
+		*ret_count = count;
+		goto done;
+	}
+	retval = ext2fs_extent_get(handle, EXT2_EXTENT_CURRENT, &extent);
+	if (retval)
+		goto done;
+
+	*phys_blk = extent.e_pblk + (block - extent.e_lblk);
+	if (extent.e_flags & EXT2_EXTENT_FLAGS_UNINIT)
+		flags |= BMAP_RET_UNINIT;
+	count = extent.e_lblk + extent.e_len - block;
+
+	/* Extents are at most 32768 blocks; keep going while they abut */
+	while (count < max_count) {
+		if (ext2fs_extent_get(handle, EXT2_EXTENT_NEXT_LEAF, &extent))
+			break;
+		next_flags = (extent.e_flags & EXT2_EXTENT_FLAGS_UNINIT) ?
+			BMAP_RET_UNINIT : 0;
+		if (extent.e_lblk != block + count ||
+		    extent.e_pblk != *phys_blk + count ||
+		    next_flags != flags)
+			break;
+		count += extent.e_len;
+	}
+
+	if (count > max_count)
+		count = max_count;
+	*ret_count = count;
+	if (ret_flags)
+		*ret_flags = flags;
+
+done:
+	ext2fs_extent_free(handle);
+	return retval;
+}
+
 errcode_t ext2fs_bmap(ext2_filsys fs, ext2_ino_t ino, struct ext2_inode *inode,
 		      char *block_buf, int bmap_flags, blk_t block,
 		      blk_t *phys_blk)
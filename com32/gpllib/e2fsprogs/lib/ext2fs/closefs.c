@@ -195,8 +195,9 @@ void ext2fs_update_dynamic_rev(ext2_filsys fs)
 	/* other fields should be left alone */
 }
 
-static errcode_t write_backup_super(ext2_filsys fs, dgrp_t group,
-				    blk_t group_block,
+static errcode_t write_backup_super(ext2_filsys fs,
+				    struct ext2_flush_plan *plan,
+				    dgrp_t group, blk_t group_block,
 				    struct ext2_super_block *super_shadow)
 {
 	dgrp_t	sgrp = group;
@@ -209,8 +210,23 @@ static errcode_t write_backup_super(ext2_filsys fs, dgrp_t group,
 	fs->super->s_block_group_nr = sgrp;
 #endif
 
-	return io_channel_write_blk(fs->io, group_block, -SUPERBLOCK_SIZE,
-				    super_shadow);
+	return ext2fs_flush_plan_add(plan, group_block, -SUPERBLOCK_SIZE,
+				     super_shadow, 1);
+}
+
+/*
+ * With EXT2_FLAG_SAMPLE_BACKUPS only the first and the last backup
+ * copies of the superblock and descriptors are rewritten; they are
+ * the ones e2fsck and the kernel look for.
+ */
+static dgrp_t last_backup_group(ext2_filsys fs)
+{
+	dgrp_t	group;
+
+	for (group = fs->group_desc_count - 1; group > 1; group--)
+		if (ext2fs_bg_has_super(fs, group))
+			break;
+	return group;
 }
 
 
@@ -228,6 +244,9 @@ errcode_t ext2fs_flush(ext2_filsys fs)
 #endif
 	char	*group_ptr;
 	int	old_desc_blocks;
+	struct ext2_flush_plan plan;
+	dgrp_t	last_backup = 0;
+	int	sampled;
 
 	EXT2_CHECK_MAGIC(fs, EXT2_ET_MAGIC_EXT2FS_FILSYS);
 
@@ -236,6 +255,7 @@ errcode_t ext2fs_flush(ext2_filsys fs)
 
 	fs->super->s_wtime = fs->now ? fs->now : time(NULL);
 	fs->super->s_block_group_nr = 0;
+	memset(&plan, 0, sizeof(plan));
 #ifdef WORDS_BIGENDIAN
 	retval = EXT2_ET_NO_MEMORY;
 	retval = ext2fs_get_mem(SUPERBLOCK_SIZE, &super_shadow);
@@ -281,8 +301,14 @@ errcode_t ext2fs_flush(ext2_filsys fs)
 
 	/*
 	 * Write out the master group descriptors, and the backup
-	 * superblocks and group descriptors.
+	 * superblocks and group descriptors.  The writes are queued on
+	 * a flush plan and issued in block order once all are known.
 	 */
+	retval = ext2fs_flush_plan_init(fs, &plan);
+	if (retval)
+		goto errout;
+	if (fs->flags & EXT2_FLAG_SAMPLE_BACKUPS)
+		last_backup = last_backup_group(fs);
 	group_ptr = (char *) group_shadow;
 	if (fs->super->s_feature_incompat & EXT2_FEATURE_INCOMPAT_META_BG)
 		old_desc_blocks = fs->super->s_first_meta_bg;
@@ -295,9 +321,12 @@ errcode_t ext2fs_flush(ext2_filsys fs)
 
 		ext2fs_super_and_bgd_loc(fs, i, &super_blk, &old_desc_blk,
 					 &new_desc_blk, &meta_bg);
+		sampled = !(fs->flags & EXT2_FLAG_SAMPLE_BACKUPS) ||
+			i == 1 || i == last_backup;
 
-		if (!(fs->flags & EXT2_FLAG_MASTER_SB_ONLY) &&i && super_blk) {
-			retval = write_backup_super(fs, i, super_blk,
+		if (!(fs->flags & EXT2_FLAG_MASTER_SB_ONLY) &&i && super_blk &&
+		    sampled) {
+			retval = write_backup_super(fs, &plan, i, super_blk,
 						    super_shadow);
 			if (retval)
 				goto errout;
@@ -305,19 +334,24 @@ errcode_t ext2fs_flush(ext2_filsys fs)
 		if (fs->flags & EXT2_FLAG_SUPER_ONLY)
 			continue;
 		if ((old_desc_blk) &&
-		    (!(fs->flags & EXT2_FLAG_MASTER_SB_ONLY) || (i == 0))) {
-			retval = io_channel_write_blk(fs->io,
-			      old_desc_blk, old_desc_blocks, group_ptr);
+		    ((!(fs->flags & EXT2_FLAG_MASTER_SB_ONLY) && sampled) ||
+		     (i == 0))) {
+			retval = ext2fs_flush_plan_add(&plan, old_desc_blk,
+					old_desc_blocks, group_ptr, 0);
 			if (retval)
 				goto errout;
 		}
-		if (new_desc_blk) {
-			retval = io_channel_write_blk(fs->io, new_desc_blk,
-				1, group_ptr + (meta_bg*fs->blocksize));
+		if (new_desc_blk &&
+		    (sampled || !(i % EXT2_DESC_PER_BLOCK(fs->super)))) {
+			retval = ext2fs_flush_plan_add(&plan, new_desc_blk, 1,
+				group_ptr + (meta_bg*fs->blocksize), 0);
 			if (retval)
 				goto errout;
 		}
 	}
+	retval = ext2fs_flush_plan_submit(&plan);
+	if (retval)
+		goto errout;
 
 	/*
 	 * If the write_bitmaps() function is present, call it to
@@ -357,6 +391,7 @@ write_primary_superblock_only:
 
 	retval = io_channel_flush(fs->io);
 errout:
+	ext2fs_flush_plan_free(&plan);
 	fs->super->s_state = fs_state;
 #ifdef WORDS_BIGENDIAN
 	if (super_shadow)
@@ -39,6 +39,7 @@ errcode_t ext2fs_dup_handle(ext2_filsys src, ext2_filsys *dest)
 	fs->block_map = 0;
 	fs->badblocks = 0;
 	fs->dblist = 0;
+	fs->dcache = 0;
 
 	io_channel_bumpcount(fs->io);
 	if (fs->icache)
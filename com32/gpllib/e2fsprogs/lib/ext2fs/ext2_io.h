@@ -117,7 +117,16 @@ extern io_manager unix_io_manager;
 
 #if defined(HAVE_SYSLINUX_BUILD)
 /* syslinuxio.c */
+struct syslinux_cache_stats {
+	unsigned long	hits;		/* blocks served from the cache */
+	unsigned long	misses;		/* blocks read from disk */
+	unsigned long	writebacks;	/* dirty blocks written to disk */
+	unsigned long	evictions;	/* blocks dropped to make room */
+};
+
 extern io_manager syslinux_io_manager;
+extern errcode_t syslinux_get_cache_stats(io_channel channel,
+					  struct syslinux_cache_stats *stats);
 #endif /* defined(HAVE_SYSLINUX_BUILD) */
 
 /* undo_io.c */
@@ -180,6 +180,8 @@ typedef struct ext2_file *ext2_file_t;
 #define EXT2_FLAG_EXCLUSIVE		0x4000
 #define EXT2_FLAG_SOFTSUPP_FEATURES	0x8000
 #define EXT2_FLAG_NOFREE_ON_ERROR	0x10000
+#define EXT2_FLAG_LAZY_BITMAPS		0x20000
+#define EXT2_FLAG_SAMPLE_BACKUPS	0x40000
 
 /*
  * Special flag in the ext2 inode i_flag field that means that this is
@@ -243,6 +245,11 @@ struct struct_ext2_filsys {
 	struct ext2_inode_cache		*icache;
 	io_channel			image_io;
 
+	/*
+	 * Directory entry cache used by ext2fs_namei()
+	 */
+	struct ext2_dentry_cache	*dcache;
+
 	/*
 	 * More callback functions
 	 */
@@ -329,6 +336,7 @@ struct ext2fs_extent {
 
 typedef struct ext2_extent_handle *ext2_extent_handle_t;
 typedef struct ext2_extent_path *ext2_extent_path_t;
+typedef struct ext2_extent_builder *ext2_extent_builder_t;
 
 /*
  * Flags used by ext2fs_extent_get()
@@ -726,6 +734,11 @@ extern errcode_t ext2fs_bmap2(ext2_filsys fs, ext2_ino_t ino,
 			      struct ext2_inode *inode,
 			      char *block_buf, int bmap_flags, blk64_t block,
 			      int *ret_flags, blk64_t *phys_blk);
+extern errcode_t ext2fs_bmap_run(ext2_filsys fs, ext2_ino_t ino,
+				 struct ext2_inode *inode, char *block_buf,
+				 blk64_t block, blk_t max_count,
+				 int *ret_flags, blk64_t *phys_blk,
+				 blk_t *ret_count);
 
 #if 0
 /* bmove.c */
@@ -876,6 +889,16 @@ extern errcode_t ext2fs_extent_get_info(ext2_extent_handle_t handle,
 					struct ext2_extent_info *info);
 extern errcode_t ext2fs_extent_goto(ext2_extent_handle_t handle,
 				    blk64_t blk);
+extern errcode_t ext2fs_extent_builder_open(ext2_filsys fs,
+					ext2_extent_builder_t *ret_builder);
+extern void ext2fs_extent_builder_free(ext2_extent_builder_t builder);
+extern errcode_t ext2fs_extent_builder_add(ext2_extent_builder_t builder,
+					   blk64_t lblk, blk64_t pblk,
+					   blk64_t len);
+extern void ext2fs_extent_builder_end(ext2_extent_builder_t builder,
+				      blk64_t *next_lblk, blk64_t *next_pblk);
+extern errcode_t ext2fs_extent_builder_write(ext2_extent_builder_t builder,
+					     struct ext2_inode *inode);
 
 /* fileio.c */
 extern errcode_t ext2fs_file_open2(ext2_filsys fs, ext2_ino_t ino,
@@ -948,6 +971,15 @@ extern errcode_t ext2fs_set_generic_bitmap_range(ext2fs_generic_bitmap bmap,
 						 errcode_t magic,
 						 __u32 start, __u32 num,
 						 void *in);
+extern errcode_t ext2fs_set_generic_bitmap_loader(ext2fs_generic_bitmap bitmap,
+				__u32 group_bits,
+				errcode_t (*load)(ext2_filsys fs, dgrp_t group,
+						  char *bits));
+extern errcode_t ext2fs_load_generic_bitmap(ext2fs_generic_bitmap bitmap);
+extern errcode_t ext2fs_get_generic_bitmap_load_error(ext2fs_generic_bitmap bitmap);
+extern int ext2fs_generic_bitmap_group_dirty(ext2fs_generic_bitmap bitmap,
+					     dgrp_t group);
+extern void ext2fs_clear_generic_bitmap_dirty(ext2fs_generic_bitmap bitmap);
 
 /* getsize.c */
 extern errcode_t ext2fs_get_device_size(const char *file, int blocksize,
@@ -1005,6 +1037,7 @@ errcode_t ext2fs_icount_validate(ext2_icount_t icount, FILE *);
 
 /* inode.c */
 extern errcode_t ext2fs_flush_icache(ext2_filsys fs);
+extern errcode_t ext2fs_set_icache_size(ext2_filsys fs, int cache_size);
 extern errcode_t ext2fs_get_next_inode_full(ext2_inode_scan scan,
 					    ext2_ino_t *ino,
 					    struct ext2_inode *inode,
@@ -1025,6 +1058,13 @@ extern void ext2fs_set_inode_callback
 	 void *done_group_data);
 extern int ext2fs_inode_scan_flags(ext2_inode_scan scan, int set_flags,
 				   int clear_flags);
+extern errcode_t ext2fs_inode_scan_batch(ext2_inode_scan scan,
+				 errcode_t (*func)(ext2_filsys fs,
+						   ext2_ino_t ino,
+						   struct ext2_inode *inodes,
+						   int num,
+						   void *priv_data),
+				 void *priv_data);
 extern errcode_t ext2fs_read_inode_full(ext2_filsys fs, ext2_ino_t ino,
 					struct ext2_inode * inode,
 					int bufsize);
@@ -1062,6 +1102,8 @@ errcode_t ext2fs_namei_follow(ext2_filsys fs, ext2_ino_t root, ext2_ino_t cwd,
 			      const char *name, ext2_ino_t *inode);
 extern errcode_t ext2fs_follow_link(ext2_filsys fs, ext2_ino_t root, ext2_ino_t cwd,
 			ext2_ino_t inode, ext2_ino_t *res_inode);
+extern void ext2fs_dcache_invalidate(ext2_filsys fs, ext2_ino_t dir,
+				     const char *name, int namelen);
 
 /* native.c */
 int ext2fs_native_flag(void);
@@ -65,17 +65,74 @@ struct dir_context {
 struct ext2_inode_cache {
 	void *				buffer;
 	blk_t				buffer_blk;
-	int				cache_last;
+	int				buffer_count;
 	int				cache_size;
 	int				refcount;
 	struct ext2_inode_cache_ent	*cache;
+	int				*hash;
+	int				hash_size;
+	int				lru_first;
+	int				lru_last;
 };
 
+/*
+ * Entries are chained (by index) in a hash bucket and on a list
+ * ordered from most to least recently used.
+ */
 struct ext2_inode_cache_ent {
 	ext2_ino_t		ino;
+	int			hash_next;
+	int			lru_prev;
+	int			lru_next;
 	struct ext2_inode	inode;
 };
 
+/*
+ * Directory entry cache: maps a (directory, name) pair to the inode
+ * it names, or to 0 if the name is known not to exist.  Names longer
+ * than EXT2_DCACHE_NAME_LEN are not cached.
+ */
+#define EXT2_DCACHE_NAME_LEN	60
+
+struct ext2_dentry_cache {
+	int				cache_size;
+	int				next;
+	struct ext2_dentry_cache_ent	*cache;
+	int				*hash;
+	int				hash_size;
+};
+
+struct ext2_dentry_cache_ent {
+	ext2_ino_t		dir;
+	ext2_ino_t		ino;
+	int			hash_next;
+	int			namelen;
+	char			name[EXT2_DCACHE_NAME_LEN];
+};
+
+/*
+ * Flush plan: metadata writes queued to be issued in block order,
+ * with adjacent blocks merged (see flush_plan.c)
+ */
+struct ext2_flush_ent {
+	blk_t			blk;
+	unsigned int		nbytes;
+	int			seq;
+	void			*buf;
+};
+
+struct ext2_flush_plan {
+	ext2_filsys		fs;
+	struct ext2_flush_ent	*ents;
+	int			count;
+	int			size;
+	int			seq;
+	char			*data;
+	unsigned int		data_used;
+	unsigned int		data_size;
+	char			*run_buf;
+};
+
 /* Function prototypes */
 
 extern int ext2fs_process_dir_block(ext2_filsys  	fs,
@@ -85,4 +142,11 @@ extern int ext2fs_process_dir_block(ext2_filsys  	fs,
 				    int			ref_offset,
 				    void		*priv_data);
 
-
+/* flush_plan.c */
+extern errcode_t ext2fs_flush_plan_init(ext2_filsys fs,
+					struct ext2_flush_plan *plan);
+extern errcode_t ext2fs_flush_plan_add(struct ext2_flush_plan *plan,
+				       blk_t blk, int count, const void *buf,
+				       int copy);
+extern errcode_t ext2fs_flush_plan_submit(struct ext2_flush_plan *plan);
+extern void ext2fs_flush_plan_free(struct ext2_flush_plan *plan);
@@ -1550,6 +1550,267 @@ errcode_t ext2fs_extent_get_info(ext2_extent_handle_t handle,
 	return 0;
 }
 
+/*
+ * Extent tree builder.
+ *
+ * Mapping a freshly written file one block at a time through
+ * ext2fs_extent_set_bmap() splits and rewrites tree nodes as it goes.
+ * When the runs are known up front (and arrive in logical order) the
+ * builder instead collects them, merging adjacent ones, and then lays
+ * out a packed, balanced tree in one pass: every node is full except
+ * the last one on each level, and every node is written exactly once.
+ */
+struct ext2_extent_builder {
+	ext2_filsys		fs;
+	struct ext2fs_extent	*runs;
+	int			count;
+	int			size;
+};
+
+errcode_t ext2fs_extent_builder_open(ext2_filsys fs,
+				     ext2_extent_builder_t *ret_builder)
+{
+	ext2_extent_builder_t	builder;
+	errcode_t		retval;
+
+	retval = ext2fs_get_mem(sizeof(struct ext2_extent_builder), &builder);
+	if (retval)
+		return retval;
+	memset(builder, 0, sizeof(struct ext2_extent_builder));
+	builder->fs = fs;
+	*ret_builder = builder;
+	return 0;
+}
+
+void ext2fs_extent_builder_free(ext2_extent_builder_t builder)
+{
+	if (!builder)
+		return;
+	if (builder->runs)
+		ext2fs_free_mem(&builder->runs);
+	ext2fs_free_mem(&builder);
+}
+
+/*
+ * Add len blocks mapped from logical block lblk to physical block
+ * pblk.  Runs must be added in increasing logical order.
+ */
+errcode_t ext2fs_extent_builder_add(ext2_extent_builder_t builder,
+				    blk64_t lblk, blk64_t pblk, blk64_t len)
+{
+	struct ext2fs_extent	*last;
+	blk64_t			n;
+	errcode_t		retval;
+
+	while (len) {
+		last = builder->count ? &builder->runs[builder->count - 1] : 0;
+		if (last && lblk < last->e_lblk + last->e_len)
+			return EXT2_ET_INVALID_ARGUMENT;
+		if (last && last->e_lblk + last->e_len == lblk &&
+		    last->e_pblk + last->e_len == pblk &&
+		    last->e_len < EXT_INIT_MAX_LEN) {
+			n = EXT_INIT_MAX_LEN - last->e_len;
+			if (n > len)
+				n = len;
+			last->e_len += n;
+		} else {
+			if (builder->count == builder->size) {
+				retval = ext2fs_resize_mem(builder->size *
+					sizeof(struct ext2fs_extent),
+					(builder->size + 64) *
+					sizeof(struct ext2fs_extent),
+					&builder->runs);
+				if (retval)
+					return retval;
+				builder->size += 64;
+			}
+			n = (len > EXT_INIT_MAX_LEN) ? EXT_INIT_MAX_LEN : len;
+			last = &builder->runs[builder->count++];
+			last->e_lblk = lblk;
+			last->e_pblk = pblk;
+			last->e_len = n;
+			last->e_flags = 0;
+		}
+		lblk += n;
+		pblk += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/*
+ * Return the logical block just past the last run, and the physical
+ * block that would continue it (both 0 if nothing has been added).
+ */
+void ext2fs_extent_builder_end(ext2_extent_builder_t builder,
+			       blk64_t *next_lblk, blk64_t *next_pblk)
+{
+	struct ext2fs_extent	*last;
+
+	if (!builder->count) {
+		*next_lblk = *next_pblk = 0;
+		return;
+	}
+	last = &builder->runs[builder->count - 1];
+	*next_lblk = last->e_lblk + last->e_len;
+	*next_pblk = last->e_pblk + last->e_len;
+}
+
+/*
+ * Fill one tree node (or the root in i_block) with entries from items
+ */
+static void build_node(struct ext3_extent_header *eh, int max, int depth,
+		       struct ext2fs_extent *items, int nitems)
+{
+	struct ext3_extent	*ex;
+	struct ext3_extent_idx	*ix;
+	int			i;
+
+	eh->eh_magic = ext2fs_cpu_to_le16(EXT3_EXT_MAGIC);
+	eh->eh_entries = ext2fs_cpu_to_le16(nitems);
+	eh->eh_max = ext2fs_cpu_to_le16(max);
+	eh->eh_depth = ext2fs_cpu_to_le16(depth);
+	eh->eh_generation = 0;
+
+	for (i = 0; i < nitems; i++) {
+		if (depth == 0) {
+			ex = EXT_FIRST_EXTENT(eh) + i;
+			ex->ee_block = ext2fs_cpu_to_le32(items[i].e_lblk);
+			ex->ee_start = ext2fs_cpu_to_le32(items[i].e_pblk &
+							  0xFFFFFFFF);
+			ex->ee_start_hi = ext2fs_cpu_to_le16(items[i].e_pblk >>
+							     32);
+			ex->ee_len = ext2fs_cpu_to_le16(items[i].e_len);
+		} else {
+			ix = EXT_FIRST_INDEX(eh) + i;
+			ix->ei_block = ext2fs_cpu_to_le32(items[i].e_lblk);
+			ix->ei_leaf = ext2fs_cpu_to_le32(items[i].e_pblk &
+							 0xFFFFFFFF);
+			ix->ei_leaf_hi = ext2fs_cpu_to_le16(items[i].e_pblk >>
+							    32);
+			ix->ei_unused = 0;
+		}
+	}
+}
+
+/*
+ * Write the collected runs out as the extent tree of inode, which
+ * must not map any blocks yet.  Tree blocks are allocated after the
+ * last data block and are accounted in i_blocks; the caller writes
+ * the inode.
+ */
+errcode_t ext2fs_extent_builder_write(ext2_extent_builder_t builder,
+				      struct ext2_inode *inode)
+{
+	ext2_filsys		fs = builder->fs;
+	struct ext2fs_extent	*items = builder->runs, *next = 0;
+	struct ext2_flush_plan	plan;
+	struct ext3_extent_header *eh;
+	blk64_t			goal, dummy;
+	blk_t			*blks = 0, blk;
+	int			root_max, per_block, nitems, nblocks, total;
+	int			depth, i, j, n;
+	char			*buf = 0;
+	errcode_t		retval;
+
+	root_max = (sizeof(inode->i_block) -
+		    sizeof(struct ext3_extent_header)) /
+		sizeof(struct ext3_extent);
+	per_block = (fs->blocksize - sizeof(struct ext3_extent_header)) /
+		sizeof(struct ext3_extent);
+
+	/* Count and allocate the tree blocks before touching anything */
+	total = 0;
+	for (nitems = builder->count; nitems > root_max;
+	     nitems = (nitems + per_block - 1) / per_block)
+		total += (nitems + per_block - 1) / per_block;
+
+	memset(&plan, 0, sizeof(plan));
+	if (total) {
+		retval = ext2fs_get_array(total, sizeof(blk_t), &blks);
+		if (retval)
+			return retval;
+		memset(blks, 0, total * sizeof(blk_t));
+		retval = ext2fs_get_mem(fs->blocksize, &buf);
+		if (retval)
+			goto errout;
+		retval = ext2fs_flush_plan_init(fs, &plan);
+		if (retval)
+			goto errout;
+		ext2fs_extent_builder_end(builder, &dummy, &goal);
+		for (i = 0; i < total; i++) {
+			retval = ext2fs_new_block(fs, goal, 0, &blk);
+			if (retval)
+				goto release;
+			ext2fs_block_alloc_stats(fs, blk, +1);
+			blks[i] = blk;
+			goal = blk + 1;
+		}
+	}
+
+	/* Build the levels bottom up, each block written once */
+	j = 0;
+	depth = 0;
+	nitems = builder->count;
+	while (nitems > root_max) {
+		nblocks = (nitems + per_block - 1) / per_block;
+		retval = ext2fs_get_array(nblocks,
+					  sizeof(struct ext2fs_extent), &next);
+		if (retval)
+			goto release;
+		for (i = 0; i < nblocks; i++) {
+			n = nitems - i * per_block;
+			if (n > per_block)
+				n = per_block;
+			memset(buf, 0, fs->blocksize);
+			build_node((struct ext3_extent_header *) buf,
+				   per_block, depth, items + i * per_block, n);
+			retval = ext2fs_flush_plan_add(&plan, blks[j], 1,
+						       buf, 1);
+			if (retval)
+				goto release;
+			next[i].e_lblk = items[i * per_block].e_lblk;
+			next[i].e_pblk = blks[j++];
+			next[i].e_len = 0;
+			next[i].e_flags = 0;
+		}
+		if (items != builder->runs)
+			ext2fs_free_mem(&items);
+		items = next;
+		next = 0;
+		nitems = nblocks;
+		depth++;
+	}
+	if (total) {
+		retval = ext2fs_flush_plan_submit(&plan);
+		if (retval)
+			goto release;
+	}
+
+	memset(inode->i_block, 0, sizeof(inode->i_block));
+	eh = (struct ext3_extent_header *) &inode->i_block[0];
+	build_node(eh, root_max, depth, items, nitems);
+	inode->i_flags |= EXT4_EXTENTS_FL;
+	ext2fs_iblk_add_blocks(fs, inode, total);
+	retval = 0;
+	goto errout;
+
+release:
+	for (i = 0; i < total && blks[i]; i++)
+		ext2fs_block_alloc_stats(fs, blks[i], -1);
+errout:
+	if (next)
+		ext2fs_free_mem(&next);
+	if (items != builder->runs)
+		ext2fs_free_mem(&items);
+	ext2fs_flush_plan_free(&plan);
+	if (buf)
+		ext2fs_free_mem(&buf);
+	if (blks)
+		ext2fs_free_mem(&blks);
+	return retval;
+}
+
 #ifdef DEBUG
 
 #include "ss/ss.h"
@@ -28,6 +28,7 @@ struct ext2_file {
 	blk_t			blockno;
 	blk_t			physblock;
 	char 			*buf;
+	ext2_extent_builder_t	extents;
 };
 
 #define BMAP_BUFFER (file->buf + fs->blocksize)
@@ -96,16 +97,70 @@ ext2_filsys ext2fs_file_get_fs(ext2_file_t file)
 }
 
 /*
- * This function flushes the dirty block buffer out to disk if
- * necessary.
+ * A new extent-mapped file that is written from start to end has its
+ * blocks collected in an extent builder (file->extents) rather than
+ * mapped one by one; the tree is written when the file is flushed or
+ * closed, or as soon as anything needs to look a block up.  Until
+ * then the inode's own tree stays empty.
  */
-errcode_t ext2fs_file_flush(ext2_file_t file)
+static int extents_pending(ext2_file_t file, blk64_t blockno)
+{
+	blk64_t	next_lblk, next_pblk;
+
+	if (!file->extents)
+		return 0;
+	ext2fs_extent_builder_end(file->extents, &next_lblk, &next_pblk);
+	return blockno < next_lblk;
+}
+
+static errcode_t finish_extents(ext2_file_t file)
 {
 	errcode_t	retval;
-	ext2_filsys fs;
 
-	EXT2_CHECK_MAGIC(file, EXT2_ET_MAGIC_EXT2_FILE);
-	fs = file->fs;
+	if (!file->extents)
+		return 0;
+	retval = ext2fs_extent_builder_write(file->extents, &file->inode);
+	ext2fs_extent_builder_free(file->extents);
+	file->extents = 0;
+	if (retval)
+		return retval;
+	return ext2fs_write_inode(file->fs, file->ino, &file->inode);
+}
+
+/*
+ * Start collecting extents if this is an extent-mapped file that
+ * doesn't map any blocks yet (an all-zero i_block counts as an empty
+ * tree, as in ext2fs_extent_open2)
+ */
+static void start_extents(ext2_file_t file)
+{
+	struct ext3_extent_header *eh;
+	int	i;
+
+	if (file->extents || !file->ino ||
+	    !(file->inode.i_flags & EXT4_EXTENTS_FL))
+		return;
+	for (i = 0; i < EXT2_N_BLOCKS; i++)
+		if (file->inode.i_block[i])
+			break;
+	eh = (struct ext3_extent_header *) &file->inode.i_block[0];
+	if (i < EXT2_N_BLOCKS &&
+	    (ext2fs_le16_to_cpu(eh->eh_magic) != EXT3_EXT_MAGIC ||
+	     eh->eh_entries || eh->eh_depth))
+		return;
+	if (ext2fs_extent_builder_open(file->fs, &file->extents))
+		file->extents = 0;
+}
+
+/*
+ * Write the dirty block buffer out, allocating its block if needed
+ */
+static errcode_t flush_buffer(ext2_file_t file)
+{
+	ext2_filsys	fs = file->fs;
+	errcode_t	retval;
+	blk64_t		next_lblk, goal;
+	blk_t		blk;
 
 	if (!(file->flags & EXT2_FILE_BUF_VALID) ||
 	    !(file->flags & EXT2_FILE_BUF_DIRTY))
@@ -116,6 +171,29 @@ errcode_t ext2fs_file_flush(ext2_file_t file)
 	 * Allocate it.
 	 */
 	if (!file->physblock) {
+		start_extents(file);
+		if (extents_pending(file, file->blockno)) {
+			retval = finish_extents(file);
+			if (retval)
+				return retval;
+		}
+	}
+	if (!file->physblock && file->extents) {
+		ext2fs_extent_builder_end(file->extents, &next_lblk, &goal);
+		if (next_lblk != file->blockno || !goal)
+			goal = ext2fs_group_first_block(fs,
+					ext2fs_group_of_ino(fs, file->ino));
+		retval = ext2fs_new_block(fs, goal, 0, &blk);
+		if (retval)
+			return retval;
+		retval = ext2fs_extent_builder_add(file->extents,
+						   file->blockno, blk, 1);
+		if (retval)
+			return retval;
+		ext2fs_block_alloc_stats(fs, blk, +1);
+		ext2fs_iblk_add_blocks(fs, &file->inode, 1);
+		file->physblock = blk;
+	} else if (!file->physblock) {
 		retval = ext2fs_bmap(fs, file->ino, &file->inode,
 				     BMAP_BUFFER, file->ino ? BMAP_ALLOC : 0,
 				     file->blockno, &file->physblock);
@@ -133,6 +211,22 @@ errcode_t ext2fs_file_flush(ext2_file_t file)
 	return retval;
 }
 
+/*
+ * This function flushes the dirty block buffer out to disk if
+ * necessary, and writes out any extents still being collected.
+ */
+errcode_t ext2fs_file_flush(ext2_file_t file)
+{
+	errcode_t	retval;
+
+	EXT2_CHECK_MAGIC(file, EXT2_ET_MAGIC_EXT2_FILE);
+
+	retval = flush_buffer(file);
+	if (retval)
+		return retval;
+	return finish_extents(file);
+}
+
 /*
  * This function synchronizes the file's block buffer and the current
  * file position, possibly invalidating block buffer if necessary
@@ -144,7 +238,7 @@ static errcode_t sync_buffer_position(ext2_file_t file)
 
 	b = file->pos / file->fs->blocksize;
 	if (b != file->blockno) {
-		retval = ext2fs_file_flush(file);
+		retval = flush_buffer(file);
 		if (retval)
 			return retval;
 		file->flags &= ~EXT2_FILE_BUF_VALID;
@@ -168,6 +262,11 @@ static errcode_t load_buffer(ext2_file_t file, int dontfill)
 	errcode_t	retval;
 
 	if (!(file->flags & EXT2_FILE_BUF_VALID)) {
+		if (extents_pending(file, file->blockno)) {
+			retval = finish_extents(file);
+			if (retval)
+				return retval;
+		}
 		retval = ext2fs_bmap(fs, file->ino, &file->inode,
 				     BMAP_BUFFER, 0, file->blockno,
 				     &file->physblock);
@@ -197,6 +296,8 @@ errcode_t ext2fs_file_close(ext2_file_t file)
 
 	retval = ext2fs_file_flush(file);
 
+	if (file->extents)
+		ext2fs_extent_builder_free(file->extents);
 	if (file->buf)
 		ext2fs_free_mem(&file->buf);
 	ext2fs_free_mem(&file);
@@ -205,6 +306,44 @@ errcode_t ext2fs_file_close(ext2_file_t file)
 }
 
 
+/*
+ * Read up to nblocks whole blocks at the current (block aligned)
+ * position straight into the caller's buffer, as one physical run.
+ * Holes and uninitialized extents read back as zeroes.
+ */
+static errcode_t read_blocks_direct(ext2_file_t file, char *buf,
+				    blk_t nblocks, unsigned int *got)
+{
+	ext2_filsys	fs = file->fs;
+	errcode_t	retval;
+	blk64_t		physblock;
+	blk_t		count;
+	int		ret_flags;
+
+	*got = 0;
+
+	/* The block buffer may hold data not yet on disk */
+	retval = flush_buffer(file);
+	if (retval)
+		return retval;
+
+	retval = ext2fs_bmap_run(fs, file->ino, &file->inode, BMAP_BUFFER,
+				 file->pos / fs->blocksize, nblocks,
+				 &ret_flags, &physblock, &count);
+	if (retval)
+		return retval;
+	if (!physblock || (ret_flags & BMAP_RET_UNINIT)) {
+		memset(buf, 0, count * fs->blocksize);
+	} else {
+		retval = io_channel_read_blk64(fs->io, physblock, count, buf);
+		if (retval)
+			return retval;
+	}
+
+	*got = count * fs->blocksize;
+	return 0;
+}
+
 errcode_t ext2fs_file_read(ext2_file_t file, void *buf,
 			   unsigned int wanted, unsigned int *got)
 {
@@ -217,7 +356,32 @@ errcode_t ext2fs_file_read(ext2_file_t file, void *buf,
 	EXT2_CHECK_MAGIC(file, EXT2_ET_MAGIC_EXT2_FILE);
 	fs = file->fs;
 
+	retval = finish_extents(file);
+	if (retval)
+		return retval;
+
 	while ((file->pos < EXT2_I_SIZE(&file->inode)) && (wanted > 0)) {
+		/*
+		 * Whole, block aligned blocks bypass the block buffer.
+		 */
+		left = EXT2_I_SIZE(&file->inode) - file->pos;
+		if ((file->pos % fs->blocksize) == 0 &&
+		    wanted >= fs->blocksize && left >= fs->blocksize) {
+			if (left > wanted)
+				left = wanted;
+			retval = read_blocks_direct(file, ptr,
+						    left / fs->blocksize, &c);
+			if (retval)
+				goto fail;
+			if (c) {
+				file->pos += c;
+				ptr += c;
+				count += c;
+				wanted -= c;
+				continue;
+			}
+		}
+
 		retval = sync_buffer_position(file);
 		if (retval)
 			goto fail;
@@ -247,6 +411,180 @@ fail:
 }
 
 
+/*
+ * Write up to nblocks whole blocks at the current (block aligned)
+ * position straight from the caller's buffer.  Blocks that are
+ * already mapped are overwritten in place, one physical run at a
+ * time.  A hole is filled from a run of free blocks found next to
+ * the previous block of the file, written with a single request.
+ * Uninitialized extents are left to the buffered path (*written is 0).
+ */
+static errcode_t write_blocks_direct(ext2_file_t file, const char *buf,
+				     blk_t nblocks, unsigned int *written)
+{
+	ext2_filsys	fs = file->fs;
+	errcode_t	retval;
+	blk64_t		physblock, goal, next_lblk;
+	blk_t		blockno, count, start, n, i, b, end;
+	int		ret_flags;
+
+	*written = 0;
+	blockno = file->pos / fs->blocksize;
+
+	/* The block buffer may hold (or be about to hold) these blocks */
+	retval = flush_buffer(file);
+	if (retval)
+		return retval;
+	if (extents_pending(file, blockno)) {
+		retval = finish_extents(file);
+		if (retval)
+			return retval;
+	}
+
+	retval = ext2fs_bmap_run(fs, file->ino, &file->inode, BMAP_BUFFER,
+				 blockno, nblocks, &ret_flags,
+				 &physblock, &count);
+	if (retval)
+		return retval;
+	if (ret_flags & BMAP_RET_UNINIT)
+		return 0;
+
+	if (physblock) {
+		retval = io_channel_write_blk64(fs->io, physblock, count, buf);
+		if (retval)
+			return retval;
+		n = count;
+		goto out;
+	}
+
+	/*
+	 * Allocate a contiguous run, preferably right after the
+	 * previous block of the file.
+	 */
+	goal = 0;
+	start_extents(file);
+	if (file->extents) {
+		ext2fs_extent_builder_end(file->extents, &next_lblk, &goal);
+		if (next_lblk != blockno)
+			goal = 0;
+	} else if (blockno) {
+		retval = ext2fs_bmap2(fs, file->ino, &file->inode, BMAP_BUFFER,
+				      0, blockno - 1, 0, &goal);
+		if (retval)
+			return retval;
+		if (goal)
+			goal++;
+	}
+	if (!goal)
+		goal = ext2fs_group_first_block(fs,
+				ext2fs_group_of_ino(fs, file->ino));
+
+	retval = ext2fs_new_block(fs, goal, 0, &start);
+	if (retval)
+		return retval;
+	n = 1;
+	while (n < count) {
+		b = start + n;
+		if (b >= fs->super->s_blocks_count)
+			break;
+		/*
+		 * Entering a new group goes through the allocator so
+		 * an uninitialized block bitmap gets set up first.
+		 */
+		if (((b - fs->super->s_first_data_block) %
+		     fs->super->s_blocks_per_group) == 0 &&
+		    (ext2fs_new_block(fs, b, 0, &b) || b != start + n))
+			break;
+		/* Extend to the next used block, within this group */
+		end = b - ((b - fs->super->s_first_data_block) %
+			   fs->super->s_blocks_per_group) +
+			fs->super->s_blocks_per_group - 1;
+		if (end >= fs->super->s_blocks_count)
+			end = fs->super->s_blocks_count - 1;
+		if (end > start + count - 1)
+			end = start + count - 1;
+		if (!ext2fs_find_first_set_block_bitmap(fs->block_map, b,
+							end, &b)) {
+			n = b - start;
+			break;
+		}
+		n = end - start + 1;
+	}
+
+	for (i = 0; i < n; i++)
+		ext2fs_block_alloc_stats(fs, start + i, +1);
+
+	retval = io_channel_write_blk64(fs->io, start, n, buf);
+	if (retval) {
+		i = 0;
+		goto fail;
+	}
+
+	if (file->extents) {
+		retval = ext2fs_extent_builder_add(file->extents, blockno,
+						   start, n);
+		if (retval) {
+			i = 0;
+			goto fail;
+		}
+		/* The inode is written along with the tree */
+		ext2fs_iblk_add_blocks(fs, &file->inode, n);
+		goto out;
+	} else if (file->inode.i_flags & EXT4_EXTENTS_FL) {
+		ext2_extent_handle_t handle;
+
+		retval = ext2fs_extent_open2(fs, file->ino, &file->inode,
+					     &handle);
+		if (retval) {
+			i = 0;
+			goto fail;
+		}
+		for (i = 0; i < n; i++) {
+			retval = ext2fs_extent_set_bmap(handle, blockno + i,
+							start + i, 0);
+			if (retval)
+				break;
+		}
+		ext2fs_extent_free(handle);
+		if (retval)
+			goto fail;
+		/*
+		 * The handle worked on its own copy of the inode; pick
+		 * up its changes before accounting for the new blocks.
+		 */
+		retval = ext2fs_read_inode(fs, file->ino, &file->inode);
+		if (retval)
+			return retval;
+	} else {
+		for (i = 0; i < n; i++) {
+			physblock = start + i;
+			retval = ext2fs_bmap2(fs, file->ino, &file->inode,
+					      BMAP_BUFFER,
+					      BMAP_SET | BMAP_ALLOC,
+					      blockno + i, 0, &physblock);
+			if (retval)
+				goto fail;
+		}
+	}
+	ext2fs_iblk_add_blocks(fs, &file->inode, n);
+	retval = ext2fs_write_inode(fs, file->ino, &file->inode);
+	if (retval)
+		return retval;
+
+out:
+	if ((file->flags & EXT2_FILE_BUF_VALID) &&
+	    file->blockno >= blockno && file->blockno < blockno + n)
+		file->flags &= ~EXT2_FILE_BUF_VALID;
+	*written = n * fs->blocksize;
+	return 0;
+
+fail:
+	/* Give back the blocks from i on; those before it are mapped */
+	for (; i < n; i++)
+		ext2fs_block_alloc_stats(fs, start + i, -1);
+	return retval;
+}
+
 errcode_t ext2fs_file_write(ext2_file_t file, const void *buf,
 			    unsigned int nbytes, unsigned int *written)
 {
@@ -262,6 +600,24 @@ errcode_t ext2fs_file_write(ext2_file_t file, const void *buf,
 		return EXT2_ET_FILE_RO;
 
 	while (nbytes > 0) {
+		/*
+		 * Whole, block aligned blocks bypass the block buffer.
+		 */
+		if (file->ino && (file->pos % fs->blocksize) == 0 &&
+		    nbytes >= fs->blocksize) {
+			retval = write_blocks_direct(file, ptr,
+						     nbytes / fs->blocksize, &c);
+			if (retval)
+				goto fail;
+			if (c) {
+				file->pos += c;
+				ptr += c;
+				count += c;
+				nbytes -= c;
+				continue;
+			}
+		}
+
 		retval = sync_buffer_position(file);
 		if (retval)
 			goto fail;
@@ -0,0 +1,180 @@
+/*
+ * flush_plan.c --- batch metadata writes into sorted, merged I/O
+ *
+ * Writing back the superblock copies, group descriptors and bitmaps
+ * one block at a time, in group order, costs a seek and a separate
+ * disk request per block.  A flush plan collects those writes first,
+ * then issues them sorted by block number, with runs of adjacent
+ * blocks merged into a single request.
+ *
+ * %Begin-Header%
+ * This file may be redistributed under the terms of the GNU Public
+ * License.
+ * %End-Header%
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#if HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include "ext2_fs.h"
+#include "ext2fsP.h"
+
+/*
+ * Staging space, in filesystem blocks, for copied data; it is also the
+ * longest run merged into one request.
+ */
+#ifndef EXT2_FLUSH_PLAN_BLOCKS
+#define EXT2_FLUSH_PLAN_BLOCKS	64
+#endif
+
+errcode_t ext2fs_flush_plan_init(ext2_filsys fs, struct ext2_flush_plan *plan)
+{
+	errcode_t	retval;
+
+	memset(plan, 0, sizeof(struct ext2_flush_plan));
+	plan->fs = fs;
+	plan->size = EXT2_FLUSH_PLAN_BLOCKS;
+	plan->data_size = EXT2_FLUSH_PLAN_BLOCKS * fs->blocksize;
+
+	retval = ext2fs_get_array(plan->size, sizeof(struct ext2_flush_ent),
+				  &plan->ents);
+	if (retval)
+		return retval;
+	retval = ext2fs_get_mem(plan->data_size, &plan->data);
+	if (retval)
+		goto errout;
+	retval = ext2fs_get_mem(plan->data_size, &plan->run_buf);
+	if (retval)
+		goto errout;
+	return 0;
+
+errout:
+	ext2fs_flush_plan_free(plan);
+	return retval;
+}
+
+void ext2fs_flush_plan_free(struct ext2_flush_plan *plan)
+{
+	if (plan->ents)
+		ext2fs_free_mem(&plan->ents);
+	if (plan->data)
+		ext2fs_free_mem(&plan->data);
+	if (plan->run_buf)
+		ext2fs_free_mem(&plan->run_buf);
+	plan->count = 0;
+}
+
+static int ent_cmp(const void *a, const void *b)
+{
+	const struct ext2_flush_ent *ea = a, *eb = b;
+
+	if (ea->blk != eb->blk)
+		return (ea->blk < eb->blk) ? -1 : 1;
+	/* Same block: keep the order the writes were queued in */
+	return ea->seq - eb->seq;
+}
+
+/*
+ * Number of whole blocks an entry covers, or 0 for a partial block
+ * (e.g. a backup superblock on a filesystem with blocks over 1k),
+ * which is never merged with its neighbours.
+ */
+static blk_t ent_blocks(struct ext2_flush_plan *plan,
+			struct ext2_flush_ent *ent)
+{
+	if (ent->nbytes % plan->fs->blocksize)
+		return 0;
+	return ent->nbytes / plan->fs->blocksize;
+}
+
+/*
+ * Issue every queued write, in block order, merging adjacent ones
+ */
+errcode_t ext2fs_flush_plan_submit(struct ext2_flush_plan *plan)
+{
+	ext2_filsys	fs = plan->fs;
+	struct ext2_flush_ent *ent;
+	errcode_t	retval = 0;
+	blk_t		nblocks, run;
+	char		*p;
+	int		i, j, k;
+
+	qsort(plan->ents, plan->count, sizeof(struct ext2_flush_ent),
+	      ent_cmp);
+
+	for (i = 0; i < plan->count; i = j) {
+		ent = &plan->ents[i];
+		run = ent_blocks(plan, ent);
+		for (j = i + 1; run && j < plan->count; j++) {
+			nblocks = ent_blocks(plan, &plan->ents[j]);
+			if (!nblocks || plan->ents[j].blk != ent->blk + run ||
+			    run + nblocks > EXT2_FLUSH_PLAN_BLOCKS)
+				break;
+			run += nblocks;
+		}
+
+		if (j == i + 1) {
+			retval = io_channel_write_blk(fs->io, ent->blk,
+						      -ent->nbytes, ent->buf);
+		} else {
+			p = plan->run_buf;
+			for (k = i; k < j; k++) {
+				memcpy(p, plan->ents[k].buf,
+				       plan->ents[k].nbytes);
+				p += plan->ents[k].nbytes;
+			}
+			retval = io_channel_write_blk(fs->io, ent->blk, run,
+						      plan->run_buf);
+		}
+		if (retval)
+			break;
+	}
+
+	plan->count = 0;
+	plan->data_used = 0;
+	return retval;
+}
+
+/*
+ * Queue a write of count blocks (or -count bytes) at blk.  Unless
+ * copy is zero the data is copied, so buf may be reused as soon as
+ * this returns; otherwise it must stay valid until the plan has been
+ * submitted.  The plan is submitted early when it fills up.
+ */
+errcode_t ext2fs_flush_plan_add(struct ext2_flush_plan *plan, blk_t blk,
+				int count, const void *buf, int copy)
+{
+	struct ext2_flush_ent *ent;
+	unsigned int	nbytes;
+	errcode_t	retval;
+
+	nbytes = (count < 0) ? (unsigned int) -count :
+		(unsigned int) count * plan->fs->blocksize;
+
+	if (plan->count == plan->size ||
+	    (copy && plan->data_used + nbytes > plan->data_size)) {
+		retval = ext2fs_flush_plan_submit(plan);
+		if (retval)
+			return retval;
+	}
+	/* Too big to stage: write it straight out */
+	if (copy && nbytes > plan->data_size)
+		return io_channel_write_blk(plan->fs->io, blk, count, buf);
+
+	ent = &plan->ents[plan->count];
+	ent->blk = blk;
+	ent->nbytes = nbytes;
+	ent->seq = plan->seq++;
+	if (copy) {
+		ent->buf = plan->data + plan->data_used;
+		memcpy(ent->buf, buf, nbytes);
+		plan->data_used += nbytes;
+	} else
+		ent->buf = (void *) buf;
+	plan->count++;
+	return 0;
+}
@@ -53,6 +53,12 @@ void ext2fs_free(ext2_filsys fs)
 	if (fs->icache)
 		ext2fs_free_inode_cache(fs->icache);
 
+	if (fs->dcache) {
+		ext2fs_free_mem(&fs->dcache->cache);
+		ext2fs_free_mem(&fs->dcache->hash);
+		ext2fs_free_mem(&fs->dcache);
+	}
+
 	fs->magic = 0;
 
 	ext2fs_free_mem(&fs);
@@ -69,6 +75,8 @@ static void ext2fs_free_inode_cache(struct ext2_inode_cache *icache)
 		ext2fs_free_mem(&icache->buffer);
 	if (icache->cache)
 		ext2fs_free_mem(&icache->cache);
+	if (icache->hash)
+		ext2fs_free_mem(&icache->hash);
 	icache->buffer_blk = 0;
 	ext2fs_free_mem(&icache);
 }
@@ -15,6 +15,9 @@
 #if HAVE_UNISTD_H
 #include <unistd.h>
 #endif
+#if HAVE_ERRNO_H
+#include <errno.h>
+#endif
 #include <fcntl.h>
 #include <time.h>
 #if HAVE_SYS_STAT_H
@@ -36,8 +39,20 @@ struct ext2fs_struct_generic_bitmap {
 	char	*	bitmap;
 	errcode_t	base_error_code;
 	__u32		reserved[7];
+	/*
+	 * Lazily loaded bitmaps: the bits of a group are read in by
+	 * load() the first time any of them is used.
+	 */
+	__u32		group_bits;
+	dgrp_t		groups;
+	unsigned char *	group_flags;
+	errcode_t	load_error;
+	errcode_t	(*load)(ext2_filsys fs, dgrp_t group, char *bits);
 };
 
+#define BMAP_GROUP_LOADED	0x01
+#define BMAP_GROUP_DIRTY	0x02
+
 /*
  * Used by previously inlined function, so we have to export this and
  * not change the function signature
@@ -72,6 +87,119 @@ static errcode_t check_magic(ext2fs_generic_bitmap bitmap)
 	return 0;
 }
 
+/*
+ * Make sure the groups holding bits first..last are loaded, and
+ * optionally mark them dirty.  A group which can't be read is filled
+ * with ones so nothing in it is handed out, and the error is kept
+ * for ext2fs_get_generic_bitmap_load_error().
+ */
+static void load_groups(ext2fs_generic_bitmap bitmap, __u32 first,
+			__u32 last, int dirty)
+{
+	dgrp_t		group, end;
+	errcode_t	retval;
+	char		*bits;
+
+	group = (first - bitmap->start) / bitmap->group_bits;
+	end = (last - bitmap->start) / bitmap->group_bits;
+	if (end >= bitmap->groups)
+		end = bitmap->groups - 1;
+
+	for (; group <= end; group++) {
+		if (!(bitmap->group_flags[group] & BMAP_GROUP_LOADED)) {
+			bits = bitmap->bitmap +
+				((group * bitmap->group_bits) >> 3);
+			retval = (bitmap->load)(bitmap->fs, group, bits);
+			if (retval) {
+				memset(bits, 0xff, bitmap->group_bits >> 3);
+				if (!bitmap->load_error)
+					bitmap->load_error = retval;
+			}
+			bitmap->group_flags[group] |= BMAP_GROUP_LOADED;
+		}
+		if (dirty)
+			bitmap->group_flags[group] |= BMAP_GROUP_DIRTY;
+	}
+}
+
+#define LOAD_BITS(bitmap, first, last, dirty)				\
+	do {								\
+		if ((bitmap)->group_flags)				\
+			load_groups((bitmap), (first), (last), (dirty)); \
+	} while (0)
+
+/*
+ * Switch a freshly allocated bitmap over to loading its bits one
+ * group (of group_bits bits) at a time through load(), which fills
+ * in group_bits / 8 bytes.
+ */
+errcode_t ext2fs_set_generic_bitmap_loader(ext2fs_generic_bitmap bitmap,
+				__u32 group_bits,
+				errcode_t (*load)(ext2_filsys fs, dgrp_t group,
+						  char *bits))
+{
+	errcode_t	retval;
+
+	retval = check_magic(bitmap);
+	if (retval)
+		return retval;
+	if (!group_bits || (group_bits & 7) || bitmap->group_flags)
+		return EXT2_ET_INVALID_ARGUMENT;
+
+	bitmap->groups = (bitmap->real_end - bitmap->start) / group_bits + 1;
+	retval = ext2fs_get_mem(bitmap->groups, &bitmap->group_flags);
+	if (retval)
+		return retval;
+	memset(bitmap->group_flags, 0, bitmap->groups);
+	bitmap->group_bits = group_bits;
+	bitmap->load = load;
+	bitmap->load_error = 0;
+	return 0;
+}
+
+/*
+ * Read in every group of a lazily loaded bitmap
+ */
+errcode_t ext2fs_load_generic_bitmap(ext2fs_generic_bitmap bitmap)
+{
+	errcode_t	retval;
+
+	retval = check_magic(bitmap);
+	if (retval)
+		return retval;
+	LOAD_BITS(bitmap, bitmap->start, bitmap->real_end, 0);
+	return bitmap->load_error;
+}
+
+errcode_t ext2fs_get_generic_bitmap_load_error(ext2fs_generic_bitmap bitmap)
+{
+	return bitmap->load_error;
+}
+
+/*
+ * Return true if the bits of a group may have changed since they were
+ * read, i.e. need writing out.  Always true unless lazily loaded.
+ */
+int ext2fs_generic_bitmap_group_dirty(ext2fs_generic_bitmap bitmap,
+				      dgrp_t group)
+{
+	if (!bitmap->group_flags)
+		return 1;
+	if (group >= bitmap->groups)
+		return 0;
+	return bitmap->group_flags[group] & BMAP_GROUP_DIRTY;
+}
+
+void ext2fs_clear_generic_bitmap_dirty(ext2fs_generic_bitmap bitmap)
+{
+	dgrp_t	group;
+
+	if (!bitmap->group_flags)
+		return;
+	for (group = 0; group < bitmap->groups; group++)
+		bitmap->group_flags[group] &= ~BMAP_GROUP_DIRTY;
+}
+
 errcode_t ext2fs_make_generic_bitmap(errcode_t magic, ext2_filsys fs,
 				     __u32 start, __u32 end, __u32 real_end,
 				     const char *descr, char *init_map,
@@ -91,6 +219,8 @@ errcode_t ext2fs_make_generic_bitmap(errcode_t magic, ext2_filsys fs,
 	bitmap->start = start;
 	bitmap->end = end;
 	bitmap->real_end = real_end;
+	bitmap->group_flags = 0;
+	bitmap->load = 0;
 	switch (magic) {
 	case EXT2_ET_MAGIC_INODE_BITMAP:
 		bitmap->base_error_code = EXT2_ET_BAD_INODE_MARK;
@@ -142,6 +272,11 @@ errcode_t ext2fs_allocate_generic_bitmap(__u32 start,
 errcode_t ext2fs_copy_generic_bitmap(ext2fs_generic_bitmap src,
 				     ext2fs_generic_bitmap *dest)
 {
+	errcode_t	retval;
+
+	retval = ext2fs_load_generic_bitmap(src);
+	if (retval)
+		return retval;
 	return (ext2fs_make_generic_bitmap(src->magic, src->fs,
 					   src->start, src->end,
 					   src->real_end,
@@ -163,6 +298,8 @@ void ext2fs_free_generic_bitmap(ext2fs_inode_bitmap bitmap)
 		ext2fs_free_mem(&bitmap->bitmap);
 		bitmap->bitmap = 0;
 	}
+	if (bitmap->group_flags)
+		ext2fs_free_mem(&bitmap->group_flags);
 	ext2fs_free_mem(&bitmap);
 }
 
@@ -173,6 +310,7 @@ int ext2fs_test_generic_bitmap(ext2fs_generic_bitmap bitmap,
 		ext2fs_warn_bitmap2(bitmap, EXT2FS_TEST_ERROR, bitno);
 		return 0;
 	}
+	LOAD_BITS(bitmap, bitno, bitno, 0);
 	return ext2fs_test_bit(bitno - bitmap->start, bitmap->bitmap);
 }
 
@@ -183,6 +321,7 @@ int ext2fs_mark_generic_bitmap(ext2fs_generic_bitmap bitmap,
 		ext2fs_warn_bitmap2(bitmap, EXT2FS_MARK_ERROR, bitno);
 		return 0;
 	}
+	LOAD_BITS(bitmap, bitno, bitno, 1);
 	return ext2fs_set_bit(bitno - bitmap->start, bitmap->bitmap);
 }
 
@@ -193,6 +332,7 @@ int ext2fs_unmark_generic_bitmap(ext2fs_generic_bitmap bitmap,
 		ext2fs_warn_bitmap2(bitmap, EXT2FS_UNMARK_ERROR, bitno);
 		return 0;
 	}
+	LOAD_BITS(bitmap, bitno, bitno, 1);
 	return ext2fs_clear_bit(bitno - bitmap->start, bitmap->bitmap);
 }
 
@@ -213,6 +353,9 @@ void ext2fs_clear_generic_bitmap(ext2fs_generic_bitmap bitmap)
 
 	memset(bitmap->bitmap, 0,
 	       (size_t) (((bitmap->real_end - bitmap->start) / 8) + 1));
+	if (bitmap->group_flags)
+		memset(bitmap->group_flags,
+		       BMAP_GROUP_LOADED | BMAP_GROUP_DIRTY, bitmap->groups);
 }
 
 errcode_t ext2fs_fudge_generic_bitmap_end(ext2fs_inode_bitmap bitmap,
@@ -240,6 +383,15 @@ errcode_t ext2fs_resize_generic_bitmap(errcode_t magic,
 	if (!bmap || (bmap->magic != magic))
 		return magic;
 
+	/* Lazy loading is per group; keep it simple and drop it here */
+	if (bmap->group_flags) {
+		retval = ext2fs_load_generic_bitmap(bmap);
+		if (retval)
+			return retval;
+		ext2fs_free_mem(&bmap->group_flags);
+		bmap->load = 0;
+	}
+
 	/*
 	 * If we're expanding the bitmap, make sure all of the new
 	 * parts of the bitmap are zero.
@@ -282,6 +434,8 @@ errcode_t ext2fs_compare_generic_bitmap(errcode_t magic, errcode_t neq,
 		return magic;
 	if (!bm2 || bm2->magic != magic)
 		return magic;
+	LOAD_BITS(bm1, bm1->start, bm1->real_end, 0);
+	LOAD_BITS(bm2, bm2->start, bm2->real_end, 0);
 
 	if ((bm1->start != bm2->start) ||
 	    (bm1->end != bm2->end) ||
@@ -301,6 +455,9 @@ void ext2fs_set_generic_bitmap_padding(ext2fs_generic_bitmap map)
 {
 	__u32	i, j;
 
+	if (map->end < map->real_end)
+		LOAD_BITS(map, map->end + 1, map->real_end, 1);
+
 	/* Protect loop from wrap-around if map->real_end is maxed */
 	for (i=map->end+1, j = i - map->start;
 	     i <= map->real_end && i > map->end;
@@ -319,6 +476,7 @@ errcode_t ext2fs_get_generic_bitmap_range(ext2fs_generic_bitmap bmap,
 	if ((start < bmap->start) || (start+num-1 > bmap->real_end))
 		return EXT2_ET_INVALID_ARGUMENT;
 
+	LOAD_BITS(bmap, start, start + num - 1, 0);
 	memcpy(out, bmap->bitmap + (start >> 3), (num+7) >> 3);
 	return 0;
 }
@@ -334,6 +492,7 @@ errcode_t ext2fs_set_generic_bitmap_range(ext2fs_generic_bitmap bmap,
 	if ((start < bmap->start) || (start+num-1 > bmap->real_end))
 		return EXT2_ET_INVALID_ARGUMENT;
 
+	LOAD_BITS(bmap, start, start + num - 1, 1);
 	memcpy(bmap->bitmap + (start >> 3), in, (num+7) >> 3);
 	return 0;
 }
@@ -374,6 +533,7 @@ static int ext2fs_test_clear_generic_bitmap_range(ext2fs_generic_bitmap bitmap,
 	int i;
 	const char *ADDR = bitmap->bitmap;
 
+	LOAD_BITS(bitmap, start, start + len - 1, 0);
 	start -= bitmap->start;
 	start_byte = start >> 3;
 	start_bit = start % 8;
@@ -459,31 +619,192 @@ int ext2fs_test_inode_bitmap_range(ext2fs_inode_bitmap bitmap,
 						      bitmap, inode, num);
 }
 
+/*
+ * Set or clear num bits starting at bit nr; whole bytes are done
+ * with memset().
+ */
+static void change_bit_range(char *map, __u32 nr, __u32 num, int set)
+{
+	for (; num && (nr & 7); nr++, num--) {
+		if (set)
+			ext2fs_fast_set_bit(nr, map);
+		else
+			ext2fs_fast_clear_bit(nr, map);
+	}
+	if (num >= 8) {
+		memset(map + (nr >> 3), set ? 0xff : 0, num >> 3);
+		nr += num & ~7;
+		num &= 7;
+	}
+	for (; num; nr++, num--) {
+		if (set)
+			ext2fs_fast_set_bit(nr, map);
+		else
+			ext2fs_fast_clear_bit(nr, map);
+	}
+}
+
 void ext2fs_mark_block_bitmap_range(ext2fs_block_bitmap bitmap,
 				    blk_t block, int num)
 {
-	int	i;
-
 	if ((block < bitmap->start) || (block+num-1 > bitmap->end)) {
 		ext2fs_warn_bitmap(EXT2_ET_BAD_BLOCK_MARK, block,
 				   bitmap->description);
 		return;
 	}
-	for (i=0; i < num; i++)
-		ext2fs_fast_set_bit(block + i - bitmap->start, bitmap->bitmap);
+	LOAD_BITS(bitmap, block, block + num - 1, 1);
+	change_bit_range(bitmap->bitmap, block - bitmap->start, num, 1);
 }
 
 void ext2fs_unmark_block_bitmap_range(ext2fs_block_bitmap bitmap,
 					       blk_t block, int num)
 {
-	int	i;
-
 	if ((block < bitmap->start) || (block+num-1 > bitmap->end)) {
 		ext2fs_warn_bitmap(EXT2_ET_BAD_BLOCK_UNMARK, block,
 				   bitmap->description);
 		return;
 	}
-	for (i=0; i < num; i++)
-		ext2fs_fast_clear_bit(block + i - bitmap->start,
-				      bitmap->bitmap);
+	LOAD_BITS(bitmap, block, block + num - 1, 1);
+	change_bit_range(bitmap->bitmap, block - bitmap->start, num, 0);
+}
+
+void ext2fs_mark_inode_bitmap_range(ext2fs_inode_bitmap bitmap,
+				    ext2_ino_t inode, int num)
+{
+	if ((inode < bitmap->start) || (inode+num-1 > bitmap->end)) {
+		ext2fs_warn_bitmap(EXT2_ET_BAD_INODE_MARK, inode,
+				   bitmap->description);
+		return;
+	}
+	LOAD_BITS(bitmap, inode, inode + num - 1, 1);
+	change_bit_range(bitmap->bitmap, inode - bitmap->start, num, 1);
+}
+
+void ext2fs_unmark_inode_bitmap_range(ext2fs_inode_bitmap bitmap,
+				      ext2_ino_t inode, int num)
+{
+	if ((inode < bitmap->start) || (inode+num-1 > bitmap->end)) {
+		ext2fs_warn_bitmap(EXT2_ET_BAD_INODE_UNMARK, inode,
+				   bitmap->description);
+		return;
+	}
+	LOAD_BITS(bitmap, inode, inode + num - 1, 1);
+	change_bit_range(bitmap->bitmap, inode - bitmap->start, num, 0);
+}
+
+/*
+ * Return the first bit in [nr, last] which is set (if set is
+ * nonzero) or clear.  Runs of uninteresting bits are skipped a long
+ * word, then a byte, at a time.
+ */
+static int find_bit(const char *map, __u32 nr, __u32 last, int set,
+		    __u32 *out)
+{
+	const unsigned char *p;
+	unsigned long	skip_word = set ? 0UL : ~0UL;
+	unsigned char	skip_byte = set ? 0 : 0xff;
+
+	while (nr <= last) {
+		if (!(nr & 7) && last - nr >= 7) {
+			p = (const unsigned char *) map + (nr >> 3);
+			if (!((unsigned long) p & (sizeof(unsigned long) - 1)) &&
+			    last - nr >= 8 * sizeof(unsigned long) - 1 &&
+			    *(const unsigned long *) p == skip_word) {
+				nr += 8 * sizeof(unsigned long);
+				continue;
+			}
+			if (*p == skip_byte) {
+				nr += 8;
+				continue;
+			}
+		}
+		if (!ext2fs_test_bit(nr, map) == !set) {
+			*out = nr;
+			return 1;
+		}
+		nr++;
+	}
+	return 0;
+}
+
+/*
+ * Find the first clear (or set) bit between start and end inclusive.
+ * Returns ENOENT if there is none.
+ */
+static errcode_t find_first_generic(ext2fs_generic_bitmap bitmap,
+				    __u32 start, __u32 end, int set,
+				    __u32 *out)
+{
+	__u32	bit, last;
+
+	if (start < bitmap->start || end > bitmap->end || start > end)
+		return EINVAL;
+
+	/* Lazily loaded bitmaps are searched (and read) a group at a time */
+	while (1) {
+		last = end;
+		if (bitmap->group_flags) {
+			last = start - (start - bitmap->start) %
+				bitmap->group_bits + bitmap->group_bits - 1;
+			if (last > end || last < start)
+				last = end;
+			load_groups(bitmap, start, last, 0);
+		}
+		if (find_bit(bitmap->bitmap, start - bitmap->start,
+			     last - bitmap->start, set, &bit)) {
+			*out = bit + bitmap->start;
+			return 0;
+		}
+		if (last == end)
+			return ENOENT;
+		start = last + 1;
+	}
+}
+
+errcode_t ext2fs_find_first_zero_generic_bitmap(ext2fs_generic_bitmap bitmap,
+						__u32 start, __u32 end,
+						__u32 *out)
+{
+	errcode_t retval;
+
+	retval = check_magic(bitmap);
+	if (retval)
+		return retval;
+	return find_first_generic(bitmap, start, end, 0, out);
+}
+
+errcode_t ext2fs_find_first_set_generic_bitmap(ext2fs_generic_bitmap bitmap,
+					       __u32 start, __u32 end,
+					       __u32 *out)
+{
+	errcode_t retval;
+
+	retval = check_magic(bitmap);
+	if (retval)
+		return retval;
+	return find_first_generic(bitmap, start, end, 1, out);
+}
+
+errcode_t ext2fs_find_first_zero_block_bitmap(ext2fs_block_bitmap bitmap,
+					      blk_t start, blk_t end,
+					      blk_t *out)
+{
+	EXT2_CHECK_MAGIC(bitmap, EXT2_ET_MAGIC_BLOCK_BITMAP);
+	return find_first_generic(bitmap, start, end, 0, out);
+}
+
+errcode_t ext2fs_find_first_set_block_bitmap(ext2fs_block_bitmap bitmap,
+					     blk_t start, blk_t end,
+					     blk_t *out)
+{
+	EXT2_CHECK_MAGIC(bitmap, EXT2_ET_MAGIC_BLOCK_BITMAP);
+	return find_first_generic(bitmap, start, end, 1, out);
+}
+
+errcode_t ext2fs_find_first_zero_inode_bitmap(ext2fs_inode_bitmap bitmap,
+					      ext2_ino_t start, ext2_ino_t end,
+					      ext2_ino_t *out)
+{
+	EXT2_CHECK_MAGIC(bitmap, EXT2_ET_MAGIC_INODE_BITMAP);
+	return find_first_generic(bitmap, start, end, 0, out);
 }
@@ -54,52 +54,211 @@ struct ext2_struct_inode_scan {
 	int			reserved[6];
 };
 
+/*
+ * Number of cached inodes, and the most inode table blocks read in
+ * one go to satisfy a cache miss.
+ */
+#ifndef EXT2_ICACHE_SIZE
+#define EXT2_ICACHE_SIZE	256
+#endif
+#define EXT2_ICACHE_READAHEAD	8
+
 /*
  * This routine flushes the icache, if it exists.
  */
 errcode_t ext2fs_flush_icache(ext2_filsys fs)
 {
+	struct ext2_inode_cache *icache = fs->icache;
 	int	i;
 
-	if (!fs->icache)
+	if (!icache)
 		return 0;
 
-	for (i=0; i < fs->icache->cache_size; i++)
-		fs->icache->cache[i].ino = 0;
+	for (i=0; i < icache->hash_size; i++)
+		icache->hash[i] = -1;
+	for (i=0; i < icache->cache_size; i++) {
+		icache->cache[i].ino = 0;
+		icache->cache[i].hash_next = -1;
+		icache->cache[i].lru_prev = i - 1;
+		icache->cache[i].lru_next = i + 1;
+	}
+	icache->cache[icache->cache_size - 1].lru_next = -1;
+	icache->lru_first = 0;
+	icache->lru_last = icache->cache_size - 1;
 
-	fs->icache->buffer_blk = 0;
+	icache->buffer_blk = 0;
+	icache->buffer_count = 0;
 	return 0;
 }
 
-static errcode_t create_icache(ext2_filsys fs)
+static errcode_t create_icache(ext2_filsys fs, int cache_size)
 {
+	struct ext2_inode_cache *icache;
 	errcode_t	retval;
 
 	if (fs->icache)
 		return 0;
-	retval = ext2fs_get_mem(sizeof(struct ext2_inode_cache), &fs->icache);
+	retval = ext2fs_get_mem(sizeof(struct ext2_inode_cache), &icache);
 	if (retval)
 		return retval;
 
-	memset(fs->icache, 0, sizeof(struct ext2_inode_cache));
-	retval = ext2fs_get_mem(fs->blocksize, &fs->icache->buffer);
-	if (retval) {
-		ext2fs_free_mem(&fs->icache);
-		return retval;
-	}
-	fs->icache->buffer_blk = 0;
-	fs->icache->cache_last = -1;
-	fs->icache->cache_size = 4;
-	fs->icache->refcount = 1;
-	retval = ext2fs_get_array(fs->icache->cache_size,
+	memset(icache, 0, sizeof(struct ext2_inode_cache));
+	retval = ext2fs_get_array(EXT2_ICACHE_READAHEAD, fs->blocksize,
+				  &icache->buffer);
+	if (retval)
+		goto errout;
+	icache->cache_size = cache_size;
+	for (icache->hash_size = 1; icache->hash_size < cache_size;
+	     icache->hash_size <<= 1)
+		;
+	icache->refcount = 1;
+	retval = ext2fs_get_array(icache->cache_size,
 				  sizeof(struct ext2_inode_cache_ent),
-				  &fs->icache->cache);
+				  &icache->cache);
+	if (retval)
+		goto errout;
+	retval = ext2fs_get_array(icache->hash_size, sizeof(int),
+				  &icache->hash);
+	if (retval)
+		goto errout;
+	fs->icache = icache;
+	ext2fs_flush_icache(fs);
+	return 0;
+
+errout:
+	if (icache->cache)
+		ext2fs_free_mem(&icache->cache);
+	if (icache->buffer)
+		ext2fs_free_mem(&icache->buffer);
+	ext2fs_free_mem(&icache);
+	return retval;
+}
+
+/*
+ * Replace the inode cache with one holding cache_size inodes
+ */
+errcode_t ext2fs_set_icache_size(ext2_filsys fs, int cache_size)
+{
+	struct ext2_inode_cache *icache = fs->icache;
+	errcode_t	retval;
+
+	EXT2_CHECK_MAGIC(fs, EXT2_ET_MAGIC_EXT2FS_FILSYS);
+
+	if (cache_size < 1)
+		return EXT2_ET_INVALID_ARGUMENT;
+
+	fs->icache = 0;
+	retval = create_icache(fs, cache_size);
 	if (retval) {
-		ext2fs_free_mem(&fs->icache->buffer);
-		ext2fs_free_mem(&fs->icache);
+		fs->icache = icache;
 		return retval;
 	}
-	ext2fs_flush_icache(fs);
+	if (icache && --icache->refcount == 0) {
+		ext2fs_free_mem(&icache->buffer);
+		ext2fs_free_mem(&icache->cache);
+		ext2fs_free_mem(&icache->hash);
+		ext2fs_free_mem(&icache);
+	}
+	return 0;
+}
+
+#define icache_hash(icache, ino)	((ino) & ((icache)->hash_size - 1))
+
+/*
+ * Move a cache entry to the head of the LRU list
+ */
+static void icache_touch(struct ext2_inode_cache *icache, int i)
+{
+	struct ext2_inode_cache_ent *ent = &icache->cache[i];
+
+	if (icache->lru_first == i)
+		return;
+
+	icache->cache[ent->lru_prev].lru_next = ent->lru_next;
+	if (ent->lru_next >= 0)
+		icache->cache[ent->lru_next].lru_prev = ent->lru_prev;
+	else
+		icache->lru_last = ent->lru_prev;
+
+	ent->lru_prev = -1;
+	ent->lru_next = icache->lru_first;
+	icache->cache[icache->lru_first].lru_prev = i;
+	icache->lru_first = i;
+}
+
+static int icache_lookup(struct ext2_inode_cache *icache, ext2_ino_t ino)
+{
+	int	i;
+
+	for (i = icache->hash[icache_hash(icache, ino)]; i >= 0;
+	     i = icache->cache[i].hash_next) {
+		if (icache->cache[i].ino == ino) {
+			icache_touch(icache, i);
+			return i;
+		}
+	}
+	return -1;
+}
+
+/*
+ * Store an inode in the cache, recycling the least recently used
+ * entry if it isn't there yet.
+ */
+static void icache_store(struct ext2_inode_cache *icache, ext2_ino_t ino,
+			 struct ext2_inode *inode)
+{
+	struct ext2_inode_cache_ent *ent;
+	int	i, *p;
+
+	i = icache_lookup(icache, ino);
+	if (i < 0) {
+		i = icache->lru_last;
+		ent = &icache->cache[i];
+		if (ent->ino) {
+			p = &icache->hash[icache_hash(icache, ent->ino)];
+			while (*p != i)
+				p = &icache->cache[*p].hash_next;
+			*p = ent->hash_next;
+		}
+		ent->ino = ino;
+		p = &icache->hash[icache_hash(icache, ino)];
+		ent->hash_next = *p;
+		*p = i;
+		icache_touch(icache, i);
+	}
+	icache->cache[i].inode = *inode;
+}
+
+/*
+ * Return a pointer to inode table block block_nr, reading it (and,
+ * for reads, up to EXT2_ICACHE_READAHEAD - 1 following blocks of the
+ * same inode table) into the icache buffer if it isn't there.
+ */
+static errcode_t icache_get_block(ext2_filsys fs, io_channel io,
+				  blk_t block_nr, blk_t table_end,
+				  char **ret)
+{
+	struct ext2_inode_cache *icache = fs->icache;
+	errcode_t	retval;
+	int		count = 1;
+
+	if (!icache->buffer_count || block_nr < icache->buffer_blk ||
+	    block_nr >= icache->buffer_blk + icache->buffer_count) {
+		if (table_end > block_nr) {
+			count = EXT2_ICACHE_READAHEAD;
+			if (table_end - block_nr < (blk_t) count)
+				count = table_end - block_nr;
+		}
+		icache->buffer_count = 0;
+		retval = io_channel_read_blk(io, block_nr, count,
+					     icache->buffer);
+		if (retval)
+			return retval;
+		icache->buffer_blk = block_nr;
+		icache->buffer_count = count;
+	}
+	*ret = (char *) icache->buffer +
+		(block_nr - icache->buffer_blk) * fs->blocksize;
 	return 0;
 }
 
@@ -517,6 +676,216 @@ errcode_t ext2fs_get_next_inode(ext2_inode_scan scan, ext2_ino_t *ino,
 						sizeof(struct ext2_inode));
 }
 
+/*
+ * Number of inodes in use at the start of a group's inode table, as
+ * far as the scan's flags let us tell.
+ */
+static errcode_t batch_group_inodes(ext2_inode_scan scan, dgrp_t group,
+				    ext2_ino_t *ret)
+{
+	ext2_filsys	fs = scan->fs;
+	ext2_ino_t	used = EXT2_INODES_PER_GROUP(fs->super);
+
+	if (EXT2_HAS_RO_COMPAT_FEATURE(fs->super,
+				       EXT4_FEATURE_RO_COMPAT_GDT_CSUM))
+		used -= fs->group_desc[group].bg_itable_unused;
+	if ((scan->scan_flags & EXT2_SF_DO_LAZY) &&
+	    (fs->group_desc[group].bg_flags & EXT2_BG_INODE_UNINIT))
+		used = 0;
+	if (used && !fs->group_desc[group].bg_inode_table) {
+		if (!(scan->scan_flags & EXT2_SF_SKIP_MISSING_ITABLE))
+			return EXT2_ET_MISSING_INODE_TABLE;
+		used = 0;
+	}
+	*ret = used;
+	return 0;
+}
+
+/*
+ * Read num inode table blocks, zero-filling any that are on the bad
+ * blocks list.
+ */
+static errcode_t batch_read_blocks(ext2_inode_scan scan, blk_t blk,
+				   blk_t num, char *buf, int *bad)
+{
+	ext2_filsys	fs = scan->fs;
+	errcode_t	retval;
+	blk_t		i, start;
+
+	if (!(scan->scan_flags & EXT2_SF_CHK_BADBLOCKS))
+		return io_channel_read_blk(fs->io, blk, num, buf);
+
+	for (i = 0, start = 0; i <= num; i++) {
+		if (i < num && !ext2fs_badblocks_list_test(fs->badblocks,
+							   blk + i))
+			continue;
+		if (i > start) {
+			retval = io_channel_read_blk(fs->io, blk + start,
+						     i - start, buf +
+						     start * fs->blocksize);
+			if (retval)
+				return retval;
+		}
+		if (i < num) {
+			memset(buf + i * fs->blocksize, 0, fs->blocksize);
+			*bad = 1;
+		}
+		start = i + 1;
+	}
+	return 0;
+}
+
+/*
+ * Turn num raw on-disk inodes at buf into an array of struct
+ * ext2_inode in place.
+ */
+static void batch_convert(ext2_inode_scan scan, char *buf, ext2_ino_t num)
+{
+	struct ext2_inode *inodes = (struct ext2_inode *) buf;
+	ext2_ino_t	i;
+
+#ifdef WORDS_BIGENDIAN
+	for (i = 0; i < num; i++) {
+		ext2fs_swap_inode_full(scan->fs,
+			       (struct ext2_inode_large *) scan->temp_buffer,
+			       (struct ext2_inode_large *)
+			       (buf + i * scan->inode_size),
+			       0, sizeof(struct ext2_inode));
+		memcpy(&inodes[i], scan->temp_buffer,
+		       sizeof(struct ext2_inode));
+	}
+#else
+	if (scan->inode_size == sizeof(struct ext2_inode))
+		return;
+	for (i = 1; i < num; i++)
+		memmove(&inodes[i], buf + i * scan->inode_size,
+			sizeof(struct ext2_inode));
+#endif
+}
+
+/*
+ * Hand the in-use part of every remaining inode table to func, one
+ * group at a time, starting at the scan's current group.  The in-use
+ * part of a table is read at once; when it fills the whole table and
+ * the next group's table follows straight after on disk (flex_bg),
+ * the read goes on into that one, for as long as the scan's buffer
+ * (grown to hold at least one inode table) allows.  Unused tails
+ * (bg_itable_unused) and uninitialized tables are never read.
+ *
+ * func gets the number of the first inode and an array of num
+ * inodes; a non-zero return stops the scan and is returned.  Inodes
+ * in bad blocks are handed out zeroed, and the scan then finishes
+ * with EXT2_ET_BAD_BLOCK_IN_INODE_TABLE.  The done_group callback is
+ * called after each group; the scan is exhausted afterwards.
+ */
+errcode_t ext2fs_inode_scan_batch(ext2_inode_scan scan,
+				  errcode_t (*func)(ext2_filsys fs,
+						    ext2_ino_t ino,
+						    struct ext2_inode *inodes,
+						    int num,
+						    void *priv_data),
+				  void *priv_data)
+{
+	ext2_filsys	fs;
+	errcode_t	retval;
+	dgrp_t		group, first, last;
+	ext2_ino_t	used, next_used;
+	blk_t		start, end, next_end;
+	int		inodes_per_block, bad = 0;
+
+	EXT2_CHECK_MAGIC(scan, EXT2_ET_MAGIC_INODE_SCAN);
+	fs = scan->fs;
+	inodes_per_block = fs->blocksize / scan->inode_size;
+
+	if (scan->inode_buffer_blocks < (blk_t) fs->inode_blocks_per_group) {
+		ext2fs_free_mem(&scan->inode_buffer);
+		retval = ext2fs_get_array(fs->inode_blocks_per_group,
+					  fs->blocksize, &scan->inode_buffer);
+		if (retval) {
+			scan->inode_buffer_blocks = 0;
+			return retval;
+		}
+		scan->inode_buffer_blocks = fs->inode_blocks_per_group;
+	}
+	scan->bytes_left = 0;
+
+	for (first = scan->current_group; first < fs->group_desc_count;
+	     first = last + 1) {
+		retval = batch_group_inodes(scan, first, &used);
+		if (retval)
+			return retval;
+		last = first;
+		if (used) {
+			/*
+			 * Extend the read over the following groups for as
+			 * long as their tables come straight after this one
+			 * and there is no unused tail in between
+			 */
+			start = fs->group_desc[first].bg_inode_table;
+			end = start + (used + inodes_per_block - 1) /
+				inodes_per_block;
+			while (end == fs->group_desc[last].bg_inode_table +
+			       fs->inode_blocks_per_group &&
+			       last + 1 < fs->group_desc_count &&
+			       fs->group_desc[last + 1].bg_inode_table ==
+			       fs->group_desc[last].bg_inode_table +
+			       fs->inode_blocks_per_group) {
+				retval = batch_group_inodes(scan, last + 1,
+							    &next_used);
+				if (retval)
+					return retval;
+				next_end = fs->group_desc[last + 1].
+					bg_inode_table +
+					(next_used + inodes_per_block - 1) /
+					inodes_per_block;
+				if (!next_used ||
+				    next_end - start > scan->inode_buffer_blocks)
+					break;
+				end = next_end;
+				last++;
+			}
+			retval = batch_read_blocks(scan, start, end - start,
+						   scan->inode_buffer, &bad);
+			if (retval)
+				return EXT2_ET_NEXT_INODE_READ;
+		}
+
+		for (group = first; group <= last; group++) {
+			char	*buf;
+
+			scan->current_group = group;
+			scan->groups_left = fs->group_desc_count - group - 1;
+			retval = batch_group_inodes(scan, group, &used);
+			if (retval)
+				return retval;
+			if (used) {
+				buf = scan->inode_buffer + fs->blocksize *
+					(fs->group_desc[group].bg_inode_table -
+					 fs->group_desc[first].bg_inode_table);
+				batch_convert(scan, buf, used);
+				retval = (func)(fs, group *
+						EXT2_INODES_PER_GROUP(fs->super)
+						+ 1, (struct ext2_inode *) buf,
+						used, priv_data);
+				if (retval)
+					return retval;
+			}
+			if (scan->done_group) {
+				retval = (scan->done_group)
+					(fs, scan, group,
+					 scan->done_group_data);
+				if (retval)
+					return retval;
+			}
+		}
+	}
+
+	scan->current_inode = fs->super->s_inodes_count;
+	scan->inodes_left = 0;
+	scan->groups_left = 0;
+	return bad ? EXT2_ET_BAD_BLOCK_IN_INODE_TABLE : 0;
+}
+
 /*
  * Functions to read and write a single inode.
  */
@@ -524,7 +893,8 @@ errcode_t ext2fs_read_inode_full(ext2_filsys fs, ext2_ino_t ino,
 				 struct ext2_inode * inode, int bufsize)
 {
 	unsigned long 	group, block, block_nr, offset;
-	char 		*ptr;
+	blk_t		table_end = 0;
+	char 		*ptr, *buf;
 	errcode_t	retval;
 	int 		clen, i, inodes_per_block, length;
 	io_channel	io;
@@ -541,18 +911,17 @@ errcode_t ext2fs_read_inode_full(ext2_filsys fs, ext2_ino_t ino,
 		return EXT2_ET_BAD_INODE_NUM;
 	/* Create inode cache if not present */
 	if (!fs->icache) {
-		retval = create_icache(fs);
+		retval = create_icache(fs, EXT2_ICACHE_SIZE);
 		if (retval)
 			return retval;
 	}
 	/* Check to see if it's in the inode cache */
 	if (bufsize == sizeof(struct ext2_inode)) {
 		/* only old good inode can be retrieved from the cache */
-		for (i=0; i < fs->icache->cache_size; i++) {
-			if (fs->icache->cache[i].ino == ino) {
-				*inode = fs->icache->cache[i].inode;
-				return 0;
-			}
+		i = icache_lookup(fs->icache, ino);
+		if (i >= 0) {
+			*inode = fs->icache->cache[i].inode;
+			return 0;
 		}
 	}
 	if (fs->flags & EXT2_FLAG_IMAGE_FILE) {
@@ -573,6 +942,8 @@ errcode_t ext2fs_read_inode_full(ext2_filsys fs, ext2_ino_t ino,
 			return EXT2_ET_MISSING_INODE_TABLE;
 		block_nr = fs->group_desc[(unsigned)group].bg_inode_table +
 			block;
+		table_end = fs->group_desc[(unsigned)group].bg_inode_table +
+			fs->inode_blocks_per_group;
 		io = fs->io;
 	}
 	offset &= (EXT2_BLOCK_SIZE(fs->super) - 1);
@@ -587,16 +958,11 @@ errcode_t ext2fs_read_inode_full(ext2_filsys fs, ext2_ino_t ino,
 		if ((offset + length) > fs->blocksize)
 			clen = fs->blocksize - offset;
 
-		if (block_nr != fs->icache->buffer_blk) {
-			retval = io_channel_read_blk(io, block_nr, 1,
-						     fs->icache->buffer);
-			if (retval)
-				return retval;
-			fs->icache->buffer_blk = block_nr;
-		}
+		retval = icache_get_block(fs, io, block_nr, table_end, &buf);
+		if (retval)
+			return retval;
 
-		memcpy(ptr, ((char *) fs->icache->buffer) + (unsigned) offset,
-		       clen);
+		memcpy(ptr, buf + (unsigned) offset, clen);
 
 		offset = 0;
 		length -= clen;
@@ -611,10 +977,7 @@ errcode_t ext2fs_read_inode_full(ext2_filsys fs, ext2_ino_t ino,
 #endif
 
 	/* Update the inode cache */
-	fs->icache->cache_last = (fs->icache->cache_last + 1) %
-		fs->icache->cache_size;
-	fs->icache->cache[fs->icache->cache_last].ino = ino;
-	fs->icache->cache[fs->icache->cache_last].inode = *inode;
+	icache_store(fs->icache, ino, inode);
 
 	return 0;
 }
@@ -632,8 +995,8 @@ errcode_t ext2fs_write_inode_full(ext2_filsys fs, ext2_ino_t ino,
 	unsigned long group, block, block_nr, offset;
 	errcode_t retval = 0;
 	struct ext2_inode_large temp_inode, *w_inode;
-	char *ptr;
-	int clen, i, length;
+	char *ptr, *buf;
+	int clen, length;
 
 	EXT2_CHECK_MAGIC(fs, EXT2_ET_MAGIC_EXT2FS_FILSYS);
 
@@ -644,16 +1007,8 @@ errcode_t ext2fs_write_inode_full(ext2_filsys fs, ext2_ino_t ino,
 			return retval;
 	}
 
-	/* Check to see if the inode cache needs to be updated */
-	if (fs->icache) {
-		for (i=0; i < fs->icache->cache_size; i++) {
-			if (fs->icache->cache[i].ino == ino) {
-				fs->icache->cache[i].inode = *inode;
-				break;
-			}
-		}
-	} else {
-		retval = create_icache(fs);
+	if (!fs->icache) {
+		retval = create_icache(fs, EXT2_ICACHE_SIZE);
 		if (retval)
 			return retval;
 	}
@@ -664,6 +1019,9 @@ errcode_t ext2fs_write_inode_full(ext2_filsys fs, ext2_ino_t ino,
 	if ((ino == 0) || (ino > fs->super->s_inodes_count))
 		return EXT2_ET_BAD_INODE_NUM;
 
+	/* Update the inode cache */
+	icache_store(fs->icache, ino, inode);
+
 	length = bufsize;
 	if (length < EXT2_INODE_SIZE(fs->super))
 		length = EXT2_INODE_SIZE(fs->super);
@@ -707,20 +1065,13 @@ errcode_t ext2fs_write_inode_full(ext2_filsys fs, ext2_ino_t ino,
 		if ((offset + length) > fs->blocksize)
 			clen = fs->blocksize - offset;
 
-		if (fs->icache->buffer_blk != block_nr) {
-			retval = io_channel_read_blk(fs->io, block_nr, 1,
-						     fs->icache->buffer);
-			if (retval)
-				goto errout;
-			fs->icache->buffer_blk = block_nr;
-		}
-
+		retval = icache_get_block(fs, fs->io, block_nr, 0, &buf);
+		if (retval)
+			goto errout;
 
-		memcpy((char *) fs->icache->buffer + (unsigned) offset,
-		       ptr, clen);
+		memcpy(buf + (unsigned) offset, ptr, clen);
 
-		retval = io_channel_write_blk(fs->io, block_nr, 1,
-					      fs->icache->buffer);
+		retval = io_channel_write_blk(fs->io, block_nr, 1, buf);
 		if (retval)
 			goto errout;
 
@@ -46,6 +46,180 @@ static int lookup_proc(struct ext2_dir_entry *dirent,
 }
 
 
+/*
+ * Look for name in one leaf block of an indexed directory
+ */
+static errcode_t dx_search_leaf(ext2_filsys fs, char *buf, const char *name,
+				int namelen, ext2_ino_t *inode)
+{
+	struct ext2_dir_entry *dirent;
+	unsigned int	offset = 0, rec_len;
+	errcode_t	retval;
+
+	while (offset < fs->blocksize - 8) {
+		dirent = (struct ext2_dir_entry *) (buf + offset);
+		retval = ext2fs_get_rec_len(fs, dirent, &rec_len);
+		if (retval)
+			return retval;
+		if (rec_len < 8 || offset + rec_len > fs->blocksize)
+			return EXT2_ET_DIR_CORRUPTED;
+		if (dirent->inode &&
+		    (dirent->name_len & 0xFF) == namelen &&
+		    !strncmp(name, dirent->name, namelen)) {
+			*inode = dirent->inode;
+			return 0;
+		}
+		offset += rec_len;
+	}
+	return EXT2_ET_FILE_NOT_FOUND;
+}
+
+/*
+ * Read logical block blk of directory dir
+ */
+static errcode_t dx_read_block(ext2_filsys fs, ext2_ino_t dir,
+			       struct ext2_inode *inode, blk_t blk, char *buf)
+{
+	blk64_t		pblk;
+	errcode_t	retval;
+
+	retval = ext2fs_bmap2(fs, dir, inode, 0, 0, blk, 0, &pblk);
+	if (retval)
+		return retval;
+	if (!pblk)
+		return EXT2_ET_DIR_CORRUPTED;
+	return ext2fs_read_dir_block(fs, (blk_t) pblk, buf);
+}
+
+/*
+ * Look name up through the hash tree of an indexed (dir_index)
+ * directory: hash the name, walk from the dx_root through the index
+ * nodes to the one leaf block whose hash range covers it, and search
+ * only that leaf (and its continuations if the hash collides across
+ * leaves).  Returns EXT2_ET_FILE_NOT_FOUND if the name isn't there;
+ * any other error means the caller should fall back to a linear scan.
+ */
+static errcode_t dx_lookup(ext2_filsys fs, ext2_ino_t dir, const char *name,
+			   int namelen, ext2_ino_t *ino)
+{
+	struct ext2_inode		inode;
+	struct ext2_dx_root_info	*root;
+	struct ext2_dx_countlimit	*limit;
+	struct ext2_dx_entry		*entries, *end, *p, *q, *at;
+	ext2_dirhash_t	hash, minor_hash, next_hash = 0;
+	errcode_t	retval;
+	char		*buf, *leaf;
+	int		hash_version, levels, count, has_next = 0;
+
+	if (!EXT2_HAS_COMPAT_FEATURE(fs->super,
+				     EXT2_FEATURE_COMPAT_DIR_INDEX))
+		return EXT2_ET_DIRHASH_UNSUPP;
+	retval = ext2fs_read_inode(fs, dir, &inode);
+	if (retval)
+		return retval;
+	if (!(inode.i_flags & EXT2_INDEX_FL))
+		return EXT2_ET_DIRHASH_UNSUPP;
+
+	retval = ext2fs_get_array(2, fs->blocksize, &buf);
+	if (retval)
+		return retval;
+	leaf = buf + fs->blocksize;
+
+	retval = dx_read_block(fs, dir, &inode, 0, buf);
+	if (retval)
+		goto out;
+
+	/* The dx_root_info follows the "." and ".." entries */
+	root = (struct ext2_dx_root_info *) (buf + 24);
+	if (root->reserved_zero || root->info_length < 8 ||
+	    root->indirect_levels > 1) {
+		retval = EXT2_ET_DIR_CORRUPTED;
+		goto out;
+	}
+	hash_version = root->hash_version;
+	if (hash_version <= EXT2_HASH_TEA &&
+	    (fs->super->s_flags & EXT2_FLAGS_UNSIGNED_HASH))
+		hash_version += 3;
+	retval = ext2fs_dirhash(hash_version, name, namelen,
+				fs->super->s_hash_seed, &hash, &minor_hash);
+	if (retval)
+		goto out;
+
+	levels = root->indirect_levels;
+	limit = (struct ext2_dx_countlimit *) (buf + 24 + root->info_length);
+	while (1) {
+		count = ext2fs_le16_to_cpu(limit->count);
+		entries = (struct ext2_dx_entry *) limit;
+		end = entries + count;
+		if (!count || count > ext2fs_le16_to_cpu(limit->limit) ||
+		    (char *) end > buf + fs->blocksize) {
+			retval = EXT2_ET_DIR_CORRUPTED;
+			goto out;
+		}
+
+		/*
+		 * Find the last entry whose hash is <= ours.  The first
+		 * entry has the count/limit header in place of a hash
+		 * and covers everything below the second.
+		 */
+		p = entries + 1;
+		q = end - 1;
+		while (p <= q) {
+			at = p + (q - p) / 2;
+			if (ext2fs_le32_to_cpu(at->hash) > hash)
+				q = at - 1;
+			else
+				p = at + 1;
+		}
+		at = p - 1;
+
+		if (!levels--)
+			break;
+
+		/* Remember where the next index node starts */
+		if (at + 1 < end) {
+			next_hash = ext2fs_le32_to_cpu(at[1].hash);
+			has_next = 1;
+		}
+		retval = dx_read_block(fs, dir, &inode,
+				ext2fs_le32_to_cpu(at->block) & 0x0fffffff,
+				buf);
+		if (retval)
+			goto out;
+		/* Index nodes start with an empty, block-sized dirent */
+		limit = (struct ext2_dx_countlimit *) (buf + 8);
+	}
+
+	/*
+	 * Search the leaf.  Names whose hash collides may continue in
+	 * the following leaves; their index entries carry the same hash
+	 * (with the low bit set).
+	 */
+	while (1) {
+		retval = dx_read_block(fs, dir, &inode,
+				ext2fs_le32_to_cpu(at->block) & 0x0fffffff,
+				leaf);
+		if (retval)
+			goto out;
+		retval = dx_search_leaf(fs, leaf, name, namelen, ino);
+		if (retval != EXT2_ET_FILE_NOT_FOUND)
+			goto out;
+		if (++at < end) {
+			if ((ext2fs_le32_to_cpu(at->hash) & ~1) != hash)
+				break;
+			continue;
+		}
+		/* Continued in the next index node: not worth the trouble */
+		if (has_next && (next_hash & ~1) == hash)
+			retval = EXT2_ET_DIR_CORRUPTED;
+		break;
+	}
+
+out:
+	ext2fs_free_mem(&buf);
+	return retval;
+}
+
 errcode_t ext2fs_lookup(ext2_filsys fs, ext2_ino_t dir, const char *name,
 			int namelen, char *buf, ext2_ino_t *inode)
 {
@@ -54,6 +228,11 @@ errcode_t ext2fs_lookup(ext2_filsys fs, ext2_ino_t dir, const char *name,
 
 	EXT2_CHECK_MAGIC(fs, EXT2_ET_MAGIC_EXT2FS_FILSYS);
 
+	/* Indexed directories need only the leaf the name hashes to */
+	retval = dx_lookup(fs, dir, name, namelen, inode);
+	if (retval == 0 || retval == EXT2_ET_FILE_NOT_FOUND)
+		return retval;
+
 	ls.name = name;
 	ls.len = namelen;
 	ls.inode = inode;
@@ -52,6 +52,12 @@ errcode_t ext2fs_mkdir(ext2_filsys fs, ext2_ino_t parent, ext2_ino_t inum,
 			goto cleanup;
 	}
 
+	/*
+	 * The inode number may have belonged to a directory that has
+	 * since been removed; drop any lookups cached under it.
+	 */
+	ext2fs_dcache_invalidate(fs, ino, 0, 0);
+
 	/*
 	 * Allocate a data block for the directory
 	 */
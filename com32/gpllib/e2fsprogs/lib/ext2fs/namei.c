@@ -18,12 +18,178 @@
 /* #define NAMEI_DEBUG */
 
 #include "ext2_fs.h"
-#include "ext2fs.h"
+#include "ext2fsP.h"
 
 static errcode_t open_namei(ext2_filsys fs, ext2_ino_t root, ext2_ino_t base,
 			    const char *pathname, size_t pathlen, int follow,
 			    int link_count, char *buf, ext2_ino_t *res_inode);
 
+#ifndef EXT2_DCACHE_SIZE
+#define EXT2_DCACHE_SIZE	256
+#endif
+
+static errcode_t create_dcache(ext2_filsys fs)
+{
+	struct ext2_dentry_cache *dcache;
+	errcode_t	retval;
+	int		i;
+
+	retval = ext2fs_get_mem(sizeof(struct ext2_dentry_cache), &dcache);
+	if (retval)
+		return retval;
+	memset(dcache, 0, sizeof(struct ext2_dentry_cache));
+	dcache->cache_size = EXT2_DCACHE_SIZE;
+	dcache->hash_size = EXT2_DCACHE_SIZE;
+	retval = ext2fs_get_array(dcache->cache_size,
+				  sizeof(struct ext2_dentry_cache_ent),
+				  &dcache->cache);
+	if (retval)
+		goto errout;
+	retval = ext2fs_get_array(dcache->hash_size, sizeof(int),
+				  &dcache->hash);
+	if (retval)
+		goto errout;
+	for (i = 0; i < dcache->cache_size; i++)
+		dcache->cache[i].dir = 0;
+	for (i = 0; i < dcache->hash_size; i++)
+		dcache->hash[i] = -1;
+	fs->dcache = dcache;
+	return 0;
+
+errout:
+	if (dcache->cache)
+		ext2fs_free_mem(&dcache->cache);
+	ext2fs_free_mem(&dcache);
+	return retval;
+}
+
+static int dcache_bucket(struct ext2_dentry_cache *dcache, ext2_ino_t dir,
+			 const char *name, int namelen)
+{
+	__u32	h = dir * 0x9E3779B1;
+
+	while (namelen--)
+		h = (h ^ (unsigned char) *name++) * 16777619;
+	return h % dcache->hash_size;
+}
+
+static int dcache_find(struct ext2_dentry_cache *dcache, ext2_ino_t dir,
+		       const char *name, int namelen)
+{
+	struct ext2_dentry_cache_ent *ent;
+	int	i;
+
+	i = dcache->hash[dcache_bucket(dcache, dir, name, namelen)];
+	for (; i >= 0; i = ent->hash_next) {
+		ent = &dcache->cache[i];
+		if (ent->dir == dir && ent->namelen == namelen &&
+		    !memcmp(ent->name, name, namelen))
+			return i;
+	}
+	return -1;
+}
+
+static void dcache_remove(struct ext2_dentry_cache *dcache, int i)
+{
+	struct ext2_dentry_cache_ent *ent = &dcache->cache[i];
+	int	*pp;
+
+	pp = &dcache->hash[dcache_bucket(dcache, ent->dir, ent->name,
+					 ent->namelen)];
+	while (*pp != i)
+		pp = &dcache->cache[*pp].hash_next;
+	*pp = ent->hash_next;
+	ent->dir = 0;
+}
+
+/*
+ * Remember the result of looking up name in dir; ino is 0 if the
+ * name doesn't exist.  Slots are recycled round-robin.
+ */
+static void dcache_store(ext2_filsys fs, ext2_ino_t dir, const char *name,
+			 int namelen, ext2_ino_t ino)
+{
+	struct ext2_dentry_cache *dcache;
+	struct ext2_dentry_cache_ent *ent;
+	int	i, bucket;
+
+	if (namelen > EXT2_DCACHE_NAME_LEN)
+		return;
+	if (!fs->dcache && create_dcache(fs))
+		return;
+	dcache = fs->dcache;
+
+	i = dcache_find(dcache, dir, name, namelen);
+	if (i >= 0) {
+		dcache->cache[i].ino = ino;
+		return;
+	}
+	i = dcache->next;
+	dcache->next = (i + 1) % dcache->cache_size;
+	ent = &dcache->cache[i];
+	if (ent->dir)
+		dcache_remove(dcache, i);
+
+	ent->dir = dir;
+	ent->ino = ino;
+	ent->namelen = namelen;
+	memcpy(ent->name, name, namelen);
+	bucket = dcache_bucket(dcache, dir, name, namelen);
+	ent->hash_next = dcache->hash[bucket];
+	dcache->hash[bucket] = i;
+}
+
+/*
+ * ext2fs_lookup() through the dentry cache
+ */
+static errcode_t cached_lookup(ext2_filsys fs, ext2_ino_t dir,
+			       const char *name, int namelen, char *buf,
+			       ext2_ino_t *inode)
+{
+	errcode_t	retval;
+	int		i;
+
+	if (fs->dcache) {
+		i = dcache_find(fs->dcache, dir, name, namelen);
+		if (i >= 0) {
+			*inode = fs->dcache->cache[i].ino;
+			return *inode ? 0 : EXT2_ET_FILE_NOT_FOUND;
+		}
+	}
+
+	retval = ext2fs_lookup(fs, dir, name, namelen, buf, inode);
+	if (!retval)
+		dcache_store(fs, dir, name, namelen, *inode);
+	else if (retval == EXT2_ET_FILE_NOT_FOUND)
+		dcache_store(fs, dir, name, namelen, 0);
+	return retval;
+}
+
+/*
+ * Forget cached lookups that a directory change may have made stale:
+ * the entry for name in dir, or, if name is NULL, every entry looked
+ * up in dir.
+ */
+void ext2fs_dcache_invalidate(ext2_filsys fs, ext2_ino_t dir,
+			      const char *name, int namelen)
+{
+	struct ext2_dentry_cache *dcache = fs->dcache;
+	int	i;
+
+	if (!dcache)
+		return;
+	if (name) {
+		i = dcache_find(dcache, dir, name, namelen);
+		if (i >= 0)
+			dcache_remove(dcache, i);
+		return;
+	}
+	for (i = 0; i < dcache->cache_size; i++) {
+		if (dcache->cache[i].dir == dir)
+			dcache_remove(dcache, i);
+	}
+}
+
 static errcode_t follow_link(ext2_filsys fs, ext2_ino_t root, ext2_ino_t dir,
 			     ext2_ino_t inode, int link_count,
 			     char *buf, ext2_ino_t *res_inode)
@@ -98,7 +264,7 @@ static errcode_t dir_namei(ext2_filsys fs, ext2_ino_t root, ext2_ino_t dir,
 		}
 		if (pathlen < 0)
 			break;
-		retval = ext2fs_lookup (fs, dir, thisname, len, buf, &inode);
+		retval = cached_lookup(fs, dir, thisname, len, buf, &inode);
 		if (retval) return retval;
         	retval = follow_link (fs, root, dir, inode,
 				      link_count, buf, &dir);
@@ -130,7 +296,7 @@ static errcode_t open_namei(ext2_filsys fs, ext2_ino_t root, ext2_ino_t base,
 		*res_inode=dir;
 		return 0;
 	}
-	retval = ext2fs_lookup (fs, dir, base_name, namelen, buf, &inode);
+	retval = cached_lookup(fs, dir, base_name, namelen, buf, &inode);
 	if (retval)
 		return retval;
 	if (follow) {
@@ -24,7 +24,7 @@
 #endif
 
 #include "ext2_fs.h"
-#include "ext2fs.h"
+#include "ext2fsP.h"
 #include "e2image.h"
 
 static errcode_t write_bitmaps(ext2_filsys fs, int do_inode, int do_block)
@@ -34,11 +34,12 @@ static errcode_t write_bitmaps(ext2_filsys fs, int do_inode, int do_block)
 	int		block_nbytes, inode_nbytes;
 	unsigned int	nbits;
 	errcode_t	retval;
-	char 		*block_buf, *inode_buf;
+	char 		*block_buf = NULL, *inode_buf = NULL;
 	int		csum_flag = 0;
 	blk_t		blk;
 	blk_t		blk_itr = fs->super->s_first_data_block;
 	ext2_ino_t	ino_itr = 1;
+	struct ext2_flush_plan plan;
 
 	EXT2_CHECK_MAGIC(fs, EXT2_ET_MAGIC_EXT2FS_FILSYS);
 
@@ -50,11 +51,18 @@ static errcode_t write_bitmaps(ext2_filsys fs, int do_inode, int do_block)
 		csum_flag = 1;
 
 	inode_nbytes = block_nbytes = 0;
+	memset(&plan, 0, sizeof(plan));
+	/* Don't write back groups we never managed to read */
+	if (do_block && ext2fs_get_generic_bitmap_load_error(fs->block_map))
+		return EXT2_ET_BLOCK_BITMAP_READ;
+	if (do_inode && ext2fs_get_generic_bitmap_load_error(fs->inode_map))
+		return EXT2_ET_INODE_BITMAP_READ;
+
 	if (do_block) {
 		block_nbytes = EXT2_BLOCKS_PER_GROUP(fs->super) / 8;
 		retval = ext2fs_get_mem(fs->blocksize, &block_buf);
 		if (retval)
-			return retval;
+			goto errout;
 		memset(block_buf, 0xff, fs->blocksize);
 	}
 	if (do_inode) {
@@ -62,10 +70,19 @@ static errcode_t write_bitmaps(ext2_filsys fs, int do_inode, int do_block)
 			((EXT2_INODES_PER_GROUP(fs->super)+7) / 8);
 		retval = ext2fs_get_mem(fs->blocksize, &inode_buf);
 		if (retval)
-			return retval;
+			goto errout;
 		memset(inode_buf, 0xff, fs->blocksize);
 	}
 
+	/*
+	 * Queue the bitmap blocks and write them in disk order; with
+	 * flex_bg the bitmaps of a whole flex group are adjacent and go
+	 * out as one request.
+	 */
+	retval = ext2fs_flush_plan_init(fs, &plan);
+	if (retval)
+		goto errout;
+
 	for (i = 0; i < fs->group_desc_count; i++) {
 		if (!do_block)
 			goto skip_block_bitmap;
@@ -74,10 +91,13 @@ static errcode_t write_bitmaps(ext2_filsys fs, int do_inode, int do_block)
 		    EXT2_BG_BLOCK_UNINIT)
 			goto skip_this_block_bitmap;
 
+		if (!ext2fs_generic_bitmap_group_dirty(fs->block_map, i))
+			goto skip_this_block_bitmap;
+
 		retval = ext2fs_get_block_bitmap_range(fs->block_map,
 				blk_itr, block_nbytes << 3, block_buf);
 		if (retval)
-			return retval;
+			goto errout;
 
 		if (i == fs->group_desc_count - 1) {
 			/* Force bitmap padding for the last group */
@@ -90,10 +110,10 @@ static errcode_t write_bitmaps(ext2_filsys fs, int do_inode, int do_block)
 		}
 		blk = fs->group_desc[i].bg_block_bitmap;
 		if (blk) {
-			retval = io_channel_write_blk(fs->io, blk, 1,
-						      block_buf);
+			retval = ext2fs_flush_plan_add(&plan, blk, 1,
+						       block_buf, 1);
 			if (retval)
-				return EXT2_ET_BLOCK_BITMAP_WRITE;
+				goto write_error;
 		}
 	skip_this_block_bitmap:
 		blk_itr += block_nbytes << 3;
@@ -106,30 +126,92 @@ static errcode_t write_bitmaps(ext2_filsys fs, int do_inode, int do_block)
 		    EXT2_BG_INODE_UNINIT)
 			goto skip_this_inode_bitmap;
 
+		if (!ext2fs_generic_bitmap_group_dirty(fs->inode_map, i))
+			goto skip_this_inode_bitmap;
+
 		retval = ext2fs_get_inode_bitmap_range(fs->inode_map,
 				ino_itr, inode_nbytes << 3, inode_buf);
 		if (retval)
-			return retval;
+			goto errout;
 
 		blk = fs->group_desc[i].bg_inode_bitmap;
 		if (blk) {
-			retval = io_channel_write_blk(fs->io, blk, 1,
-						      inode_buf);
+			retval = ext2fs_flush_plan_add(&plan, blk, 1,
+						       inode_buf, 1);
 			if (retval)
-				return EXT2_ET_INODE_BITMAP_WRITE;
+				goto write_error;
 		}
 	skip_this_inode_bitmap:
 		ino_itr += inode_nbytes << 3;
 
 	}
+	retval = ext2fs_flush_plan_submit(&plan);
+	if (retval)
+		goto write_error;
 	if (do_block) {
 		fs->flags &= ~EXT2_FLAG_BB_DIRTY;
-		ext2fs_free_mem(&block_buf);
+		ext2fs_clear_generic_bitmap_dirty(fs->block_map);
 	}
 	if (do_inode) {
 		fs->flags &= ~EXT2_FLAG_IB_DIRTY;
+		ext2fs_clear_generic_bitmap_dirty(fs->inode_map);
+	}
+	goto errout;
+
+write_error:
+	retval = do_block ? EXT2_ET_BLOCK_BITMAP_WRITE :
+		EXT2_ET_INODE_BITMAP_WRITE;
+errout:
+	ext2fs_flush_plan_free(&plan);
+	if (block_buf)
+		ext2fs_free_mem(&block_buf);
+	if (inode_buf)
 		ext2fs_free_mem(&inode_buf);
+	return retval;
+}
+
+/*
+ * Read the block bitmap of one group into bits; groups whose bitmap
+ * was never initialized read as all free.
+ */
+static errcode_t read_block_group(ext2_filsys fs, dgrp_t group, char *bits)
+{
+	int	nbytes = EXT2_BLOCKS_PER_GROUP(fs->super) / 8;
+	blk_t	blk = fs->group_desc[group].bg_block_bitmap;
+
+	if (EXT2_HAS_RO_COMPAT_FEATURE(fs->super,
+				       EXT4_FEATURE_RO_COMPAT_GDT_CSUM) &&
+	    fs->group_desc[group].bg_flags & EXT2_BG_BLOCK_UNINIT &&
+	    ext2fs_group_desc_csum_verify(fs, group))
+		blk = 0;
+	if (!blk) {
+		memset(bits, 0, nbytes);
+		return 0;
 	}
+	if (io_channel_read_blk(fs->io, blk, -nbytes, bits))
+		return EXT2_ET_BLOCK_BITMAP_READ;
+	return 0;
+}
+
+/*
+ * Read the inode bitmap of one group into bits
+ */
+static errcode_t read_inode_group(ext2_filsys fs, dgrp_t group, char *bits)
+{
+	int	nbytes = EXT2_INODES_PER_GROUP(fs->super) / 8;
+	blk_t	blk = fs->group_desc[group].bg_inode_bitmap;
+
+	if (EXT2_HAS_RO_COMPAT_FEATURE(fs->super,
+				       EXT4_FEATURE_RO_COMPAT_GDT_CSUM) &&
+	    fs->group_desc[group].bg_flags & EXT2_BG_INODE_UNINIT &&
+	    ext2fs_group_desc_csum_verify(fs, group))
+		blk = 0;
+	if (!blk) {
+		memset(bits, 0, nbytes);
+		return 0;
+	}
+	if (io_channel_read_blk(fs->io, blk, -nbytes, bits))
+		return EXT2_ET_INODE_BITMAP_READ;
 	return 0;
 }
 
@@ -141,7 +223,6 @@ static errcode_t read_bitmaps(ext2_filsys fs, int do_inode, int do_block)
 	errcode_t retval;
 	int block_nbytes = EXT2_BLOCKS_PER_GROUP(fs->super) / 8;
 	int inode_nbytes = EXT2_INODES_PER_GROUP(fs->super) / 8;
-	int csum_flag = 0;
 	int do_image = fs->flags & EXT2_FLAG_IMAGE_FILE;
 	unsigned int	cnt;
 	blk_t	blk;
@@ -154,10 +235,6 @@ static errcode_t read_bitmaps(ext2_filsys fs, int do_inode, int do_block)
 
 	fs->write_bitmaps = ext2fs_write_bitmaps;
 
-	if (EXT2_HAS_RO_COMPAT_FEATURE(fs->super,
-				       EXT4_FEATURE_RO_COMPAT_GDT_CSUM))
-		csum_flag = 1;
-
 	retval = ext2fs_get_mem(strlen(fs->device_name) + 80, &buf);
 	if (retval)
 		return retval;
@@ -233,22 +310,31 @@ static errcode_t read_bitmaps(ext2_filsys fs, int do_inode, int do_block)
 		goto success_cleanup;
 	}
 
+	/*
+	 * With EXT2_FLAG_LAZY_BITMAPS a group's bitmap is only read the
+	 * first time one of its bits is used.
+	 */
+	if (fs->flags & EXT2_FLAG_LAZY_BITMAPS) {
+		if (block_bitmap) {
+			retval = ext2fs_set_generic_bitmap_loader(fs->block_map,
+					block_nbytes << 3, read_block_group);
+			if (retval)
+				goto cleanup;
+		}
+		if (inode_bitmap) {
+			retval = ext2fs_set_generic_bitmap_loader(fs->inode_map,
+					inode_nbytes << 3, read_inode_group);
+			if (retval)
+				goto cleanup;
+		}
+		goto success_cleanup;
+	}
+
 	for (i = 0; i < fs->group_desc_count; i++) {
 		if (block_bitmap) {
-			blk = fs->group_desc[i].bg_block_bitmap;
-			if (csum_flag && fs->group_desc[i].bg_flags &
-			    EXT2_BG_BLOCK_UNINIT &&
-			    ext2fs_group_desc_csum_verify(fs, i))
-				blk = 0;
-			if (blk) {
-				retval = io_channel_read_blk(fs->io, blk,
-					     -block_nbytes, block_bitmap);
-				if (retval) {
-					retval = EXT2_ET_BLOCK_BITMAP_READ;
-					goto cleanup;
-				}
-			} else
-				memset(block_bitmap, 0, block_nbytes);
+			retval = read_block_group(fs, i, block_bitmap);
+			if (retval)
+				goto cleanup;
 			cnt = block_nbytes << 3;
 			retval = ext2fs_set_block_bitmap_range(fs->block_map,
 					       blk_itr, cnt, block_bitmap);
@@ -257,20 +343,9 @@ static errcode_t read_bitmaps(ext2_filsys fs, int do_inode, int do_block)
 			blk_itr += block_nbytes << 3;
 		}
 		if (inode_bitmap) {
-			blk = fs->group_desc[i].bg_inode_bitmap;
-			if (csum_flag && fs->group_desc[i].bg_flags &
-			    EXT2_BG_INODE_UNINIT &&
-			    ext2fs_group_desc_csum_verify(fs, i))
-				blk = 0;
-			if (blk) {
-				retval = io_channel_read_blk(fs->io, blk,
-					     -inode_nbytes, inode_bitmap);
-				if (retval) {
-					retval = EXT2_ET_INODE_BITMAP_READ;
-					goto cleanup;
-				}
-			} else
-				memset(inode_bitmap, 0, inode_nbytes);
+			retval = read_inode_group(fs, i, inode_bitmap);
+			if (retval)
+				goto cleanup;
 			cnt = inode_nbytes << 3;
 			retval = ext2fs_set_inode_bitmap_range(fs->inode_map,
 					       ino_itr, cnt, inode_bitmap);
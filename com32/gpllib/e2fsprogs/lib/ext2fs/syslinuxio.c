@@ -141,6 +141,8 @@ static errcode_t syslinux_write_blk(io_channel channel,
 				    int count, const void *buf);
 
 static errcode_t syslinux_flush(io_channel channel);
+static errcode_t syslinux_set_option(io_channel channel, const char *option,
+				     const char *arg);
 
 static struct struct_io_manager struct_syslinux_manager = {
   .magic       = EXT2_ET_MAGIC_IO_MANAGER,
@@ -151,6 +153,7 @@ static struct struct_io_manager struct_syslinux_manager = {
   .read_blk    = syslinux_read_blk,
   .write_blk   = syslinux_write_blk,
   .flush       = syslinux_flush,
+  .set_option  = syslinux_set_option,
 };
 
 io_manager syslinux_io_manager = &struct_syslinux_manager;
@@ -161,6 +164,7 @@ io_manager syslinux_io_manager = &struct_syslinux_manager;
 static io_channel alloc_io_channel(PARTITION *part)
 {
   io_channel     ioch;
+  struct syslinux_private_data *data;
 
   ioch = (io_channel)malloc(sizeof(struct struct_io_channel));
   if (!ioch)
@@ -174,7 +178,18 @@ static io_channel alloc_io_channel(PARTITION *part)
 	  return NULL;
   }
   strcpy(ioch->name, part->dev);
-  ioch->private_data = part;
+
+  data = (struct syslinux_private_data *)malloc(sizeof(*data));
+  if (!data) {
+	  free(ioch->name);
+	  free(ioch);
+	  return NULL;
+  }
+  memset(data, 0, sizeof(*data));
+  data->part = part;
+  data->cache_blocks = SYSLINUX_CACHE_BLOCKS;
+
+  ioch->private_data = data;
   ioch->block_size = 1024; /* The smallest ext2fs block size */
   ioch->read_error = 0;
   ioch->write_error = 0;
@@ -247,34 +262,21 @@ static errcode_t syslinux_open(const char *dev,
   return 0;
 }
 
-static errcode_t syslinux_close(io_channel channel)
-{
-	free(channel->name);
-	free(channel);
-
-	return 0;
-}
-
-static errcode_t syslinux_set_blksize(io_channel channel, int blksize)
-{
-  channel->block_size = blksize;
-  return 0;
-}
-
-static errcode_t syslinux_read_blk(io_channel channel, 
-				   unsigned long int block,
-				   int count, void *buf)
+/*
+ * Uncached disk access
+ */
+static errcode_t raw_read_blk(io_channel channel,
+			      struct syslinux_private_data *data,
+			      unsigned long int block,
+			      int count, void *buf)
 {
   char *sector_buf = NULL;
-  PARTITION     *part;
+  PARTITION     *part = data->part;
   size_t        size;
   ext2_loff_t   lba;
   int ret = 0;
   struct driveinfo *d = &drive;
 
-  EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
-  part = (PARTITION*)channel->private_data;
-  
   size = (size_t)((count < 0) ? -count : count * channel->block_size);
   lba  = (ext2_loff_t)(((block * channel->block_size) / SECTOR) + part->start);
 
@@ -303,6 +305,7 @@ static errcode_t syslinux_read_blk(io_channel channel,
 
   if(ret == -1) {
     printf("ERR: dev_read() failed\n");
+    free(sector_buf);
     return EFAULT;
   }
 
@@ -317,18 +320,16 @@ static errcode_t syslinux_read_blk(io_channel channel,
   return 0;
 }
 
-static errcode_t syslinux_write_blk(io_channel channel, 
-				    unsigned long int block,
-				    int count, const void *buf)
+static errcode_t raw_write_blk(io_channel channel,
+			       struct syslinux_private_data *data,
+			       unsigned long int block,
+			       int count, const void *buf)
 {
-  PARTITION     *part;
+  PARTITION     *part = data->part;
   ext2_loff_t   lba;
   size_t        size;
   int ret = 0;
 
-  EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
-  part = (PARTITION*)channel->private_data;
-  
   if (count < 0) {
     printf("Writing superblocks\n");
     size = (size_t)-count;
@@ -348,10 +349,487 @@ static errcode_t syslinux_write_blk(io_channel channel,
   return 0;
 }
 
-static errcode_t syslinux_flush(io_channel channel EXT2FS_ATTR((unused)))
+/*
+ * Block cache
+ */
+static void free_cache(struct syslinux_private_data *data)
+{
+  free(data->cache);
+  free(data->cache_mem);
+  free(data->xfer_buf);
+  data->cache = NULL;
+  data->cache_mem = NULL;
+  data->xfer_buf = NULL;
+  data->cache_sets = 0;
+}
+
+/*
+ * Size the cache for the current block size.  The number of sets is
+ * rounded down to a power of two so the set index is a simple mask.
+ * If that can't be done, the cache is turned off (cache_blocks = 0)
+ * and I/O goes straight to the disk from then on.
+ */
+static void alloc_cache(io_channel channel,
+			struct syslinux_private_data *data)
+{
+  int i, sets, nr;
+
+  free_cache(data);
+
+  sets = data->cache_blocks / SYSLINUX_CACHE_WAYS;
+  if (sets <= 0) {
+    data->cache_blocks = 0;
+    return;
+  }
+  while (sets & (sets - 1))
+    sets &= sets - 1;
+  nr = sets * SYSLINUX_CACHE_WAYS;
+
+  data->cache = malloc(nr * sizeof(struct syslinux_cache));
+  data->cache_mem = malloc(nr * channel->block_size);
+  if (channel->block_size < SYSLINUX_CACHE_MAX_XFER)
+    data->xfer_buf = malloc(SYSLINUX_CACHE_MAX_XFER);
+  if (!data->cache || !data->cache_mem) {
+    printf("ERR: can't malloc %d cache blocks, cache disabled\n", nr);
+    free_cache(data);
+    data->cache_blocks = 0;
+    return;
+  }
+
+  memset(data->cache, 0, nr * sizeof(struct syslinux_cache));
+  for (i = 0; i < nr; i++)
+    data->cache[i].buf = data->cache_mem + i * channel->block_size;
+  data->cache_sets = sets;
+}
+
+static inline struct syslinux_cache *cache_set(struct syslinux_private_data *data,
+					       unsigned long block)
+{
+  return &data->cache[(block & (data->cache_sets - 1)) * SYSLINUX_CACHE_WAYS];
+}
+
+/*
+ * Return the cache entry for block, or NULL if it isn't cached.
+ */
+static struct syslinux_cache *find_cached_block(struct syslinux_private_data *data,
+						unsigned long block)
+{
+  struct syslinux_cache *cache = cache_set(data, block);
+  int i;
+
+  for (i = 0; i < SYSLINUX_CACHE_WAYS; i++, cache++) {
+    if (cache->in_use && cache->block == block) {
+      cache->access_time = ++data->access_time;
+      return cache;
+    }
+  }
+  return NULL;
+}
+
+/*
+ * Claim an entry for block in its set, writing back the least
+ * recently used entry if it is dirty.
+ */
+static errcode_t reuse_cached_block(io_channel channel,
+				    struct syslinux_private_data *data,
+				    unsigned long block,
+				    struct syslinux_cache **ret_cache)
+{
+  struct syslinux_cache *cache = cache_set(data, block);
+  struct syslinux_cache *oldest = NULL;
+  errcode_t retval;
+  int i;
+
+  for (i = 0; i < SYSLINUX_CACHE_WAYS; i++, cache++) {
+    if (!cache->in_use) {
+      oldest = cache;
+      break;
+    }
+    if (!oldest || cache->access_time < oldest->access_time)
+      oldest = cache;
+  }
+
+  if (oldest->in_use) {
+    if (oldest->dirty) {
+      retval = raw_write_blk(channel, data, oldest->block, 1, oldest->buf);
+      if (retval)
+	return retval;
+      data->stats.writebacks++;
+    }
+    data->stats.evictions++;
+  }
+
+  oldest->in_use = 1;
+  oldest->dirty = 0;
+  oldest->block = block;
+  oldest->access_time = ++data->access_time;
+  *ret_cache = oldest;
+
+  return 0;
+}
+
+static int cache_block_cmp(const void *a, const void *b)
 {
+  const struct syslinux_cache *ca = *(const struct syslinux_cache * const *)a;
+  const struct syslinux_cache *cb = *(const struct syslinux_cache * const *)b;
+
+  if (ca->block < cb->block)
+    return -1;
+  return ca->block > cb->block;
+}
+
+/*
+ * Write out every dirty block in LBA order.  Runs of adjacent blocks
+ * are gathered into xfer_buf so they go out in a single disk write.
+ */
+static errcode_t flush_cached_blocks(io_channel channel,
+				     struct syslinux_private_data *data,
+				     int invalidate)
+{
+  struct syslinux_cache **dirty;
+  struct syslinux_cache *cache;
+  int i, j, n, nr, run, max_run;
+  errcode_t retval = 0;
+
+  if (!data->cache)
+    return 0;
+
+  nr = data->cache_sets * SYSLINUX_CACHE_WAYS;
+  dirty = malloc(nr * sizeof(*dirty));
+
+  for (i = n = 0; i < nr; i++) {
+    cache = &data->cache[i];
+    if (!cache->in_use || !cache->dirty)
+      continue;
+    if (dirty) {
+      dirty[n++] = cache;
+    } else {
+      /* No memory to sort, write the blocks out as they come */
+      retval = raw_write_blk(channel, data, cache->block, 1, cache->buf);
+      if (retval)
+	return retval;
+      cache->dirty = 0;
+      data->stats.writebacks++;
+    }
+  }
+
+  if (dirty) {
+    qsort(dirty, n, sizeof(*dirty), cache_block_cmp);
+
+    max_run = data->xfer_buf ? SYSLINUX_CACHE_MAX_XFER / channel->block_size : 1;
+    for (i = 0; i < n; i += run) {
+      run = 1;
+      while (i + run < n && run < max_run &&
+	     dirty[i + run]->block == dirty[i]->block + run)
+	run++;
+
+      if (run == 1) {
+	retval = raw_write_blk(channel, data, dirty[i]->block, 1,
+			       dirty[i]->buf);
+      } else {
+	for (j = 0; j < run; j++)
+	  memcpy(data->xfer_buf + j * channel->block_size,
+		 dirty[i + j]->buf, channel->block_size);
+	retval = raw_write_blk(channel, data, dirty[i]->block, run,
+			       data->xfer_buf);
+      }
+      if (retval)
+	break;
+
+      for (j = 0; j < run; j++)
+	dirty[i + j]->dirty = 0;
+      data->stats.writebacks += run;
+    }
+    free(dirty);
+    if (retval)
+      return retval;
+  }
+
+  if (invalidate) {
+    for (i = 0; i < nr; i++)
+      data->cache[i].in_use = 0;
+  }
+
+  return 0;
+}
+
+/*
+ * Write back (and optionally drop) any cached blocks in
+ * [block, block + count) before they are accessed behind the
+ * cache's back.
+ */
+static errcode_t sync_cached_range(io_channel channel,
+				   struct syslinux_private_data *data,
+				   unsigned long block, int count,
+				   int invalidate)
+{
+  struct syslinux_cache *cache;
+  errcode_t retval;
+  int i;
+
+  if (!data->cache)
+    return 0;
+
+  for (i = 0; i < count; i++) {
+    cache = find_cached_block(data, block + i);
+    if (!cache)
+      continue;
+    if (cache->dirty) {
+      retval = raw_write_blk(channel, data, cache->block, 1, cache->buf);
+      if (retval)
+	return retval;
+      cache->dirty = 0;
+      data->stats.writebacks++;
+    }
+    if (invalidate)
+      cache->in_use = 0;
+  }
+  return 0;
+}
+
+static errcode_t syslinux_close(io_channel channel)
+{
+	struct syslinux_private_data *data;
+	errcode_t retval;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct syslinux_private_data *)channel->private_data;
+
+	retval = flush_cached_blocks(channel, data, 0);
+
+	free_cache(data);
+	free(data);
+	free(channel->name);
+	free(channel);
+
+	return retval;
+}
+
+static errcode_t syslinux_set_blksize(io_channel channel, int blksize)
+{
+  struct syslinux_private_data *data;
+  errcode_t retval;
+
+  EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+  data = (struct syslinux_private_data *)channel->private_data;
+
+  if (channel->block_size != blksize) {
+    retval = flush_cached_blocks(channel, data, 0);
+    if (retval)
+      return retval;
+    free_cache(data);
+    channel->block_size = blksize;
+  }
+  return 0;
+}
+
+static errcode_t syslinux_read_blk(io_channel channel, 
+				   unsigned long int block,
+				   int count, void *buf)
+{
+  struct syslinux_private_data *data;
+  struct syslinux_cache *cache;
+  char *cp = (char *)buf;
+  errcode_t retval;
+  int i, run;
+
+  EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+  data = (struct syslinux_private_data *)channel->private_data;
+
+  /*
+   * Byte-sized reads (superblock, bitmaps) go straight to disk;
+   * make sure the disk is current for the blocks they cover first.
+   */
+  if (count < 0) {
+    retval = sync_cached_range(channel, data, block,
+			       (-count + channel->block_size - 1) /
+			       channel->block_size, 0);
+    if (retval)
+      return retval;
+    return raw_read_blk(channel, data, block, count, buf);
+  }
+
+  if (!data->cache && data->cache_blocks)
+    alloc_cache(channel, data);
+  if (!data->cache)
+    return raw_read_blk(channel, data, block, count, buf);
+
   /*
-   * No buffers, no flush...
+   * Reads larger than half the cache would only flush it out, so
+   * read them directly and patch in any blocks still dirty in memory.
    */
+  if (count > data->cache_sets * SYSLINUX_CACHE_WAYS / 2) {
+    retval = raw_read_blk(channel, data, block, count, buf);
+    if (retval)
+      return retval;
+    for (i = 0; i < count; i++) {
+      cache = find_cached_block(data, block + i);
+      if (cache && cache->dirty)
+	memcpy(cp + i * channel->block_size, cache->buf, channel->block_size);
+    }
+    data->stats.misses += count;
+    return 0;
+  }
+
+  while (count > 0) {
+    if ((cache = find_cached_block(data, block))) {
+      memcpy(cp, cache->buf, channel->block_size);
+      data->stats.hits++;
+      count--;
+      block++;
+      cp += channel->block_size;
+      continue;
+    }
+
+    /*
+     * Read the whole run of missing blocks with one request
+     * directly into the caller's buffer, then populate the cache.
+     */
+    for (run = 1; run < count; run++)
+      if (find_cached_block(data, block + run))
+	break;
+
+    retval = raw_read_blk(channel, data, block, run, cp);
+    if (retval)
+      return retval;
+    data->stats.misses += run;
+
+    for (i = 0; i < run; i++) {
+      if (reuse_cached_block(channel, data, block + i, &cache) == 0)
+	memcpy(cache->buf, cp + i * channel->block_size, channel->block_size);
+    }
+
+    count -= run;
+    block += run;
+    cp += run * channel->block_size;
+  }
+
+  return 0;
+}
+
+static errcode_t syslinux_write_blk(io_channel channel, 
+				    unsigned long int block,
+				    int count, const void *buf)
+{
+  struct syslinux_private_data *data;
+  struct syslinux_cache *cache;
+  const char *cp = (const char *)buf;
+  errcode_t retval;
+  int i, writethrough;
+
+  EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+  data = (struct syslinux_private_data *)channel->private_data;
+
+  /*
+   * Byte-sized writes bypass the cache; write back and drop any
+   * cached copy of the blocks they touch.
+   */
+  if (count < 0) {
+    retval = sync_cached_range(channel, data, block,
+			       (-count + channel->block_size - 1) /
+			       channel->block_size, 1);
+    if (retval)
+      return retval;
+    return raw_write_blk(channel, data, block, count, buf);
+  }
+
+  if (!data->cache && data->cache_blocks)
+    alloc_cache(channel, data);
+  if (!data->cache)
+    return raw_write_blk(channel, data, block, count, buf);
+
+  /*
+   * Large writes go straight to disk; refresh any cached copies so
+   * they don't go stale.
+   */
+  if (count > data->cache_sets * SYSLINUX_CACHE_WAYS / 2) {
+    retval = raw_write_blk(channel, data, block, count, buf);
+    if (retval)
+      return retval;
+    for (i = 0; i < count; i++) {
+      cache = find_cached_block(data, block + i);
+      if (cache) {
+	memcpy(cache->buf, cp + i * channel->block_size, channel->block_size);
+	cache->dirty = 0;
+      }
+    }
+    return 0;
+  }
+
+  writethrough = channel->flags & CHANNEL_FLAGS_WRITETHROUGH;
+  if (writethrough) {
+    retval = raw_write_blk(channel, data, block, count, buf);
+    if (retval)
+      return retval;
+  }
+
+  for (i = 0; i < count; i++, cp += channel->block_size) {
+    cache = find_cached_block(data, block + i);
+    if (!cache) {
+      retval = reuse_cached_block(channel, data, block + i, &cache);
+      if (retval)
+	return retval;
+    }
+    memcpy(cache->buf, cp, channel->block_size);
+    cache->dirty = !writethrough;
+  }
+
+  return 0;
+}
+
+static errcode_t syslinux_flush(io_channel channel)
+{
+  struct syslinux_private_data *data;
+
+  EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+  data = (struct syslinux_private_data *)channel->private_data;
+
+  return flush_cached_blocks(channel, data, 0);
+}
+
+/*
+ * Options (see io_channel_set_options()):
+ *   cache_blocks=N   size the block cache to N blocks, 0 disables it
+ */
+static errcode_t syslinux_set_option(io_channel channel, const char *option,
+				     const char *arg)
+{
+  struct syslinux_private_data *data;
+  errcode_t retval;
+  char *end;
+  long tmp;
+
+  EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+  data = (struct syslinux_private_data *)channel->private_data;
+
+  if (!strcmp(option, "cache_blocks")) {
+    if (!arg)
+      return EXT2_ET_INVALID_ARGUMENT;
+    tmp = strtol(arg, &end, 0);
+    if (*end || tmp < 0)
+      return EXT2_ET_INVALID_ARGUMENT;
+
+    retval = flush_cached_blocks(channel, data, 1);
+    if (retval)
+      return retval;
+    free_cache(data);
+    data->cache_blocks = (int)tmp;
+    return 0;
+  }
+
+  return EXT2_ET_INVALID_ARGUMENT;
+}
+
+errcode_t syslinux_get_cache_stats(io_channel channel,
+				   struct syslinux_cache_stats *stats)
+{
+  struct syslinux_private_data *data;
+
+  EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+  if (channel->manager != syslinux_io_manager)
+    return EXT2_ET_INVALID_ARGUMENT;
+  data = (struct syslinux_private_data *)channel->private_data;
+
+  *stats = data->stats;
   return 0;
 }
@@ -31,6 +31,41 @@ typedef struct
   unsigned short       sects;
 } PARTITION;
 
+/*
+ * Block cache
+ *
+ * The cache is set-associative: a block can only live in the set
+ * selected by the low bits of its block number, and each set holds
+ * SYSLINUX_CACHE_WAYS blocks which are replaced in LRU order.  Writes
+ * are held in the cache (write-back) until the channel is flushed,
+ * closed, or the entry is evicted.
+ */
+#define SYSLINUX_CACHE_WAYS	4
+#define SYSLINUX_CACHE_BLOCKS	256	/* default cache size in blocks */
+#define SYSLINUX_CACHE_MAX_XFER	32768	/* max bytes per merged write */
+
+struct syslinux_cache {
+  unsigned long        block;
+  unsigned long        access_time;
+  int                  in_use;
+  int                  dirty;
+  char                 *buf;
+};
+
+/*
+ * Per-channel private data
+ */
+struct syslinux_private_data {
+  PARTITION             *part;
+  int                   cache_blocks; /* requested size, 0 disables */
+  int                   cache_sets;   /* number of sets (power of 2) */
+  unsigned long         access_time;
+  struct syslinux_cache *cache;
+  char                  *cache_mem;
+  char                  *xfer_buf;    /* used to merge adjacent writes */
+  struct syslinux_cache_stats stats;
+};
+
 /*
  * PC partition table entry format
  */
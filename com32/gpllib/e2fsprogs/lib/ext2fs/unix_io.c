@@ -0,0 +1,309 @@
+/*
+ * unix_io.c --- POSIX file I/O manager for the ext2fs library
+ *
+ * Copyright 2010 Don Hiatt - All Rights Reserved
+ * This file may be distributed under the terms of the GNU LGPL
+ * (GNU Lesser General Public License)
+ *
+ * Based on:
+ *   unix_io.c -- This is the Unix (well, really POSIX) implementation
+ *     of the I/O manager.
+ *     Copyright (C) 1993, 1994, 1995 Theodore Ts'o.
+ *
+ * Used by the host build of ext2fs so the library can be run and
+ * timed against a filesystem image file.  Blocks are transferred
+ * with pread()/pwrite(); there is no caching at this level.
+ */
+
+#if !defined(HAVE_SYSLINUX_BUILD)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#if HAVE_ERRNO_H
+#include <errno.h>
+#endif
+#include <fcntl.h>
+#if HAVE_SYS_STAT_H
+#include <sys/stat.h>
+#endif
+#if HAVE_SYS_TYPES_H
+#include <sys/types.h>
+#endif
+
+#include "ext2_fs.h"
+#include "ext2fs.h"
+
+struct unix_private_data {
+	int	magic;
+	int	dev;
+	struct struct_io_stats io_stats;
+};
+
+static errcode_t unix_open(const char *name, int flags, io_channel *channel);
+static errcode_t unix_close(io_channel channel);
+static errcode_t unix_set_blksize(io_channel channel, int blksize);
+static errcode_t unix_read_blk(io_channel channel, unsigned long block,
+			       int count, void *data);
+static errcode_t unix_write_blk(io_channel channel, unsigned long block,
+				int count, const void *data);
+static errcode_t unix_read_blk64(io_channel channel, unsigned long long block,
+				 int count, void *data);
+static errcode_t unix_write_blk64(io_channel channel, unsigned long long block,
+				  int count, const void *data);
+static errcode_t unix_flush(io_channel channel);
+static errcode_t unix_write_byte(io_channel channel, unsigned long offset,
+				 int size, const void *data);
+static errcode_t unix_get_stats(io_channel channel, io_stats *stats);
+
+static struct struct_io_manager struct_unix_manager = {
+	.magic		= EXT2_ET_MAGIC_IO_MANAGER,
+	.name		= "Unix I/O Manager",
+	.open		= unix_open,
+	.close		= unix_close,
+	.set_blksize	= unix_set_blksize,
+	.read_blk	= unix_read_blk,
+	.write_blk	= unix_write_blk,
+	.flush		= unix_flush,
+	.write_byte	= unix_write_byte,
+	.get_stats	= unix_get_stats,
+	.read_blk64	= unix_read_blk64,
+	.write_blk64	= unix_write_blk64,
+};
+
+io_manager unix_io_manager = &struct_unix_manager;
+
+static errcode_t unix_get_stats(io_channel channel, io_stats *stats)
+{
+	struct unix_private_data *data;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct unix_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
+
+	if (stats)
+		*stats = &data->io_stats;
+
+	return 0;
+}
+
+static errcode_t unix_open(const char *name, int flags, io_channel *channel)
+{
+	io_channel	io = NULL;
+	struct unix_private_data *data = NULL;
+	errcode_t	retval;
+	int		open_flags;
+
+	if (name == 0)
+		return EXT2_ET_BAD_DEVICE_NAME;
+	retval = ext2fs_get_mem(sizeof(struct struct_io_channel), &io);
+	if (retval)
+		return retval;
+	memset(io, 0, sizeof(struct struct_io_channel));
+	io->magic = EXT2_ET_MAGIC_IO_CHANNEL;
+	retval = ext2fs_get_mem(sizeof(struct unix_private_data), &data);
+	if (retval)
+		goto cleanup;
+
+	io->manager = unix_io_manager;
+	retval = ext2fs_get_mem(strlen(name)+1, &io->name);
+	if (retval)
+		goto cleanup;
+	strcpy(io->name, name);
+	io->private_data = data;
+	io->block_size = 1024;
+	io->read_error = 0;
+	io->write_error = 0;
+	io->refcount = 1;
+
+	memset(data, 0, sizeof(struct unix_private_data));
+	data->magic = EXT2_ET_MAGIC_UNIX_IO_CHANNEL;
+	data->io_stats.num_fields = 2;
+
+	open_flags = (flags & IO_FLAG_RW) ? O_RDWR : O_RDONLY;
+	if (flags & IO_FLAG_EXCLUSIVE)
+		open_flags |= O_EXCL;
+	data->dev = open(io->name, open_flags);
+	if (data->dev < 0) {
+		retval = errno;
+		goto cleanup;
+	}
+
+	*channel = io;
+	return 0;
+
+cleanup:
+	if (data)
+		ext2fs_free_mem(&data);
+	if (io) {
+		if (io->name)
+			ext2fs_free_mem(&io->name);
+		ext2fs_free_mem(&io);
+	}
+	return retval;
+}
+
+static errcode_t unix_close(io_channel channel)
+{
+	struct unix_private_data *data;
+	errcode_t	retval = 0;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct unix_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
+
+	if (--channel->refcount > 0)
+		return 0;
+
+	if (close(data->dev) < 0)
+		retval = errno;
+
+	ext2fs_free_mem(&channel->private_data);
+	if (channel->name)
+		ext2fs_free_mem(&channel->name);
+	ext2fs_free_mem(&channel);
+	return retval;
+}
+
+static errcode_t unix_set_blksize(io_channel channel, int blksize)
+{
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+
+	channel->block_size = blksize;
+	return 0;
+}
+
+static errcode_t unix_read_blk64(io_channel channel, unsigned long long block,
+				 int count, void *buf)
+{
+	struct unix_private_data *data;
+	errcode_t	retval;
+	size_t		size;
+	ext2_loff_t	location;
+	ssize_t		actual = 0;
+	char		*cp = buf;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct unix_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
+
+	size = (count < 0) ? (size_t) -count : (size_t) count * channel->block_size;
+	location = (ext2_loff_t) block * channel->block_size;
+	data->io_stats.bytes_read += size;
+
+	while (size > 0) {
+		actual = pread(data->dev, cp, size, location);
+		if (actual < 0 && errno == EINTR)
+			continue;
+		if (actual <= 0)
+			break;
+		cp += actual;
+		size -= actual;
+		location += actual;
+	}
+	if (size == 0)
+		return 0;
+
+	retval = (actual < 0) ? errno : EXT2_ET_SHORT_READ;
+	/* Zero out the unread part so callers never see stale data */
+	memset(cp, 0, size);
+	if (channel->read_error)
+		retval = (channel->read_error)(channel, block, count, buf,
+					       cp - (char *) buf + size,
+					       cp - (char *) buf, retval);
+	return retval;
+}
+
+static errcode_t unix_read_blk(io_channel channel, unsigned long block,
+			       int count, void *buf)
+{
+	return unix_read_blk64(channel, block, count, buf);
+}
+
+static errcode_t unix_write_blk64(io_channel channel, unsigned long long block,
+				  int count, const void *buf)
+{
+	struct unix_private_data *data;
+	errcode_t	retval;
+	size_t		size;
+	ext2_loff_t	location;
+	ssize_t		actual = 0;
+	const char	*cp = buf;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct unix_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
+
+	size = (count < 0) ? (size_t) -count : (size_t) count * channel->block_size;
+	location = (ext2_loff_t) block * channel->block_size;
+	data->io_stats.bytes_written += size;
+
+	while (size > 0) {
+		actual = pwrite(data->dev, cp, size, location);
+		if (actual < 0 && errno == EINTR)
+			continue;
+		if (actual <= 0)
+			break;
+		cp += actual;
+		size -= actual;
+		location += actual;
+	}
+	if (size == 0)
+		return 0;
+
+	retval = (actual < 0) ? errno : EXT2_ET_SHORT_WRITE;
+	if (channel->write_error)
+		retval = (channel->write_error)(channel, block, count, buf,
+						cp - (const char *) buf + size,
+						cp - (const char *) buf, retval);
+	return retval;
+}
+
+static errcode_t unix_write_blk(io_channel channel, unsigned long block,
+				int count, const void *buf)
+{
+	return unix_write_blk64(channel, block, count, buf);
+}
+
+static errcode_t unix_write_byte(io_channel channel, unsigned long offset,
+				 int size, const void *buf)
+{
+	struct unix_private_data *data;
+	ssize_t		actual;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct unix_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
+
+	if (size < 0)
+		return EXT2_ET_INVALID_ARGUMENT;
+
+	data->io_stats.bytes_written += size;
+	actual = pwrite(data->dev, buf, size, (ext2_loff_t) offset);
+	if (actual < 0)
+		return errno;
+	if (actual != size)
+		return EXT2_ET_SHORT_WRITE;
+
+	return 0;
+}
+
+static errcode_t unix_flush(io_channel channel)
+{
+	struct unix_private_data *data;
+	errcode_t retval = 0;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct unix_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
+
+	if (fsync(data->dev) < 0)
+		retval = errno;
+
+	return retval;
+}
+
+#endif /* !defined(HAVE_SYSLINUX_BUILD) */
@@ -89,6 +89,11 @@ errcode_t ext2fs_unlink(ext2_filsys fs, ext2_ino_t dir,
 	ls.done = 0;
 	ls.prev = 0;
 
+	/* Without a name we don't know which entry goes: forget them all */
+	ext2fs_dcache_invalidate(fs, dir, name, ls.namelen);
+	if (ino)
+		ext2fs_dcache_invalidate(fs, ino, 0, 0);
+
 	retval = ext2fs_dir_iterate(fs, dir, DIRENT_FLAG_INCLUDE_EMPTY,
 				    0, unlink_proc, &ls);
 	if (retval)
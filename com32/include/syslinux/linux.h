@@ -40,7 +40,9 @@
 /* A chunk of an initramfs.  These are kept as a doubly-linked
    circular list with headnode; the headnode is distinguished by
    having len == 0.  The data pointer can be NULL if data_len is zero;
-   if data_len < len then the balance of the region is zeroed. */
+   if data_len < len then the balance of the region is zeroed.
+   In the headnode, data and data_len describe the memory set aside
+   with initramfs_reserve(), if any. */
 
 struct initramfs {
     struct initramfs *prev, *next;
@@ -69,5 +71,8 @@ int initramfs_load_file(struct initramfs *ihead, const char *src_filename,
 			const char *dst_filename, int do_mkdir, uint32_t mode);
 int initramfs_add_trailer(struct initramfs *ihead);
 int initramfs_load_archive(struct initramfs *ihead, const char *filename);
+int initramfs_reserve(struct initramfs *ihead, size_t len,
+		      const void *kernel_buf, size_t kernel_size,
+		      const char *cmdline);
 
 #endif /* _SYSLINUX_LINUX_H */
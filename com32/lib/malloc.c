@@ -154,3 +154,81 @@ void *malloc(size_t size)
     /* Nothing found... need to request a block from the kernel */
     return NULL;		/* No kernel to get stuff from */
 }
+
+/*
+ * Allocate size bytes aligned to align (a power of two) from the highest
+ * address where they fit, ending at or below limit (0 for no limit).
+ * This keeps a large, long-lived buffer out of the way of ordinary
+ * allocations, which are made from the bottom up.
+ */
+void *malloc_high(size_t size, size_t align, size_t limit)
+{
+    struct free_arena_header *fp, *nfp, *best = NULL;
+    size_t start, top, here, best_here = 0;
+
+    if (size == 0)
+	return NULL;
+
+    if (align < sizeof(struct arena_header))
+	align = sizeof(struct arena_header);
+
+    /* Add the obligatory arena header, and round up */
+    size = (size + 2 * sizeof(struct arena_header) - 1) & ARENA_SIZE_MASK;
+
+    for (fp = __malloc_head.next_free; fp->a.type != ARENA_TYPE_HEAD;
+	 fp = fp->next_free) {
+	start = (size_t)fp;
+	top = start + fp->a.size;
+	if (limit && top > limit)
+	    top = limit;
+	if (top < start || top - start < size)
+	    continue;
+
+	/* The data gets the alignment, not the arena header */
+	here = ((top - size + sizeof(struct arena_header)) & ~(align - 1))
+	    - sizeof(struct arena_header);
+	if (here < start)
+	    continue;
+
+	/* Whatever is left below has to be big enough to be a free block */
+	if (here != start && here - start < 2 * sizeof(struct arena_header)) {
+	    if (here - start < align)
+		continue;
+	    here -= align;
+	}
+
+	if (!best || here > best_here) {
+	    best = fp;
+	    best_here = here;
+	}
+    }
+
+    if (!best)
+	return NULL;
+
+    fp = best;
+    if (best_here != (size_t)fp) {
+	/* Split off the part below as a free block of its own */
+	nfp = (struct free_arena_header *)best_here;
+	nfp->a.type = ARENA_TYPE_FREE;
+	nfp->a.size = fp->a.size - (best_here - (size_t)fp);
+	fp->a.size = best_here - (size_t)fp;
+
+	/* Insert into all-block chain */
+	nfp->a.prev = fp;
+	nfp->a.next = fp->a.next;
+	fp->a.next->a.prev = nfp;
+	fp->a.next = nfp;
+
+	/* Insert into free chain */
+	nfp->next_free = fp->next_free;
+	nfp->prev_free = fp;
+	fp->next_free->prev_free = nfp;
+	fp->next_free = nfp;
+
+	fp = nfp;
+    }
+
+    /* Allocate from the start of what is left, freeing any tail */
+    return __malloc_from_block(fp, size);
+}
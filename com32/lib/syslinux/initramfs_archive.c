@@ -31,14 +31,74 @@
  * Utility function to load an initramfs archive.
  */
 
+#include <stdio.h>
 #include <stdlib.h>
+#include <sys/stat.h>
 #include <syslinux/loadfile.h>
 #include <syslinux/linux.h>
 
+/*
+ * Read an archive straight into the memory reserved with
+ * initramfs_reserve(), right after the archives already there.
+ * Returns 1 if that can't be done, so the archive should be loaded
+ * the usual way instead.
+ */
+static int load_archive_reserved(struct initramfs *ihead,
+				 const char *filename)
+{
+    struct initramfs *last = ihead->prev;
+    const char *base = ihead->data;
+    size_t offset = 0;
+    size_t len;
+    struct stat st;
+    FILE *f;
+    int rv = 1;
+
+    if (!base)
+	return 1;
+
+    /* Only while the reserved memory holds the whole initramfs so far */
+    if (last != ihead) {
+	if ((const char *)last->data < base ||
+	    (const char *)last->data > base + ihead->data_len ||
+	    last->len > (size_t)(base + ihead->data_len -
+				 (const char *)last->data))
+	    return 1;
+	offset = ((const char *)last->data - base) + last->len;
+	offset = (offset + 3) & ~3;
+    }
+
+    f = fopen(filename, "r");
+    if (!f)
+	return -1;
+
+    if (fstat(fileno(f), &st) || !S_ISREG(st.st_mode) ||
+	offset > ihead->data_len ||
+	(size_t)st.st_size > ihead->data_len - offset)
+	goto done;
+
+    len = st.st_size;
+    if (fread((char *)base + offset, 1, len, f) != len) {
+	rv = -1;
+	goto done;
+    }
+
+    rv = initramfs_add_data(ihead, base + offset, len, len, 4);
+
+done:
+    fclose(f);
+    return rv;
+}
+
 int initramfs_load_archive(struct initramfs *ihead, const char *filename)
 {
     void *data;
     size_t len;
+    int rv;
+
+    rv = load_archive_reserved(ihead, filename);
+    if (rv <= 0)
+	return rv;
 
     if (loadfile(filename, &data, &len))
 	return -1;
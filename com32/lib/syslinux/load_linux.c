@@ -164,6 +164,21 @@ static inline uint32_t saturate32(unsigned long long v)
     return (v > 0xffffffff) ? 0xffffffff : (uint32_t) v;
 }
 
+/* The end of the memory the kernel and initramfs may use; 0 for no limit */
+static uint32_t linux_memlimit(const char *cmdline, uint32_t initrd_addr_max)
+{
+    const char *arg;
+    uint32_t memlimit = 0;
+
+    if ((arg = find_argument(cmdline, "mem=")))
+	memlimit = saturate32(suffix_number(arg));
+
+    if (!memlimit && memlimit - 1 > initrd_addr_max)
+	memlimit = initrd_addr_max + 1;	/* Zero for no limit */
+
+    return memlimit;
+}
+
 /* Get the combined size of the initramfs */
 static addr_t initramfs_size(struct initramfs *initramfs)
 {
@@ -216,6 +231,40 @@ static int map_initramfs(struct syslinux_movelist **fraglist,
     return 0;
 }
 
+/*
+ * Reserve len bytes as high as the kernel will take an initramfs, so
+ * that initramfs_load_archive() can read the archives straight into
+ * the place syslinux_boot_linux() then boots them from, instead of
+ * loading them elsewhere and copying them there.
+ */
+int initramfs_reserve(struct initramfs *ihead, size_t len,
+		      const void *kernel_buf, size_t kernel_size,
+		      const char *cmdline)
+{
+    const struct linux_header *hdr = kernel_buf;
+    uint32_t initrd_addr_max;
+    void *data;
+
+    if (ihead->data || ihead->next != ihead || !len)
+	return -1;
+
+    if (kernel_size < 2 * 512 || hdr->boot_flag != BOOT_MAGIC ||
+	hdr->header != LINUX_MAGIC)
+	return -1;		/* No initramfs support */
+
+    initrd_addr_max = hdr->version < 0x0203 ? 0x37ffffff
+	: hdr->initrd_addr_max;
+
+    data = malloc_high(len, INITRAMFS_MAX_ALIGN,
+		       linux_memlimit(cmdline, initrd_addr_max));
+    if (!data)
+	return -1;
+
+    ihead->data = data;
+    ihead->data_len = len;
+    return 0;
+}
+
 int syslinux_boot_linux(void *kernel_buf, size_t kernel_size,
 			struct initramfs *initramfs, char *cmdline)
 {
@@ -229,7 +278,7 @@ int syslinux_boot_linux(void *kernel_buf, size_t kernel_size,
     struct syslinux_memmap *mmap = NULL;
     struct syslinux_memmap *amap = NULL;
     bool ok;
-    uint32_t memlimit = 0;
+    uint32_t memlimit;
     uint16_t video_mode = 0;
     const char *arg;
 
@@ -239,9 +288,6 @@ int syslinux_boot_linux(void *kernel_buf, size_t kernel_size,
 	goto bail;
 
     /* Look for specific command-line arguments we care about */
-    if ((arg = find_argument(cmdline, "mem=")))
-	memlimit = saturate32(suffix_number(arg));
-
     if ((arg = find_argument(cmdline, "vga="))) {
 	switch (arg[0] | 0x20) {
 	case 'a':		/* "ask" */
@@ -283,8 +329,7 @@ int syslinux_boot_linux(void *kernel_buf, size_t kernel_size,
     if (hdr.version < 0x0203)
 	hdr.initrd_addr_max = 0x37ffffff;
 
-    if (!memlimit && memlimit - 1 > hdr.initrd_addr_max)
-	memlimit = hdr.initrd_addr_max + 1;	/* Zero for no limit */
+    memlimit = linux_memlimit(cmdline, hdr.initrd_addr_max);
 
     if (hdr.version < 0x0205 || !(hdr.loadflags & LOAD_HIGH))
 	hdr.relocatable_kernel = 0;
@@ -451,7 +496,9 @@ int syslinux_boot_linux(void *kernel_buf, size_t kernel_size,
 
     /* Figure out the size of the initramfs, and where to put it.
        We should put it at the highest possible address which is
-       <= hdr.initrd_addr_max, which fits the entire initramfs. */
+       <= hdr.initrd_addr_max, which fits the entire initramfs,
+       unless it was read straight into memory reserved for it with
+       initramfs_reserve() and can stay where it is. */
 
     irf_size = initramfs_size(initramfs);	/* Handles initramfs == NULL */
 
@@ -461,11 +508,19 @@ int syslinux_boot_linux(void *kernel_buf, size_t kernel_size,
 	const addr_t align_mask = INITRAMFS_MAX_ALIGN - 1;
 
 	if (irf_size) {
-	    for (ml = amap; ml->type != SMT_END; ml = ml->next) {
-		addr_t adj_start = (ml->start + align_mask) & ~align_mask;
-		addr_t adj_end = ml->next->start & ~align_mask;
-		if (ml->type == SMT_FREE && adj_end - adj_start >= irf_size)
-		    best_addr = (adj_end - irf_size) & ~align_mask;
+	    addr_t here = (addr_t) initramfs->next->data;
+
+	    if (here && initramfs->next->data == initramfs->data &&
+		!(here & align_mask) &&
+		syslinux_memmap_type(amap, here, irf_size) == SMT_FREE) {
+		best_addr = here;
+	    } else {
+		for (ml = amap; ml->type != SMT_END; ml = ml->next) {
+		    addr_t adj_start = (ml->start + align_mask) & ~align_mask;
+		    addr_t adj_end = ml->next->start & ~align_mask;
+		    if (ml->type == SMT_FREE && adj_end - adj_start >= irf_size)
+			best_addr = (adj_end - irf_size) & ~align_mask;
+		}
 	    }
 
 	    if (!best_addr)
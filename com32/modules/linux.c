@@ -43,6 +43,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <console.h>
+#include <sys/stat.h>
 #include <syslinux/loadfile.h>
 #include <syslinux/linux.h>
 #include <syslinux/pxe.h>
@@ -78,6 +79,37 @@ static int find_boolean(char **argv, const char *argument)
     return 0;
 }
 
+/* Add up the sizes of the initrd= archives as laid out in the initramfs;
+   zero if the size of any of them is not known up front */
+static size_t initrd_size(char *arg)
+{
+    struct stat st;
+    size_t size = 0;
+    FILE *f;
+    char *p;
+    bool ok;
+
+    do {
+	p = strchr(arg, ',');
+	if (p)
+	    *p = '\0';
+
+	f = fopen(arg, "r");
+	ok = f && !fstat(fileno(f), &st) && S_ISREG(st.st_mode);
+	if (f)
+	    fclose(f);
+
+	if (p)
+	    *p++ = ',';
+
+	if (!ok)
+	    return 0;
+	size = ((size + 3) & ~3) + st.st_size;
+    } while ((arg = p));
+
+    return size;
+}
+
 /* Stitch together the command line from a set of argv's */
 static char *make_cmdline(char **argv)
 {
@@ -111,11 +143,12 @@ static char *make_cmdline(char **argv)
 int main(int argc, char *argv[])
 {
     const char *kernel_name;
-    struct initramfs *initramfs;
+    struct initramfs *initramfs = NULL;
     char *cmdline;
     char *boot_image;
     void *kernel_data;
     size_t kernel_len;
+    size_t irf_len;
     bool opt_dhcpinfo = false;
     bool opt_quiet = false;
     void *dhcpdata;
@@ -177,7 +210,22 @@ int main(int argc, char *argv[])
     if (!initramfs)
 	goto bail;
 
+    if (opt_dhcpinfo &&
+	pxe_get_cached_info(PXENV_PACKET_TYPE_DHCP_ACK, &dhcpdata, &dhcplen))
+	opt_dhcpinfo = false;
+
     if ((arg = find_argument(argp, "initrd="))) {
+	/* Set aside memory where the initramfs will be booted from, so
+	   the archives can be read straight into it rather than copied
+	   there at the end; if that fails, they are loaded as before */
+	irf_len = initrd_size(arg);
+	if (irf_len) {
+	    if (opt_dhcpinfo)
+		irf_len += dhcplen + 512;	/* Plus its cpio header */
+	    initramfs_reserve(initramfs, irf_len, kernel_data, kernel_len,
+			      cmdline);
+	}
+
 	do {
 	    p = strchr(arg, ',');
 	    if (p)
@@ -200,8 +248,7 @@ int main(int argc, char *argv[])
     }
 
     /* Append the DHCP info */
-    if (opt_dhcpinfo &&
-	!pxe_get_cached_info(PXENV_PACKET_TYPE_DHCP_ACK, &dhcpdata, &dhcplen)) {
+    if (opt_dhcpinfo) {
 	if (initramfs_add_file(initramfs, dhcpdata, dhcplen, dhcplen,
 			       "/dhcpinfo.dat", 0, 0755))
 	    goto bail;
@@ -211,6 +258,9 @@ int main(int argc, char *argv[])
     syslinux_boot_linux(kernel_data, kernel_len, initramfs, cmdline);
 
 bail:
+    /* Don't leave the initramfs memory pinned at the top of the heap */
+    if (initramfs && initramfs->data)
+	free((void *)initramfs->data);
     fprintf(stderr, "Kernel load failure (insufficient memory?)\n");
     return 1;
 }
@@ -19,6 +19,7 @@
 #include <disk.h>
 #include <fs.h>
 #include <dirent.h>
+#include <minmax.h>
 #include "btrfs.h"
 
 /* compare function used for bin_search */
@@ -512,76 +513,254 @@ static int btrfs_readdir(struct file *file, struct dirent *dirent)
 	return 0;
 }
 
-static int btrfs_next_extent(struct inode *inode, uint32_t lstart)
+/*
+ * Find the file extent item covering byte pos of inode; the item is
+ * left in path.  Returns 0 on success.
+ */
+static int btrfs_find_file_extent(struct inode *inode, u64 pos,
+				  struct btrfs_path *path)
 {
 	struct btrfs_disk_key search_key;
-	struct btrfs_file_extent_item extent_item;
-	struct btrfs_path path;
-	int ret;
-	u64 offset;
-	struct fs_info *fs = inode->fs;
-	u32 sec_shift = SECTOR_SHIFT(fs);
-	u32 sec_size = SECTOR_SIZE(fs);
+	struct btrfs_file_extent_item *extent_item;
+	u64 len;
 
 	search_key.objectid = inode->ino;
 	search_key.type = BTRFS_EXTENT_DATA_KEY;
-	search_key.offset = lstart << sec_shift;
-	clear_path(&path);
-	ret = search_tree(fs, fs_tree, &search_key, &path);
-	if (ret) { /* impossible */
+	search_key.offset = pos;
+	clear_path(path);
+	search_tree(inode->fs, fs_tree, &search_key, path);
+	extent_item = (struct btrfs_file_extent_item *)path->data;
+
+	if (btrfs_comp_keys_type(&search_key, &path->item.key)) {
 		printf("btrfs: search extent data error!\n");
 		return -1;
 	}
-	extent_item = *(struct btrfs_file_extent_item *)path.data;
+	if (extent_item->type == BTRFS_FILE_EXTENT_INLINE)
+		len = extent_item->ram_bytes;
+	else
+		len = extent_item->num_bytes;
+	if (pos >= path->item.key.offset + len) {
+		printf("btrfs: no extent data at %llu!\n", pos);
+		return -1;
+	}
+	if (extent_item->encryption) {
+		printf("btrfs: found encrypted data, cannot continue!\n");
+		return -1;
+	}
+	return 0;
+}
+
+static int btrfs_next_extent(struct inode *inode, uint32_t lstart)
+{
+	struct btrfs_file_extent_item *extent_item;
+	struct btrfs_path path;
+	u64 offset, delta;
+	struct fs_info *fs = inode->fs;
+	u32 sec_shift = SECTOR_SHIFT(fs);
+	u32 sec_size = SECTOR_SIZE(fs);
+
+	offset = (u64)lstart << sec_shift;
+	if (btrfs_find_file_extent(inode, offset, &path))
+		return -1;
+	extent_item = (struct btrfs_file_extent_item *)path.data;
 
-	if (extent_item.encryption) {
-	    printf("btrfs: found encrypted data, cannot continue!\n");
-	    return -1;
+	/* these have no sectors to map; btrfs_read_decoded() reads them */
+	if (extent_item->type == BTRFS_FILE_EXTENT_INLINE ||
+	    extent_item->compression)
+		return -1;
+
+	delta = offset - path.item.key.offset;
+	inode->next_extent.len =
+		(extent_item->num_bytes - delta + sec_size - 1) >> sec_shift;
+	if (!extent_item->disk_bytenr ||
+	    extent_item->type == BTRFS_FILE_EXTENT_PREALLOC) {
+		inode->next_extent.pstart = EXTENT_ZERO;
+	} else {
+		offset = extent_item->disk_bytenr + extent_item->offset + delta;
+		inode->next_extent.pstart =
+			logical_physical(offset) >> sec_shift;
 	}
-	if (extent_item.compression) {
-	    printf("btrfs: found compressed data, cannot continue!\n");
-	    return -1;
+	return 0;
+}
+
+/*
+ * Decoded copies of the last few compressed extents read, most recently
+ * used first, so that reading one a few sectors at a time reads and
+ * decompresses it only once.
+ */
+#define BTRFS_DECODED_EXTENTS 2
+
+struct btrfs_decoded_extent {
+	u64 bytenr;	/* logical address of the compressed data */
+	u32 len;	/* decoded length, 0 if the slot is unused */
+	char *data;
+};
+
+static struct btrfs_decoded_extent decoded[BTRFS_DECODED_EXTENTS];
+static __hugebss char decoded_buf[BTRFS_DECODED_EXTENTS]
+				 [BTRFS_MAX_UNCOMPRESSED];
+static __hugebss char compressed_buf[BTRFS_MAX_COMPRESSED];
+
+static void btrfs_init_decoded(void)
+{
+	int i;
+
+	for (i = 0; i < BTRFS_DECODED_EXTENTS; i++) {
+		decoded[i].len = 0;
+		decoded[i].data = decoded_buf[i];
 	}
+}
 
-	if (extent_item.type == BTRFS_FILE_EXTENT_INLINE) {/* inline file */
-		/* we fake a extent here, and PVT of inode will tell us */
-		offset = path.offsets[0] + sizeof(struct btrfs_header)
-			+ path.item.offset
+/* return the decoded data of the compressed extent in path */
+static const char *btrfs_decode_extent(struct fs_info *fs,
+				       struct btrfs_path *path, u32 *len)
+{
+	struct disk *disk = fs->fs_dev->disk;
+	struct btrfs_file_extent_item *extent_item =
+		(struct btrfs_file_extent_item *)path->data;
+	struct btrfs_decoded_extent de;
+	const char *in;
+	size_t in_len;
+	u64 bytenr, phys;
+	int i, ret;
+
+	if (extent_item->type == BTRFS_FILE_EXTENT_INLINE) {
+		bytenr = path->offsets[0] + sizeof(struct btrfs_header)
+			+ path->item.offset
 			+ offsetof(struct btrfs_file_extent_item, disk_bytenr);
-		inode->next_extent.len =
-			(inode->size + sec_size -1) >> sec_shift;
+		in = (char *)&extent_item->disk_bytenr;
+		in_len = path->item.size
+			- offsetof(struct btrfs_file_extent_item, disk_bytenr);
 	} else {
-		offset = extent_item.disk_bytenr + extent_item.offset;
-		inode->next_extent.len =
-			(extent_item.num_bytes + sec_size - 1) >> sec_shift;
+		bytenr = extent_item->disk_bytenr;
+		in = compressed_buf;
+		in_len = extent_item->disk_num_bytes;
 	}
-	inode->next_extent.pstart =
-		logical_physical(offset) >> sec_shift;
-	PVT(inode)->offset = offset;
-	return 0;
+
+	for (i = 0; i < BTRFS_DECODED_EXTENTS; i++)
+		if (decoded[i].len && decoded[i].bytenr == bytenr)
+			goto found;
+
+	if (extent_item->compression != BTRFS_COMPRESS_ZLIB &&
+	    extent_item->compression != BTRFS_COMPRESS_LZO) {
+		printf("btrfs: unsupported compression type %d!\n",
+		       extent_item->compression);
+		return NULL;
+	}
+	if (extent_item->ram_bytes > BTRFS_MAX_UNCOMPRESSED ||
+	    in_len > BTRFS_MAX_COMPRESSED) {
+		printf("btrfs: compressed extent too large!\n");
+		return NULL;
+	}
+
+	i = BTRFS_DECODED_EXTENTS - 1;	/* least recently used */
+	decoded[i].len = 0;
+
+	if (extent_item->type != BTRFS_FILE_EXTENT_INLINE) {
+		phys = logical_physical(bytenr);
+		if (phys == (u64)-1)
+			return NULL;
+		disk->rdwr_sectors(disk, compressed_buf,
+				   phys >> SECTOR_SHIFT(fs),
+				   in_len >> SECTOR_SHIFT(fs), 0);
+	}
+
+	ret = btrfs_decompress(extent_item->compression, in, in_len,
+			       decoded[i].data, extent_item->ram_bytes,
+			       sb.sectorsize);
+	if (ret <= 0) {
+		printf("btrfs: bad compressed extent at %llu!\n", bytenr);
+		return NULL;
+	}
+	decoded[i].bytenr = bytenr;
+	decoded[i].len = ret;
+
+found:
+	de = decoded[i];
+	memmove(&decoded[1], &decoded[0], i * sizeof(de));
+	decoded[0] = de;
+
+	*len = de.len;
+	return de.data;
 }
 
-static uint32_t btrfs_getfssec(struct file *file, char *buf, int sectors,
-					bool *have_more)
+/*
+ * Read from an inline or compressed extent at the file position; these
+ * cannot be read straight from disk.  Returns the bytes read, 0 if the
+ * extent there is a plain one, or -1 on error.
+ */
+static int btrfs_read_decoded(struct file *file, char *buf, int sectors)
 {
-	u32 ret;
+	struct inode *inode = file->inode;
 	struct fs_info *fs = file->fs;
-	u32 off = PVT(file->inode)->offset % SECTOR_SIZE(fs);
-	bool handle_inline = false;
+	struct btrfs_file_extent_item *extent_item;
+	struct btrfs_path path;
+	const char *data;
+	u64 skip;
+	u32 len, end, bytes;
 
-	if (off && !file->offset) {/* inline file first read patch */
-		file->inode->size += off;
-		handle_inline = true;
+	if (btrfs_find_file_extent(inode, file->offset, &path))
+		return -1;
+	extent_item = (struct btrfs_file_extent_item *)path.data;
+
+	skip = file->offset - path.item.key.offset;
+	if (extent_item->type == BTRFS_FILE_EXTENT_INLINE) {
+		if (extent_item->compression) {
+			data = btrfs_decode_extent(fs, &path, &len);
+			if (!data)
+				return -1;
+		} else {
+			data = (char *)&extent_item->disk_bytenr;
+			len = path.item.size - offsetof(struct
+				btrfs_file_extent_item, disk_bytenr);
+		}
+		end = len;
+	} else if (extent_item->compression) {
+		data = btrfs_decode_extent(fs, &path, &len);
+		if (!data)
+			return -1;
+		skip += extent_item->offset;
+		end = min(len, extent_item->offset + extent_item->num_bytes);
+	} else {
+		return 0;
 	}
-	ret = generic_getfssec(file, buf, sectors, have_more);
-	if (!ret)
-		return ret;
-	off = PVT(file->inode)->offset % SECTOR_SIZE(fs);
-	if (handle_inline) {/* inline file patch */
-		ret -= off;
-		memcpy(buf, buf + off, ret);
+
+	if (skip >= end)
+		return -1;
+	bytes = min(end - skip, (u64)sectors << SECTOR_SHIFT(fs));
+	bytes = min(bytes, inode->size - file->offset);
+	memcpy(buf, data + skip, bytes);
+	file->offset += bytes;
+	return bytes;
+}
+
+static uint32_t btrfs_getfssec(struct file *file, char *buf, int sectors,
+					bool *have_more)
+{
+	struct inode *inode = file->inode;
+	u32 sec_shift = SECTOR_SHIFT(file->fs);
+	u32 bytes_read = 0;
+	int ret;
+
+	/*
+	 * generic_getfssec() stops at an extent btrfs_next_extent() cannot
+	 * map, and btrfs_read_decoded() at the end of its extent, so
+	 * alternate between them until the request is filled.
+	 */
+	while (sectors > 0 && file->offset < inode->size) {
+		ret = btrfs_read_decoded(file, buf, sectors);
+		if (!ret)
+			ret = generic_getfssec(file, buf, sectors, NULL);
+		if (ret <= 0)
+			break;
+		buf += ret;
+		bytes_read += ret;
+		sectors -= ret >> sec_shift;
 	}
-	return ret;
+
+	if (have_more)
+		*have_more = file->offset < inode->size;
+	return bytes_read;
 }
 
 static void btrfs_get_fs_tree(struct fs_info *fs)
@@ -639,6 +818,7 @@ static int btrfs_fs_init(struct fs_info *fs)
 	struct disk *disk = fs->fs_dev->disk;
     
 	btrfs_init_crc32c();
+	btrfs_init_decoded();
 
 	fs->sector_shift = disk->sector_shift;
 	fs->sector_size  = 1 << fs->sector_shift;
@@ -50,6 +50,14 @@ typedef u64 __le64;
 #define BTRFS_FILE_EXTENT_REG 1
 #define BTRFS_FILE_EXTENT_PREALLOC 2
 
+#define BTRFS_COMPRESS_NONE 0
+#define BTRFS_COMPRESS_ZLIB 1
+#define BTRFS_COMPRESS_LZO  2
+
+/* limits on one compressed extent, before and after decompression */
+#define BTRFS_MAX_COMPRESSED	(128 * 1024)
+#define BTRFS_MAX_UNCOMPRESSED	(128 * 1024)
+
 #define BTRFS_MAX_LEVEL 8
 #define BTRFS_MAX_CHUNK_ENTRIES 256
 
@@ -289,4 +297,8 @@ struct btrfs_pvt_inode {
 
 #define PVT(i) ((struct btrfs_pvt_inode *)((i)->pvt))
 
+/* compress.c */
+int btrfs_decompress(int type, const void *in, size_t in_len,
+		     void *out, size_t out_len, u32 sectorsize);
+
 #endif
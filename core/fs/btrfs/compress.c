@@ -0,0 +1,148 @@
+/*
+ * compress.c -- decompression of btrfs zlib and LZO extents
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, Inc., 53 Temple Place Ste 330,
+ * Boston MA 02111-1307, USA; either version 2 of the License, or
+ * (at your option) any later version; incorporated herein by reference.
+ *
+ */
+
+#include <dprintf.h>
+#include <string.h>
+#include <zlib.h>
+#include <core.h>
+#include <klibc/compiler.h>
+#include "btrfs.h"
+
+/*
+ * inflate() allocates its state and a 32K window on every call; take
+ * them from a private arena instead of the small core heap.
+ */
+#define ZLIB_ARENA_SIZE	(48 * 1024)
+static __hugebss char zlib_arena[ZLIB_ARENA_SIZE];
+static size_t zlib_arena_used;
+
+static voidpf zlib_alloc(voidpf opaque, uInt items, uInt size)
+{
+	size_t bytes = ((size_t)items * size + 7) & ~7;
+	voidpf p;
+
+	(void)opaque;
+	if (bytes > ZLIB_ARENA_SIZE - zlib_arena_used)
+		return Z_NULL;
+	p = zlib_arena + zlib_arena_used;
+	zlib_arena_used += bytes;
+	return p;
+}
+
+static void zlib_free(voidpf opaque, voidpf ptr)
+{
+	(void)opaque;
+	(void)ptr;
+}
+
+/* a btrfs zlib extent is a single zlib stream */
+static int zlib_decompress(const u8 *in, size_t in_len,
+			   u8 *out, size_t out_len)
+{
+	z_stream zs;
+	int ret;
+
+	memset(&zs, 0, sizeof zs);
+	zs.zalloc = zlib_alloc;
+	zs.zfree = zlib_free;
+	zlib_arena_used = 0;
+
+	if (inflateInit(&zs) != Z_OK)
+		return -1;
+
+	zs.next_in = (Bytef *)in;
+	zs.avail_in = in_len;
+	zs.next_out = out;
+	zs.avail_out = out_len;
+	ret = inflate(&zs, Z_FINISH);
+	inflateEnd(&zs);
+
+	if (ret != Z_STREAM_END && !(ret == Z_BUF_ERROR && !zs.avail_out)) {
+		dprintf("btrfs: inflate error %d\n", ret);
+		return -1;
+	}
+	return out_len - zs.avail_out;
+}
+
+/* the safe LZO1X decoder in core/lzo, which checks both buffer ends */
+#define LZO_E_OK 0
+extern int __cdecl _lzo1x_decompress_asm_safe(const void *src,
+					      unsigned int src_len,
+					      void *dst,
+					      unsigned int *dst_len,
+					      void *wrkmem);
+
+#define LZO_LEN 4
+
+/*
+ * A btrfs LZO extent is a 32-bit total length, then segments of a
+ * 32-bit length and LZO1X data that decodes to one sector, the last
+ * one possibly less.  A segment header never straddles a sector
+ * boundary; the encoder pads with zeroes up to the next sector instead.
+ */
+static int lzo_decompress(const u8 *in, size_t in_len,
+			  u8 *out, size_t out_len, u32 sectorsize)
+{
+	u32 tot_len, seg_len, left;
+	size_t in_off, out_off = 0;
+	unsigned int dlen;
+	int ret;
+
+	if (in_len < LZO_LEN)
+		return -1;
+	tot_len = *(const __le32 *)in;
+	if (tot_len > in_len)
+		return -1;
+
+	in_off = LZO_LEN;
+	while (in_off < tot_len && out_off < out_len) {
+		if (tot_len - in_off < LZO_LEN)
+			return -1;
+		seg_len = *(const __le32 *)(in + in_off);
+		in_off += LZO_LEN;
+		if (seg_len > tot_len - in_off)
+			return -1;
+
+		dlen = out_len - out_off;
+		if (dlen > sectorsize)
+			dlen = sectorsize;
+		ret = _lzo1x_decompress_asm_safe(in + in_off, seg_len,
+						 out + out_off, &dlen, NULL);
+		if (ret != LZO_E_OK) {
+			dprintf("btrfs: lzo error %d\n", ret);
+			return -1;
+		}
+		out_off += dlen;
+		in_off += seg_len;
+
+		left = sectorsize - in_off % sectorsize;
+		if (left < LZO_LEN)
+			in_off += left;
+	}
+	return out_off;
+}
+
+/*
+ * Decode in_len bytes of extent data compressed with method type into
+ * at most out_len bytes at out.  Returns the decoded length or -1.
+ */
+int btrfs_decompress(int type, const void *in, size_t in_len,
+		     void *out, size_t out_len, u32 sectorsize)
+{
+	switch (type) {
+	case BTRFS_COMPRESS_ZLIB:
+		return zlib_decompress(in, in_len, out, out_len);
+	case BTRFS_COMPRESS_LZO:
+		return lzo_decompress(in, in_len, out, out_len, sectorsize);
+	default:
+		return -1;
+	}
+}
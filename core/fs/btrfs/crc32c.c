@@ -0,0 +1,146 @@
+/*
+ * CRC-32C for btrfs name hashes and metadata checksums.
+ *
+ * Based on Linux kernel crypto/crc32c.c
+ * Copyright (c) 2004 Cisco Systems, Inc.
+ * Copyright (c) 2008 Herbert Xu <herbert@gondor.apana.org.au>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * Two implementations: "slicing-by-8", which looks up eight bytes per
+ * step in eight 256-entry tables instead of one byte in one table, and
+ * the SSE4.2 crc32 instruction, used when CPUID says it is there and
+ * it passes a self-test.
+ */
+
+#include <dprintf.h>
+#include <string.h>
+#include <com32.h>
+#include <sys/cpu.h>
+#include "crc32c.h"
+
+/* Bit-reflected CRC32C polynomial */
+#define CRC32C_POLY	0x82F63B78
+
+/* CPUID.1:ECX bit for SSE4.2, which includes the crc32 instruction */
+#define CPUID1_ECX_SSE4_2	(1 << 20)
+
+/*
+ * crc32c_table[0] is the usual byte-at-a-time table; crc32c_table[k][i]
+ * is the CRC of byte i followed by k zero bytes.
+ */
+static uint32_t crc32c_table[8][256];
+
+static uint32_t (*crc32c_fn)(uint32_t, const char *, size_t);
+
+static uint32_t crc32c_sb8(uint32_t crc, const char *data, size_t length)
+{
+	const uint8_t *p = (const uint8_t *)data;
+	uint32_t lo;
+
+	while (length >= 8) {
+		lo = crc ^ (p[0] | (p[1] << 8) | (p[2] << 16) |
+			    ((uint32_t)p[3] << 24));
+		crc = crc32c_table[7][lo & 0xff] ^
+		      crc32c_table[6][(lo >> 8) & 0xff] ^
+		      crc32c_table[5][(lo >> 16) & 0xff] ^
+		      crc32c_table[4][lo >> 24] ^
+		      crc32c_table[3][p[4]] ^
+		      crc32c_table[2][p[5]] ^
+		      crc32c_table[1][p[6]] ^
+		      crc32c_table[0][p[7]];
+		p += 8;
+		length -= 8;
+	}
+
+	while (length--)
+		crc = crc32c_table[0][(uint8_t)(crc ^ *p++)] ^ (crc >> 8);
+
+	return crc;
+}
+
+static uint32_t crc32c_sse42(uint32_t crc, const char *data, size_t length)
+{
+	uint32_t v;
+
+	while (length >= 4) {
+		memcpy(&v, data, 4);
+		asm("crc32l %1,%0" : "+r" (crc) : "rm" (v));
+		data += 4;
+		length -= 4;
+	}
+
+	while (length--)
+		asm("crc32b %1,%0" : "+r" (crc) : "qm" (*data++));
+
+	return crc;
+}
+
+static bool cpu_has_sse42(void)
+{
+	if (!cpu_has_eflag(EFLAGS_ID) || cpuid_eax(0) < 1)
+		return false;
+	return !!(cpuid_ecx(1) & CPUID1_ECX_SSE4_2);
+}
+
+/*
+ * Known answer for "123456789" (with the usual ~0 pre- and
+ * post-conditioning), fed in two pieces split at every offset so that
+ * both the bulk loop and the tail of an implementation are covered.
+ */
+static bool crc32c_self_test(uint32_t (*fn)(uint32_t, const char *, size_t))
+{
+	static const char vec[] = "123456789";
+	uint32_t crc;
+	int i;
+
+	for (i = 0; i <= 9; i++) {
+		crc = fn(~0U, vec, i);
+		crc = fn(crc, vec + i, 9 - i);
+		if ((crc ^ ~0U) != 0xE3069283)
+			return false;
+	}
+	return true;
+}
+
+void btrfs_init_crc32c(void)
+{
+	int i, j;
+	uint32_t v;
+
+	if (crc32c_fn)
+		return;
+
+	for (i = 0; i < 256; i++) {
+		v = i;
+		for (j = 0; j < 8; j++)
+			v = (v >> 1) ^ ((v & 1) ? CRC32C_POLY : 0);
+		crc32c_table[0][i] = v;
+	}
+	for (i = 0; i < 256; i++) {
+		v = crc32c_table[0][i];
+		for (j = 1; j < 8; j++) {
+			v = crc32c_table[0][v & 0xff] ^ (v >> 8);
+			crc32c_table[j][i] = v;
+		}
+	}
+
+	crc32c_fn = crc32c_sb8;
+	if (!crc32c_self_test(crc32c_sb8))
+		dprintf("crc32c: table self-test failed\n");
+
+	if (cpu_has_sse42()) {
+		if (crc32c_self_test(crc32c_sse42))
+			crc32c_fn = crc32c_sse42;
+		else
+			dprintf("crc32c: SSE4.2 self-test failed, using tables\n");
+	}
+}
+
+uint32_t crc32c_le(uint32_t crc, const char *data, size_t length)
+{
+	return crc32c_fn(crc, data, length);
+}
@@ -10,41 +10,17 @@
  *
  */
 
-/*
- * This is the CRC-32C table
- * Generated with:
- * width = 32 bits
- * poly = 0x1EDC6F41
- * reflect input bytes = true
- * reflect output bytes = true
- */
+#ifndef _CRC32C_H_
+#define _CRC32C_H_
 
-static u32 crc32c_table[256];
+#include <stddef.h>
+#include <stdint.h>
 
 /*
- * Steps through buffer one byte at at time, calculates reflected
- * crc using table.
+ * CRC-32C (Castagnoli), bit-reflected, poly = 0x1EDC6F41.
+ * btrfs_init_crc32c() must be called before crc32c_le().
  */
+uint32_t crc32c_le(uint32_t crc, const char *data, size_t length);
+void btrfs_init_crc32c(void);
 
-static inline u32 crc32c_le(u32 crc, const char *data, size_t length)
-{
-	while (length--)
-		crc = crc32c_table[(u8)(crc ^ *data++)] ^ (crc >> 8);
-
-	return crc;
-}
-
-static inline void btrfs_init_crc32c(void)
-{
-	int i, j;
-	u32 v;
-	const u32 poly = 0x82F63B78; /* Bit-reflected CRC32C polynomial */
-
-	for (i = 0; i < 256; i++) {
-		v = i;
-		for (j = 0; j < 8; j++) {
-			v = (v >> 1) ^ ((v & 1) ? poly : 0);
-		}
-		crc32c_table[i] = v;
-	}
-}
+#endif /* _CRC32C_H_ */
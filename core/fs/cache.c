@@ -8,41 +8,69 @@
 #include <dprintf.h>
 #include "core.h"
 #include "cache.h"
+#include <ilog2.h>
 
 
+#define cache_hash_slot(dev, block) \
+    (&(dev)->cache_hash[(uint32_t)(block) & (dev)->cache_hash_mask])
+
+static void cache_reset_streams(struct device *dev)
+{
+    int i;
+
+    for (i = 0; i < CACHE_RA_STREAMS; i++) {
+	dev->cache_streams[i].next = -1;
+	dev->cache_streams[i].window = 0;
+    }
+}
+
 /*
  * Initialize the cache data structres. the _block_size_shift_ specify
  * the block size, which is 512 byte for FAT fs of the current 
  * implementation since the block(cluster) size in FAT is a bit big.
  *
+ * The cache area holds the block data, then the descriptors (a head
+ * node for the LRU list plus one per block), then the hash buckets
+ * used to find a block's descriptor without scanning them all.
  */
 void cache_init(struct device *dev, int block_size_shift)
 {
     struct cache *prev, *cur;
     char *data = dev->cache_data;
     struct cache *head, *cache;
-    int i;
+    uint32_t i;
 
     dev->cache_block_size = 1 << block_size_shift;
 
-    if (dev->cache_size < dev->cache_block_size + 2*sizeof(struct cache)) {
+    if (dev->cache_size < dev->cache_block_size + 2*sizeof(struct cache)
+	+ sizeof(struct cache *)) {
 	dev->cache_head = NULL;
 	return;			/* Cache unusably small */
     }
 
-    /* We need one struct cache for the headnode plus one for each block */
+    /*
+     * We need one struct cache for the headnode plus one for each
+     * block, and at most one hash bucket per block.
+     */
     dev->cache_entries =
 	(dev->cache_size - sizeof(struct cache))/
-	(dev->cache_block_size + sizeof(struct cache));
+	(dev->cache_block_size + sizeof(struct cache) +
+	 sizeof(struct cache *));
 
     dev->cache_head = head = (struct cache *)
 	(data + (dev->cache_entries << block_size_shift));
     cache = dev->cache_head + 1; /* First cache descriptor */
 
-    head->prev  = &cache[dev->cache_entries-1];
-    head->next->prev = dev->cache_head;
+    for (i = 1; i * 2 <= dev->cache_entries; i <<= 1)
+	;
+    dev->cache_hash_mask = i - 1;
+    dev->cache_hash = (struct cache **)&cache[dev->cache_entries];
+    memset(dev->cache_hash, 0, i * sizeof(struct cache *));
+
     head->block = -1;
     head->data  = NULL;
+    head->hash_next = NULL;
+    head->hash_pprev = NULL;
 
     prev = head;
     
@@ -50,11 +78,33 @@ void cache_init(struct device *dev, int block_size_shift)
         cur = &cache[i];
         cur->data  = data;
         cur->block = -1;
+        cur->hash_next = NULL;
+        cur->hash_pprev = NULL;
+        cur->readahead = false;
         cur->prev  = prev;
         prev->next = cur;
         data += dev->cache_block_size;
-        prev = cur++;
+        prev = cur;
     }
+    prev->next = head;
+    head->prev = prev;
+
+    cache_reset_streams(dev);
+    memset(&dev->cache_stats, 0, sizeof dev->cache_stats);
+}
+
+/*
+ * Let get_cache() read up to max_blocks blocks at once when it sees
+ * blocks being asked for in order, but never block limit or beyond
+ * (the end of the filesystem).  0 turns read-ahead off.  This
+ * survives cache_init(), so it can be set before or after it.
+ */
+void cache_set_readahead(struct device *dev, uint32_t max_blocks,
+			 block_t limit)
+{
+    dev->cache_ra_max = max_blocks;
+    dev->cache_ra_limit = limit;
+    cache_reset_streams(dev);
 }
 
 /*
@@ -68,27 +118,64 @@ void cache_lock_block(struct cache *cs)
     cs->next = cs->prev = NULL;
 }
 
+/*
+ * Take a descriptor off its hash chain
+ */
+static void cache_unhash(struct cache *cs)
+{
+    if (cs->hash_pprev) {
+	*cs->hash_pprev = cs->hash_next;
+	if (cs->hash_next)
+	    cs->hash_next->hash_pprev = cs->hash_pprev;
+	cs->hash_next = NULL;
+	cs->hash_pprev = NULL;
+    }
+}
+
+#ifdef DEBUG_CACHE
+/*
+ * Report the block cache counters, for tuning the read-ahead window.
+ * Build with -DDEBUG_CACHE to have them printed every 1024 misses.
+ */
+static void cache_dump_stats(struct device *dev)
+{
+    printf("cache: %u hits, %u misses in %u reads, "
+	   "%u blocks read ahead, %u of them used\n",
+	   dev->cache_stats.hits, dev->cache_stats.misses,
+	   dev->cache_stats.reads, dev->cache_stats.ra_blocks,
+	   dev->cache_stats.ra_hits);
+}
+#endif
+
 /*
  * Check for a particular BLOCK in the block cache, 
  * and if it is already there, just do nothing and return;
  * otherwise pick a victim block and update the LRU link.
+ *
+ * A victim is returned with block set to -1 and already hashed
+ * under BLOCK; the caller fills it in and sets cs->block.
  */
 struct cache *_get_cache_block(struct device *dev, block_t block)
 {
     struct cache *head = dev->cache_head;
     struct cache *cs;
-    int i;
+    struct cache **slot = cache_hash_slot(dev, block);
 
-    cs = dev->cache_head + 1;
-
-    for (i = 0; i < dev->cache_entries; i++) {
+    for (cs = *slot; cs; cs = cs->hash_next) {
 	if (cs->block == block)
 	    goto found;
-	cs++;
     }
     
-    /* Not found, pick a victim */
+    /* Not found, pick a victim and move it to this block's chain */
     cs = head->next;
+    cache_unhash(cs);
+    cs->block = -1;
+    cs->readahead = false;
+    cs->hash_next = *slot;
+    if (cs->hash_next)
+	cs->hash_next->hash_pprev = &cs->hash_next;
+    cs->hash_pprev = slot;
+    *slot = cs;
 
 found:
     /* Move to the end of the LRU chain, unless the block is already locked */
@@ -105,21 +192,135 @@ found:
     return cs;
 }    
 
+/*
+ * Is BLOCK in the cache?  Doesn't touch the LRU list.
+ */
+static bool cache_present(struct device *dev, block_t block)
+{
+    struct cache *cs;
+
+    for (cs = *cache_hash_slot(dev, block); cs; cs = cs->hash_next) {
+	if (cs->block == block)
+	    return true;
+    }
+    return false;
+}
+
+/*
+ * Read-ahead staging buffer: blocks are read into it with a single
+ * disk request, then copied into their cache slots.
+ */
+#define CACHE_RA_BYTES	(64*1024)
+static __hugebss char cache_ra_buf[CACHE_RA_BYTES];
+
+/*
+ * Fill CS with BLOCK, and the cache with up to nblocks - 1 blocks
+ * following it which aren't cached yet, in one disk read.
+ */
+static void cache_fill(struct device *dev, struct cache *cs, block_t block,
+		       struct cache_stream *st)
+{
+    uint32_t nblocks = st->window;
+    struct disk *disk = dev->disk;
+    int sec_shift = ilog2(dev->cache_block_size) - disk->sector_shift;
+    struct cache *ra;
+    uint32_t n, i;
+
+    if (nblocks > CACHE_RA_BYTES / dev->cache_block_size)
+	nblocks = CACHE_RA_BYTES / dev->cache_block_size;
+    if (nblocks > dev->cache_entries / 2)
+	nblocks = dev->cache_entries / 2;
+    if (block + nblocks > dev->cache_ra_limit)
+	nblocks = block < dev->cache_ra_limit ? dev->cache_ra_limit - block : 1;
+    for (n = 1; n < nblocks; n++) {
+	if (cache_present(dev, block + n))
+	    break;
+    }
+
+    dev->cache_stats.reads++;
+    st->next = block + n;
+    if (n <= 1) {
+	getoneblk(disk, cs->data, block, dev->cache_block_size);
+	cs->block = block;
+	return;
+    }
+
+    disk->rdwr_sectors(disk, cache_ra_buf, block << sec_shift,
+		       n << sec_shift, 0);
+
+    memcpy(cs->data, cache_ra_buf, dev->cache_block_size);
+    cs->block = block;
+
+    for (i = 1; i < n; i++) {
+	ra = _get_cache_block(dev, block + i);
+	memcpy(ra->data, cache_ra_buf + (i << ilog2(dev->cache_block_size)),
+	       dev->cache_block_size);
+	ra->block = block + i;
+	ra->readahead = true;
+    }
+    dev->cache_stats.ra_blocks += n - 1;
+}
+
 /*
  * Check for a particular BLOCK in the block cache, 
  * and if it is already there, just do nothing and return;
  * otherwise load it from disk and update the LRU link.
  * Return the data pointer.
+ *
+ * Misses are matched against a few sequential streams, so that
+ * unrelated reads in between don't break one up.  A miss on the
+ * block right after the ones last read for a stream continues it:
+ * the stream's read-ahead window (the number of blocks read for the
+ * miss) doubles, up to dev->cache_ra_max, and the stream moves to
+ * the front of the list.  Any other miss starts a new stream in the
+ * last slot and reads just the one block.
  */
 const void *get_cache(struct device *dev, block_t block)
 {
     struct cache *cs;
+    struct cache_stream *st, stream;
+    int i;
 
     cs = _get_cache_block(dev, block);
-    if (cs->block != block) {
-	cs->block = block;
-        getoneblk(dev->disk, cs->data, block, dev->cache_block_size);
+    if (cs->block == block) {
+	dev->cache_stats.hits++;
+	if (cs->readahead) {
+	    dev->cache_stats.ra_hits++;
+	    cs->readahead = false;
+	}
+	return cs->data;
+    }
+
+    dev->cache_stats.misses++;
+#ifdef DEBUG_CACHE
+    if (!(dev->cache_stats.misses & 1023))
+	cache_dump_stats(dev);
+#endif
+
+    for (i = 0; i < CACHE_RA_STREAMS - 1; i++) {
+	if (dev->cache_streams[i].next == block)
+	    break;
+    }
+    st = &dev->cache_streams[i];
+    if (st->next == block && dev->cache_ra_max) {
+	/* Continue it, and move it to the front */
+	stream = *st;
+	stream.window = stream.window ? stream.window * 2 : 2;
+	if (stream.window > dev->cache_ra_max)
+	    stream.window = dev->cache_ra_max;
+	memmove(&dev->cache_streams[1], &dev->cache_streams[0],
+		i * sizeof(struct cache_stream));
+	st = &dev->cache_streams[0];
+	*st = stream;
+    } else {
+	/*
+	 * Start a new one in the last slot: until it shows it is
+	 * really sequential it only displaces other one-off misses.
+	 */
+	st = &dev->cache_streams[CACHE_RA_STREAMS - 1];
+	st->window = 0;
     }
+    cache_fill(dev, cs, block, st);
 
     return cs->data;
 }
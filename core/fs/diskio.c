@@ -394,6 +394,15 @@ struct disk *disk_init(uint8_t devno, bool cdrom, sector_t part_start,
 }
 
 
+/*
+ * Size of the filesystem block cache.  It lives in .hugebss, above
+ * 1 MB, so it costs no low memory; lookups are hashed, so it can be
+ * made much larger without slowing them down.
+ */
+#ifndef DISK_CACHE_SIZE
+#define DISK_CACHE_SIZE	(512*1024)
+#endif
+
 /*
  * Initialize the device structure.
  *
@@ -404,7 +413,7 @@ struct device * device_init(uint8_t devno, bool cdrom, sector_t part_start,
 			    uint32_t MaxTransfer)
 {
     static struct device dev;
-    static __hugebss char diskcache[128*1024];
+    static __hugebss char diskcache[DISK_CACHE_SIZE];
 
     dev.disk = disk_init(devno, cdrom, part_start,
 			 bsHeads, bsSecPerTrack, MaxTransfer);
@@ -6,20 +6,48 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <dprintf.h>
 #include <fs.h>
 #include <disk.h>
 #include <cache.h>
 #include "ext2_fs.h"
 
+/*
+ * Extent index entries, extents and block map runs all start with
+ * their first logical block; return the last of n entries of the given
+ * size starting at or before block, or -1 if there is none.
+ */
+static int bisect_lblock(const void *entries, size_t size, int n, uint32_t block)
+{
+    int lo = 0, hi = n - 1, mid;
+
+    while (lo <= hi) {
+	mid = (lo + hi) >> 1;
+	if (*(const uint32_t *)((const char *)entries + mid * size) <= block)
+	    lo = mid + 1;
+	else
+	    hi = mid - 1;
+    }
+    return hi;
+}
+
+/*
+ * Find the leaf which may hold block.  If next is not NULL, it is set
+ * to the first logical block of the following leaf, or 0 if there is
+ * no following leaf.
+ */
 static const struct ext4_extent_header *
 ext4_find_leaf(struct fs_info *fs, const struct ext4_extent_header *eh,
-	       block_t block)
+	       block_t block, uint32_t *next)
 {
     struct ext4_extent_idx *index;
     block_t blk;
     int i;
 
+    if (next)
+	*next = 0;
+
     while (1) {
 	if (eh->eh_magic != EXT4_EXT_MAGIC)
 	    return NULL;
@@ -27,12 +55,11 @@ ext4_find_leaf(struct fs_info *fs, const struct ext4_extent_header *eh,
 	    return eh;
 
 	index = EXT4_FIRST_INDEX(eh);
-	for (i = 0; i < (int)eh->eh_entries; i++) {
-	    if (block < index[i].ei_block)
-		break;
-	}
-	if (--i < 0)
+	i = bisect_lblock(index, sizeof *index, eh->eh_entries, block);
+	if (i < 0)
 	    return NULL;
+	if (next && i + 1 < (int)eh->eh_entries)
+	    *next = index[i + 1].ei_block;
 
 	blk = index[i].ei_leaf_hi;
 	blk = (blk << 32) + index[i].ei_leaf_lo;
@@ -41,7 +68,6 @@ ext4_find_leaf(struct fs_info *fs, const struct ext4_extent_header *eh,
 }
 
 /* handle the ext4 extents to get the phsical block number */
-/* XXX: still need to handle sparse files with extents */
 static block_t
 bmap_extent(struct inode *inode, uint32_t block, size_t *nblocks)
 {
@@ -51,18 +77,15 @@ bmap_extent(struct inode *inode, uint32_t block, size_t *nblocks)
     int i;
     block_t start;
 
-    leaf = ext4_find_leaf(fs, &PVT(inode)->i_extent_hdr, block);
+    leaf = ext4_find_leaf(fs, &PVT(inode)->i_extent_hdr, block, NULL);
     if (!leaf) {
 	printf("ERROR, extent leaf not found\n");
 	return 0;
     }
 
     ext = EXT4_FIRST_EXTENT(leaf);
-    for (i = 0; i < leaf->eh_entries; i++) {
-	if (block < ext[i].ee_block)
-	    break;
-    }
-    if (--i < 0) {
+    i = bisect_lblock(ext, sizeof *ext, leaf->eh_entries, block);
+    if (i < 0) {
 	printf("ERROR, not find the right block\n");
 	return 0;
     }
@@ -179,11 +202,151 @@ bmap_traditional(struct inode *inode, block_t block, size_t *nblocks)
 }
 
 
+/*
+ * Append a run of len blocks at pblock (0 for a hole) to the block map,
+ * merging it into the last run if it continues it.
+ */
+static int add_run(struct ext2_pvt_inode *pvt, block_t pblock, uint32_t len)
+{
+    struct ext2_run *run = pvt->nruns ? &pvt->runs[pvt->nruns - 1] : NULL;
+    struct ext2_run *runs;
+    uint32_t maxruns;
+
+    if (run && (pblock ? run->pblock && run->pblock + run->len == pblock
+		       : !run->pblock)) {
+	run->len += len;
+    } else {
+	if (pvt->nruns == pvt->maxruns) {
+	    maxruns = pvt->maxruns ? pvt->maxruns << 1 : 16;
+	    runs = realloc(pvt->runs, maxruns * sizeof *runs);
+	    if (!runs)
+		return -1;
+	    pvt->runs = runs;
+	    pvt->maxruns = maxruns;
+	}
+	run = &pvt->runs[pvt->nruns++];
+	run->lblock = pvt->mapped;
+	run->len = len;
+	run->pblock = pblock;
+    }
+
+    pvt->mapped += len;
+    return 0;
+}
+
+/*
+ * Add the rest of the extent leaf holding the first unmapped block to
+ * the block map, then any hole up to the next leaf.
+ */
+static int map_extent_leaf(struct inode *inode, uint32_t fblocks)
+{
+    struct ext2_pvt_inode *pvt = PVT(inode);
+    const struct ext4_extent_header *leaf;
+    const struct ext4_extent *ext;
+    uint32_t next, start, len, skip;
+    uint32_t mapped = pvt->mapped;
+    block_t pblock;
+    int i;
+
+    leaf = ext4_find_leaf(inode->fs, &pvt->i_extent_hdr, pvt->mapped, &next);
+    if (!leaf)
+	return -1;
+
+    ext = EXT4_FIRST_EXTENT(leaf);
+    i = bisect_lblock(ext, sizeof *ext, leaf->eh_entries, pvt->mapped);
+    if (i < 0)
+	i = 0;
+
+    for (; i < (int)leaf->eh_entries && pvt->mapped < fblocks; i++) {
+	start = ext[i].ee_block;
+	len = ext[i].ee_len;
+	pblock = ((block_t)ext[i].ee_start_hi << 32) + ext[i].ee_start_lo;
+	if (len > EXT4_INIT_MAX_LEN) {
+	    len -= EXT4_INIT_MAX_LEN;
+	    pblock = 0;		/* Uninitialized, reads as zero */
+	}
+
+	if (start + len <= pvt->mapped)
+	    continue;
+	if (start > pvt->mapped && add_run(pvt, 0, start - pvt->mapped))
+	    return -1;
+
+	skip = pvt->mapped - start;
+	if (add_run(pvt, pblock ? pblock + skip : 0, len - skip))
+	    return -1;
+    }
+
+    /* Nothing is mapped between this leaf and the next one */
+    if (!next || next > fblocks)
+	next = fblocks;
+    if (pvt->mapped < next && add_run(pvt, 0, next - pvt->mapped))
+	return -1;
+
+    return pvt->mapped > mapped ? 0 : -1;	/* No progress: corrupt tree */
+}
+
+/* Add the next run of an indirect-mapped file to the block map */
+static int map_indirect(struct inode *inode, uint32_t fblocks)
+{
+    struct ext2_pvt_inode *pvt = PVT(inode);
+    size_t nblocks = 0;
+    block_t pblock;
+
+    pblock = bmap_traditional(inode, pvt->mapped, &nblocks);
+    if (!nblocks || nblocks > fblocks - pvt->mapped)
+	nblocks = fblocks - pvt->mapped;
+
+    return add_run(pvt, pblock, nblocks);
+}
+
+/*
+ * How far past the block asked for the block map is built, so that
+ * generic_getfssec() sees long extents without every lookup mapping
+ * the whole file.
+ */
+#define EXT2_MAP_AHEAD	(16 << 20)	/* bytes */
+
+/*
+ * Extend the block map of an inode until the run holding block is
+ * complete, EXT2_MAP_AHEAD is reached, or the file ends.
+ */
+static int ext2_map_blocks(struct inode *inode, uint32_t block)
+{
+    struct fs_info *fs = inode->fs;
+    struct ext2_pvt_inode *pvt = PVT(inode);
+    uint32_t fblocks = (inode->size + BLOCK_SIZE(fs) - 1) >> BLOCK_SHIFT(fs);
+    uint32_t ahead = block + (EXT2_MAP_AHEAD >> BLOCK_SHIFT(fs));
+    int ret;
+
+    while (pvt->mapped < fblocks && pvt->mapped <= ahead) {
+	if (pvt->nruns && pvt->runs[pvt->nruns - 1].lblock > block)
+	    break;		/* The run holding block is complete */
+
+	if (inode->flags & EXT4_EXTENTS_FLAG)
+	    ret = map_extent_leaf(inode, fblocks);
+	else
+	    ret = map_indirect(inode, fblocks);
+	if (ret)
+	    return -1;
+    }
+
+    return 0;
+}
+
+void ext2_destroy_inode(struct inode *inode)
+{
+    free(PVT(inode)->runs);
+}
+
 /**
  * Map the logical block to physic block where the file data stores.
  * In EXT4, there are two ways to handle the map process, extents and indirect.
  * EXT4 uses a inode flag to mark extent file and indirect block file.
  *
+ * Blocks are looked up in a map of runs built on demand, which merges
+ * adjacent extents and indirect block runs; the tree is only walked
+ * directly if the map cannot be built.
+ *
  * @fs:      the fs_info structure.
  * @inode:   the inode structure.
  * @block:   the logical block to be mapped.
@@ -193,14 +356,25 @@ bmap_traditional(struct inode *inode, block_t block, size_t *nblocks)
  */
 block_t ext2_bmap(struct inode *inode, block_t block, size_t *nblocks)
 {
-    block_t ret;
+    struct ext2_pvt_inode *pvt = PVT(inode);
+    const struct ext2_run *run;
+    uint32_t delta;
+    int i;
+
+    if (!ext2_map_blocks(inode, block) && block < pvt->mapped) {
+	i = bisect_lblock(pvt->runs, sizeof *run, pvt->nruns, block);
+	run = &pvt->runs[i];
+	delta = block - run->lblock;
+
+	if (nblocks)
+	    *nblocks = run->len - delta;
+	return run->pblock ? run->pblock + delta : 0;
+    }
 
     if (inode->flags & EXT4_EXTENTS_FLAG)
-	ret = bmap_extent(inode, block, nblocks);
+	return bmap_extent(inode, block, nblocks);
     else
-	ret = bmap_traditional(inode, block, nblocks);
-
-    return ret;
+	return bmap_traditional(inode, block, nblocks);
 }
 
 
@@ -85,6 +85,131 @@ ext2_get_cache(struct inode *inode, block_t lblock)
     return get_cache(inode->fs->fs_dev, pblock);
 }
 
+/*
+ * Search one leaf block of an indexed directory.  Returns NULL if the
+ * name isn't there, or (void *)-1 if the block is malformed.
+ */
+static const struct ext2_dir_entry *
+ext2_dx_search_leaf(struct fs_info *fs, const char *data,
+		    const char *dname, size_t dname_len)
+{
+    const struct ext2_dir_entry *de;
+    uint32_t block_size = BLOCK_SIZE(fs);
+    uint32_t offset = 0;
+
+    while (offset < block_size - 8) {
+	de = (const struct ext2_dir_entry *)(data + offset);
+	if (de->d_rec_len < 8 || de->d_rec_len > block_size - offset)
+	    return (const struct ext2_dir_entry *)-1;
+	if (ext2_match_entry(dname, dname_len, de))
+	    return de;
+	offset += de->d_rec_len;
+    }
+
+    return NULL;
+}
+
+/*
+ * Look a name up through the hash tree of a dir_index directory: hash
+ * the name and follow the dx_root (and at most one level of index
+ * nodes) to the single leaf block that can hold it, plus following
+ * leaves if the hash collides across a leaf boundary.
+ *
+ * Sets *done when the answer is authoritative; otherwise the caller
+ * falls back to a linear scan.
+ */
+static const struct ext2_dir_entry *
+ext2_dx_find_entry(struct fs_info *fs, struct inode *inode,
+		   const char *dname, size_t dname_len, bool *done)
+{
+    struct ext2_sb_info *sbi = EXT2_SB(fs);
+    const struct ext2_dx_root_info *root;
+    const struct ext2_dx_countlimit *limit;
+    const struct ext2_dx_entry *entries, *end, *p, *q, *at;
+    const struct ext2_dir_entry *de;
+    const char *data;
+    uint32_t hash, next_hash = 0;
+    int hash_version, levels, count;
+    bool has_next = false;
+
+    *done = false;
+    if (!sbi->s_dir_index || !(inode->flags & EXT2_INDEX_FL))
+	return NULL;
+
+    data = ext2_get_cache(inode, 0);
+    root = (const struct ext2_dx_root_info *)(data + 24);
+    if (root->reserved_zero || root->info_length < 8 ||
+	root->indirect_levels > 1)
+	return NULL;
+
+    hash_version = root->hash_version;
+    if (hash_version <= EXT2_HASH_TEA && sbi->s_hash_unsigned)
+	hash_version += 3;
+    if (ext2_dirhash(hash_version, dname, dname_len, sbi->s_hash_seed, &hash))
+	return NULL;
+
+    levels = root->indirect_levels;
+    limit = (const struct ext2_dx_countlimit *)(data + 24 + root->info_length);
+    for (;;) {
+	count   = limit->count;
+	entries = (const struct ext2_dx_entry *)limit;
+	end     = entries + count;
+	if (!count || count > limit->limit ||
+	    (const char *)end > data + BLOCK_SIZE(fs))
+	    return NULL;
+
+	/*
+	 * Binary search for the last entry whose hash is <= ours; the
+	 * first entry has no hash and covers everything below the second.
+	 */
+	p = entries + 1;
+	q = end - 1;
+	while (p <= q) {
+	    at = p + (q - p) / 2;
+	    if (at->hash > hash)
+		q = at - 1;
+	    else
+		p = at + 1;
+	}
+	at = p - 1;
+
+	if (!levels--)
+	    break;
+
+	if (at + 1 < end) {
+	    next_hash = at[1].hash;
+	    has_next = true;
+	}
+	data = ext2_get_cache(inode, at->block & 0x0fffffff);
+	/* Index nodes start with an empty, block-sized dirent */
+	limit = (const struct ext2_dx_countlimit *)(data + 8);
+    }
+
+    for (;;) {
+	de = ext2_dx_search_leaf(fs, ext2_get_cache(inode,
+						    at->block & 0x0fffffff),
+				 dname, dname_len);
+	if (de == (const struct ext2_dir_entry *)-1)
+	    return NULL;
+	if (de) {
+	    *done = true;
+	    return de;
+	}
+	if (++at < end) {
+	    if ((at->hash & ~1) != hash)
+		break;
+	    continue;
+	}
+	/* Collision continues in the next index node; let the scan do it */
+	if (has_next && (next_hash & ~1) == hash)
+	    return NULL;
+	break;
+    }
+
+    *done = true;
+    return NULL;
+}
+
 /*
  * find a dir entry, return it if found, or return NULL.
  */
@@ -96,6 +221,11 @@ ext2_find_entry(struct fs_info *fs, struct inode *inode, const char *dname)
     const struct ext2_dir_entry *de;
     const char *data;
     size_t dname_len = strlen(dname);
+    bool done;
+
+    de = ext2_dx_find_entry(fs, inode, dname, dname_len, &done);
+    if (done)
+	return de;
 
     while (i < inode->size) {
 	data = ext2_get_cache(inode, index++);
@@ -308,9 +438,18 @@ static int ext2_fs_init(struct fs_info *fs)
 	                      / EXT2_BLOCKS_PER_GROUP(fs);
     sbi->s_first_data_block = sb.s_first_data_block;
     sbi->s_inode_size = sb.s_inode_size;
-
-    /* Initialize the cache, and force block zero to all zero */
+    sbi->s_dir_index  = !!(sb.s_feature_compat & EXT2_FEATURE_COMPAT_DIR_INDEX);
+    sbi->s_hash_unsigned = !!(sb.s_flags & EXT2_FLAGS_UNSIGNED_HASH);
+    memcpy(sbi->s_hash_seed, sb.s_hash_seed, sizeof sbi->s_hash_seed);
+
+    /*
+     * Initialize the cache, and force block zero to all zero.
+     * Indirect, extent and directory blocks tend to be laid out in
+     * order, so let the cache read up to 32K ahead of a sequential miss.
+     */
     cache_init(fs->fs_dev, fs->block_shift);
+    cache_set_readahead(fs->fs_dev, (32 << 10) >> fs->block_shift,
+			sb.s_blocks_count);
     cs = _get_cache_block(fs->fs_dev, 0);
     memset(cs->data, 0, fs->block_size);
     cache_lock_block(cs);
@@ -331,5 +470,6 @@ const struct fs_ops ext2_fs_ops = {
     .iget          = ext2_iget,
     .readlink      = ext2_readlink,
     .readdir       = ext2_readdir,
+    .destroy_inode = ext2_destroy_inode,
     .next_extent   = ext2_next_extent,
 };
@@ -17,6 +17,8 @@
 #define EXT3_RESIZE_INO		 7	// Reserved group descriptors inode
 #define EXT3_JOURNAL_INO	 8	// Journal inode
 
+#define EXT2_FEATURE_COMPAT_DIR_INDEX		0x0020
+
 // We're readonly, so we only care about incompat features.
 #define EXT2_FEATURE_INCOMPAT_COMPRESSION	0x0001
 #define EXT2_FEATURE_INCOMPAT_FILETYPE		0x0002
@@ -32,6 +34,20 @@
 #define	EXT2_N_BLOCKS		(EXT2_TIND_BLOCK+1)
 
 
+/* Inode flags */
+#define EXT2_INDEX_FL		0x00001000	// hash-indexed directory
+
+/* Superblock s_flags */
+#define EXT2_FLAGS_UNSIGNED_HASH	0x0002	// Unsigned dirhash in use
+
+/* Directory hash versions */
+#define EXT2_HASH_LEGACY		0
+#define EXT2_HASH_HALF_MD4		1
+#define EXT2_HASH_TEA			2
+#define EXT2_HASH_LEGACY_UNSIGNED	3
+#define EXT2_HASH_HALF_MD4_UNSIGNED	4
+#define EXT2_HASH_TEA_UNSIGNED		5
+
 /* for EXT4 extent */
 #define EXT4_EXT_MAGIC     0xf30a
 #define EXT4_EXTENTS_FLAG  0x00080000
@@ -214,6 +230,30 @@ struct ext2_dir_entry {
     char	d_name[EXT2_NAME_LEN];	        /* File name */
 };
 
+/*
+ * Hash tree (dir_index) directory structures.  The dx_root_info sits
+ * in block 0 after the "." and ".." entries; index nodes start with
+ * an empty dirent covering the whole block.  In both cases the first
+ * dx_entry is overlaid by the count/limit header.
+ */
+struct ext2_dx_root_info {
+    uint32_t reserved_zero;
+    uint8_t  hash_version;
+    uint8_t  info_length;	/* 8 */
+    uint8_t  indirect_levels;
+    uint8_t  unused_flags;
+};
+
+struct ext2_dx_entry {
+    uint32_t hash;
+    uint32_t block;
+};
+
+struct ext2_dx_countlimit {
+    uint16_t limit;
+    uint16_t count;
+};
+
 /*******************************************************************************
 #define EXT2_DIR_PAD	 4
 #define EXT2_DIR_ROUND	(EXT2_DIR_PAD - 1)
@@ -263,6 +303,7 @@ struct ext4_extent_header {
 
 
 #define EXT4_FIRST_EXTENT(header) ( (struct ext4_extent *)(header + 1) )
+#define EXT4_INIT_MAX_LEN	  32768	/* longer ee_len means uninitialized */
 #define EXT4_FIRST_INDEX(header)  ( (struct ext4_extent_idx *) (header + 1) )
 
 
@@ -277,6 +318,9 @@ struct ext2_sb_info {
     uint32_t s_groups_count;    /* Number of groups in the fs */
     uint32_t s_first_data_block;	/* First Data Block */
     int      s_inode_size;
+    int      s_dir_index;	/* dir_index feature present */
+    int      s_hash_unsigned;	/* Use the unsigned dirhash variants */
+    uint32_t s_hash_seed[4];	/* HTREE hash seed */
 };
 
 static inline struct ext2_sb_info *EXT2_SB(struct fs_info *fs)
@@ -292,11 +336,26 @@ static inline struct ext2_sb_info *EXT2_SB(struct fs_info *fs)
 /*
  * ext2 private inode information
  */
+/*
+ * A run of logical blocks which are physically contiguous, or all holes
+ * (pblock == 0)
+ */
+struct ext2_run {
+    uint32_t lblock;		/* First logical block of the run */
+    uint32_t len;		/* Number of blocks */
+    block_t  pblock;		/* First physical block, or 0 */
+};
+
 struct ext2_pvt_inode {
     union {
 	uint32_t i_block[EXT2_N_BLOCKS];
 	struct ext4_extent_header i_extent_hdr;
     };
+
+    /* Block map built lazily by ext2_bmap(), covering [0, mapped) */
+    struct ext2_run *runs;
+    uint32_t nruns, maxruns;
+    uint32_t mapped;
 };
 
 #define PVT(i) ((struct ext2_pvt_inode *)((i)->pvt))
@@ -306,5 +365,7 @@ struct ext2_pvt_inode {
  */
 block_t ext2_bmap(struct inode *, block_t, size_t *);
 int ext2_next_extent(struct inode *, uint32_t);
+void ext2_destroy_inode(struct inode *);
+int ext2_dirhash(int, const char *, int, const uint32_t *, uint32_t *);
 
 #endif /* ext2_fs.h */
@@ -1,6 +1,8 @@
 #include <dprintf.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <minmax.h>
 #include <sys/dirent.h>
 #include <cache.h>
 #include <core.h>
@@ -83,7 +85,11 @@ static uint32_t get_next_cluster(struct fs_info *fs, uint32_t clust_num)
     return next_cluster;
 }
 
-static int fat_next_extent(struct inode *inode, uint32_t lstart)
+/*
+ * Find the extent containing lstart by following the cluster chain one
+ * FAT entry at a time.  Only used if there is no memory for a run map.
+ */
+static int fat_walk_extent(struct inode *inode, uint32_t lstart)
 {
     struct fs_info *fs = inode->fs;
     struct fat_sb_info *sbi = FAT_SB(fs);
@@ -143,6 +149,131 @@ err:
     return -1;
 }
 
+/*
+ * Extend the run map of an inode until it covers logical cluster
+ * mcluster and the run holding it is complete, or the chain ends.
+ * Returns -1 if the map could not be grown.
+ */
+static int fat_map_clusters(struct inode *inode, uint32_t mcluster,
+			    uint32_t tcluster)
+{
+    struct fs_info *fs = inode->fs;
+    struct fat_sb_info *sbi = FAT_SB(fs);
+    struct fat_pvt_inode *pvt = PVT(inode);
+    struct fat_run *run = NULL;
+    struct fat_run *runs;
+    uint32_t pcluster;
+    uint32_t maxruns;
+
+    if (pvt->nruns) {
+	run = &pvt->runs[pvt->nruns - 1];
+	if (mcluster < run->lcluster)
+	    return 0;		/* Already in a complete run */
+    } else if (!pvt->mapped) {
+	pvt->next_cluster = pvt->start_cluster;
+    }
+
+    while (pvt->mapped < tcluster) {
+	pcluster = pvt->next_cluster;
+	if (pcluster-2 >= sbi->clusters)
+	    break;		/* End of the chain */
+
+	if (run && run->pcluster + run->len == pcluster) {
+	    run->len++;
+	} else {
+	    if (pvt->mapped > mcluster)
+		break;		/* The run holding mcluster is complete */
+
+	    if (pvt->nruns == pvt->maxruns) {
+		maxruns = pvt->maxruns ? pvt->maxruns << 1 : 16;
+		runs = realloc(pvt->runs, maxruns * sizeof *runs);
+		if (!runs)
+		    return -1;
+		pvt->runs = runs;
+		pvt->maxruns = maxruns;
+	    }
+
+	    run = &pvt->runs[pvt->nruns++];
+	    run->lcluster = pvt->mapped;
+	    run->pcluster = pcluster;
+	    run->len = 1;
+	}
+
+	pvt->mapped++;
+	pvt->next_cluster = get_next_cluster(fs, pcluster);
+    }
+
+    return 0;
+}
+
+/*
+ * Map lstart through the run map, which is extended as far as needed
+ * first, so that seeking within a file costs O(log runs) FAT lookups
+ * instead of one per cluster.
+ */
+static int fat_next_extent(struct inode *inode, uint32_t lstart)
+{
+    struct fs_info *fs = inode->fs;
+    struct fat_sb_info *sbi = FAT_SB(fs);
+    struct fat_pvt_inode *pvt = PVT(inode);
+    uint32_t mcluster = lstart >> sbi->clust_shift;
+    uint32_t tcluster;
+    uint32_t xcluster;
+    uint32_t delta, len;
+    const uint32_t cluster_bytes = UINT32_C(1) << sbi->clust_byte_shift;
+    sector_t data_area = sbi->data;
+    const struct fat_run *run;
+    int lo, hi, mid;
+
+    tcluster = (inode->size + cluster_bytes - 1) >> sbi->clust_byte_shift;
+    if (mcluster >= tcluster)
+	return -1;		/* Requested cluster beyond end of file */
+
+    if (fat_map_clusters(inode, mcluster, tcluster))
+	return fat_walk_extent(inode, lstart);
+
+    if (mcluster >= pvt->mapped) {
+	inode->size = pvt->mapped << sbi->clust_shift;
+	return -1;		/* Chain ends short of the file size */
+    }
+
+    /* Find the last run starting at or before mcluster */
+    lo = 0;
+    hi = pvt->nruns - 1;
+    while (lo < hi) {
+	mid = (lo + hi + 1) >> 1;
+	if (pvt->runs[mid].lcluster <= mcluster)
+	    lo = mid;
+	else
+	    hi = mid - 1;
+    }
+    run = &pvt->runs[lo];
+    delta = mcluster - run->lcluster;
+    len = min(run->len - delta, tcluster - mcluster);
+
+    inode->next_extent.pstart =
+	((sector_t)(run->pcluster + delta - 2) << sbi->clust_shift) + data_area;
+    inode->next_extent.len = len << sbi->clust_shift;
+
+    if (delta + len < run->len)
+	xcluster = run->pcluster + delta + len;
+    else if (lo + 1 < (int)pvt->nruns)
+	xcluster = run[1].pcluster;
+    else
+	xcluster = pvt->next_cluster;
+
+    /* Keep the chain-walk position current, as fat_walk_extent() does */
+    pvt->offset = (mcluster + len) << sbi->clust_shift;
+    pvt->here   = ((xcluster-2) << sbi->clust_shift) + data_area;
+
+    return 0;
+}
+
+static void vfat_destroy_inode(struct inode *inode)
+{
+    free(PVT(inode)->runs);
+}
+
 static sector_t get_next_sector(struct fs_info* fs, uint32_t sector)
 {
     struct fat_sb_info *sbi = FAT_SB(fs);
@@ -773,8 +904,14 @@ static int vfat_fs_init(struct fs_info *fs)
     }
     sbi->clusters = clusters;
 
-    /* Initialize the cache */
+    /*
+     * Initialize the cache; FAT sectors and directory clusters are
+     * mostly walked in order, so read up to 16K ahead of a sequential
+     * miss.
+     */
     cache_init(fs->fs_dev, fs->block_shift);
+    cache_set_readahead(fs->fs_dev, (16 << 10) >> fs->block_shift,
+			total_sectors);
 
     return fs->block_shift;
 }
@@ -791,5 +928,6 @@ const struct fs_ops vfat_fs_ops = {
     .readdir       = vfat_readdir,
     .iget_root     = vfat_iget_root,
     .iget          = vfat_iget,
+    .destroy_inode = vfat_destroy_inode,
     .next_extent   = fat_next_extent,
 };
@@ -143,6 +143,15 @@ static inline int root_dir_size(struct fs_info *fs, struct fat_bpb *fat)
 	>> (SECTOR_SHIFT(fs) - 5);
 }
 
+/*
+ * A run of physically contiguous clusters in a file's cluster chain
+ */
+struct fat_run {
+    uint32_t lcluster;		/* First logical cluster of the run */
+    uint32_t pcluster;		/* First physical cluster of the run */
+    uint32_t len;		/* Number of clusters */
+};
+
 /*
  * FAT private inode information
  */
@@ -151,6 +160,16 @@ struct fat_pvt_inode {
     sector_t start;		/* Starting sector */
     sector_t offset;		/* Current sector offset */
     sector_t here;		/* Sector corresponding to offset */
+
+    /*
+     * Run map of the cluster chain, built lazily by fat_next_extent():
+     * runs[] covers logical clusters [0, mapped), and next_cluster is
+     * the FAT entry of the last mapped cluster.
+     */
+    struct fat_run *runs;
+    uint32_t nruns, maxruns;
+    uint32_t mapped;
+    uint32_t next_cluster;
 };
 
 #define PVT(i) ((struct fat_pvt_inode *)((i)->pvt))
@@ -37,7 +37,7 @@ void put_inode(struct inode *inode)
     while (inode && --inode->refcnt == 0) {
 	struct inode *dead = inode;
 	inode = inode->parent;
-	free(dead);
+	free_inode(dead);
     }
 }
 
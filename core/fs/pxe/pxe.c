@@ -49,6 +49,7 @@ static const struct tftp_options tftp_options[] =
 {
     { "tsize",   IFIELD(size) },
     { "blksize", PFIELD(tftp_blksize) },
+    { "windowsize", PFIELD(tftp_windowsize) },
 };
 static const int tftp_nopts = sizeof tftp_options / sizeof tftp_options[0];
 
@@ -79,6 +80,8 @@ static void free_socket(struct inode *inode)
     struct pxe_pvt_inode *socket = PVT(inode);
 
     free_port(socket->tftp_localport);
+    if (socket->tftp_window != socket->tftp_pktbuf)
+	free(socket->tftp_window);
     free_inode(inode);
 }
 
@@ -438,9 +441,8 @@ static void get_packet_gpxe(struct inode *inode)
 	    kaboom();
     }
 
-    memcpy(socket->tftp_pktbuf, packet_buf, file_read.BufferSize);
-
-    socket->tftp_dataptr   = socket->tftp_pktbuf;
+    /* The data is left in packet_buf, see keep_packet() */
+    socket->tftp_dataptr   = packet_buf;
     socket->tftp_bytesleft = file_read.BufferSize;
     socket->tftp_filepos  += file_read.BufferSize;
 
@@ -473,6 +475,137 @@ static void pxe_mangle_name(char *dst, const char *src)
     *dst = '\0';
 }
 
+/*
+ * Receive the next window of a windowsize (RFC 7440) transfer into the
+ * window buffer: ACK the last block we have, which makes the server
+ * send the blocks after it, and keep blocks in order until the buffer
+ * is full or the EOF block arrives.  Duplicates are dropped; on a gap
+ * or a timeout, the last block in order is ACKed again, which makes
+ * the server roll the window back to just after it.
+ */
+static void receive_window(struct inode *inode)
+{
+    int err;
+    uint16_t want, blk;
+    int16_t delta;
+    bool rolled_back = false;
+    const uint8_t *timeout_ptr;
+    uint8_t timeout;
+    uint16_t buffersize;
+    uint32_t oldtime;
+    static __lowmem struct s_PXENV_UDP_READ udp_read;
+    struct pxe_pvt_inode *socket = PVT(inode);
+
+    socket->tftp_winhead  = 0;
+    socket->tftp_wincount = 0;
+
+    timeout_ptr = TimeoutTable;
+    timeout = *timeout_ptr++;
+    oldtime = jiffies();
+
+    ack_packet(inode, socket->tftp_lastpkt);
+    want = ntohs(socket->tftp_lastpkt) + 1;
+
+    while (timeout) {
+        udp_read.buffer      = FAR_PTR(packet_buf);
+        udp_read.buffer_size = PKTBUF_SIZE;
+        udp_read.src_ip      = socket->tftp_remoteip;
+        udp_read.dest_ip     = IPInfo.myip;
+        udp_read.s_port      = socket->tftp_remoteport;
+        udp_read.d_port      = socket->tftp_localport;
+        err = pxe_call(PXENV_UDP_READ, &udp_read);
+        if (err) {
+	    uint32_t now = jiffies();
+
+	    if (now-oldtime >= timeout) {
+		oldtime = now;
+		timeout = *timeout_ptr++;
+		/* Whatever we have so far is good */
+		if (socket->tftp_wincount)
+		    break;
+		ack_packet(inode, socket->tftp_lastpkt);
+	    }
+            continue;
+        }
+
+        if (udp_read.buffer_size < 4)  /* Bad size for a DATA packet */
+            continue;
+        if (*(uint16_t *)packet_buf != TFTP_DATA)    /* Not a data packet */
+            continue;
+
+        blk = ntohs(*(uint16_t *)(packet_buf + 2));
+        delta = blk - want;
+        if (delta < 0)
+            continue;		/* Already have it */
+        if (delta > 0) {
+            /* Lost a block; have the server resend from the one we want */
+            if (!rolled_back) {
+                ack_packet(inode, socket->tftp_lastpkt);
+                rolled_back = true;
+            }
+            continue;
+        }
+
+        buffersize = udp_read.buffer_size - 4;  /* Skip TFTP header */
+        if (buffersize > socket->tftp_blksize)
+            continue;		/* Corrupt */
+
+        memcpy(socket->tftp_window +
+               socket->tftp_wincount * socket->tftp_blksize,
+               packet_buf + 4, buffersize);
+        socket->tftp_winlen[socket->tftp_wincount++] = buffersize;
+        socket->tftp_lastpkt = htons(want);
+        want++;
+        rolled_back = false;
+
+        /* Progress, so start the timeouts over */
+        timeout_ptr = TimeoutTable;
+        timeout = *timeout_ptr++;
+        oldtime = jiffies();
+
+        if (buffersize < socket->tftp_blksize) {
+            /* It's the last block, ACK it immediately */
+            ack_packet(inode, socket->tftp_lastpkt);
+            socket->tftp_wineof = 1;
+            break;
+        }
+
+        if (socket->tftp_wincount == socket->tftp_winslots)
+            break;		/* ACKed when the buffer has been drained */
+    }
+
+    /* time runs out */
+    if (!socket->tftp_wincount)
+	kaboom();
+}
+
+/*
+ * Hand out the next block of a windowed transfer, receiving another
+ * window first if the window buffer has been drained.
+ */
+static void fill_window(struct inode *inode)
+{
+    struct pxe_pvt_inode *socket = PVT(inode);
+    uint16_t buffersize;
+
+    if (!socket->tftp_wincount)
+        receive_window(inode);
+
+    buffersize = socket->tftp_winlen[socket->tftp_winhead];
+    socket->tftp_dataptr = socket->tftp_window +
+        socket->tftp_winhead * socket->tftp_blksize;
+    socket->tftp_winhead++;
+    socket->tftp_wincount--;
+    socket->tftp_filepos += buffersize;
+    socket->tftp_bytesleft = buffersize;
+
+    if (!socket->tftp_wincount && socket->tftp_wineof) {
+        /* Make sure we know we are at end of file */
+        inode->size 		= socket->tftp_filepos;
+        socket->tftp_goteof	= 1;
+    }
+}
+
 /*
  * Get a fresh packet if the buffer is drained, and we haven't hit
  * EOF yet.  The buffer should be filled immediately after draining!
@@ -499,6 +632,11 @@ static void fill_buffer(struct inode *inode)
     }
 #endif
 
+    if (socket->tftp_windowsize > 1) {
+        fill_window(inode);
+        return;
+    }
+
     /*
      * Start by ACKing the previous packet; this should cause
      * the next packet to be sent.
@@ -565,8 +703,8 @@ static void fill_buffer(struct inode *inode)
     /* It's the packet we want.  We're also EOF if the size < blocksize */
     socket->tftp_lastpkt = last_pkt;    /* Update last packet number */
     buffersize = udp_read.buffer_size - 4;  /* Skip TFTP header */
-    memcpy(socket->tftp_pktbuf, packet_buf + 4, buffersize);
-    socket->tftp_dataptr = socket->tftp_pktbuf;
+    /* The data is left in packet_buf, see keep_packet() */
+    socket->tftp_dataptr = packet_buf + 4;
     socket->tftp_filepos += buffersize;
     socket->tftp_bytesleft = buffersize;
     if (buffersize < socket->tftp_blksize) {
@@ -580,6 +718,26 @@ static void fill_buffer(struct inode *inode)
 }
 
 
+/*
+ * fill_buffer() leaves a freshly received packet in packet_buf, so
+ * that pxe_getfssec() copies the data only once, straight into the
+ * caller's buffer.  packet_buf is shared by all sockets, though, so
+ * whatever the caller did not take is moved into the socket's own
+ * buffer before returning.
+ */
+static void keep_packet(struct inode *inode)
+{
+    struct pxe_pvt_inode *socket = PVT(inode);
+
+    if (socket->tftp_bytesleft &&
+	socket->tftp_dataptr >= packet_buf &&
+	socket->tftp_dataptr < packet_buf + PKTBUF_SIZE) {
+	memcpy(socket->tftp_pktbuf, socket->tftp_dataptr,
+	       socket->tftp_bytesleft);
+	socket->tftp_dataptr = socket->tftp_pktbuf;
+    }
+}
+
 /**
  * getfssec: Get multiple clusters from a file, given the starting cluster.
  * In this case, get multiple blocks from a specific TCP connection.
@@ -630,6 +788,7 @@ static uint32_t pxe_getfssec(struct file *file, char *buf,
         *have_more = 0;
     }
 
+    keep_packet(inode);
     return bytes_read;
 }
 
@@ -655,7 +814,8 @@ static void pxe_searchdir(const char *filename, struct file *file)
     static __lowmem struct s_PXENV_UDP_WRITE udp_write;
     static __lowmem struct s_PXENV_UDP_READ  udp_read;
     static __lowmem struct s_PXENV_FILE_OPEN file_open;
-    static const char rrq_tail[] = "octet\0""tsize\0""0\0""blksize\0""1408";
+    static const char rrq_tail[] = "octet\0""tsize\0""0\0""blksize\0""1408"
+	"\0""windowsize\0""8";	/* TFTP_LARGEBLK, TFTP_WINDOWSIZE */
     static __lowmem char rrq_packet_buf[2+2*FILENAME_MAX+sizeof rrq_tail];
     const struct tftp_options *tftp_opt;
     int i = 0;
@@ -821,8 +981,9 @@ wait_pkt:
 
     /* filesize <- -1 == unknown */
     inode->size = -1;
-    /* Default blksize unless blksize option negotiated */
+    /* Default blksize and windowsize unless the options are negotiated */
     socket->tftp_blksize = TFTP_BLOCKSIZE;
+    socket->tftp_windowsize = 1;
     buffersize = udp_read.buffer_size - 2;  /* bytes after opcode */
     if (buffersize < 0)
         goto wait_pkt;                     /* Garbled reply */
@@ -895,7 +1056,7 @@ wait_pkt:
 	     * discard the rest.
 	     */
 	    if (!*opt)
-		goto done;
+		break;
 
             while (buffersize) {
                 if (!*p)
@@ -943,6 +1104,22 @@ wait_pkt:
             }
 	    *opdata_ptr = opdata;
 	}
+
+	if (socket->tftp_windowsize > 1) {
+	    /* The server may lower what we asked for, but not raise it */
+	    if (socket->tftp_windowsize > TFTP_WINDOWSIZE ||
+		socket->tftp_blksize > TFTP_LARGEBLK)
+		goto err_reply;
+
+	    socket->tftp_winslots = socket->tftp_windowsize;
+	    socket->tftp_window =
+		malloc(socket->tftp_winslots * socket->tftp_blksize);
+	    if (!socket->tftp_window) {
+		/* Still works, with a round trip per block */
+		socket->tftp_winslots = 1;
+		socket->tftp_window = socket->tftp_pktbuf;
+	    }
+	}
 	break;
 
     default:
@@ -30,6 +30,8 @@
 #define TFTP_BLOCKSIZE_LG2 9
 #define TFTP_BLOCKSIZE  (1 << TFTP_BLOCKSIZE_LG2)
 #define PKTBUF_SIZE     2048			/*  */
+#define TFTP_LARGEBLK   1408			/* blksize we ask for */
+#define TFTP_WINDOWSIZE 8			/* windowsize we ask for */
 
 #define is_digit(c)     (((c) >= '0') && ((c) <= '9'))
 
@@ -162,7 +164,13 @@ struct pxe_pvt_inode {
     uint16_t tftp_lastpkt;     /* Sequence number of last packet (NBO) */
     char    *tftp_dataptr;     /* Pointer to available data */
     uint8_t  tftp_goteof;      /* 1 if the EOF packet received */
-    uint8_t  tftp_unused[3];   /* Currently unused */
+    uint8_t  tftp_wineof;      /* 1 if the EOF packet is in the window */
+    uint16_t tftp_winslots;    /* Blocks the window buffer holds */
+    uint32_t tftp_windowsize;  /* Blocks per ACK (RFC 7440), 1 if none */
+    char    *tftp_window;      /* Window buffer, tftp_winslots blocks */
+    uint16_t tftp_winhead;     /* Next block in the window buffer */
+    uint16_t tftp_wincount;    /* Blocks left in the window buffer */
+    uint16_t tftp_winlen[TFTP_WINDOWSIZE]; /* Data bytes in each block */
     char     tftp_pktbuf[PKTBUF_SIZE];
 } __attribute__ ((packed));
 
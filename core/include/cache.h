@@ -11,7 +11,10 @@ struct cache {
     block_t block;
     struct cache *prev;
     struct cache *next;
+    struct cache *hash_next;	/* Chain of blocks with the same hash */
+    struct cache **hash_pprev;	/* Pointer to the link pointing at us */
     void *data;
+    bool readahead;		/* Read ahead, not yet asked for */
 };
 
 /* functions defined in cache.c */
@@ -19,5 +22,6 @@ void cache_init(struct device *, int);
 const void *get_cache(struct device *, block_t);
 struct cache *_get_cache_block(struct device *, block_t);
 void cache_lock_block(struct cache *);
+void cache_set_readahead(struct device *, uint32_t, block_t);
 
 #endif /* cache.h */
@@ -66,6 +66,7 @@ struct fs_ops {
     struct inode * (*iget_root)(struct fs_info *);
     struct inode * (*iget)(const char *, struct inode *);
     int	     (*readlink)(struct inode *, char *);
+    void     (*destroy_inode)(struct inode *); /* free private data, if any */
 
     /* the _dir_ stuff */
     int	     (*readdir)(struct file *, struct dirent *);
@@ -123,15 +124,40 @@ struct file {
  */
 struct cache;
 
+/* Block cache counters, for tuning the read-ahead window (DEBUG_CACHE) */
+struct cache_stats {
+    uint32_t hits;		/* Blocks found in the cache */
+    uint32_t misses;		/* Blocks that had to be read */
+    uint32_t reads;		/* Disk reads issued for misses */
+    uint32_t ra_blocks;		/* Blocks read ahead of a miss */
+    uint32_t ra_hits;		/* Read-ahead blocks later asked for */
+};
+
+/* A sequential stream of cache misses, see get_cache() */
+#define CACHE_RA_STREAMS	4
+
+struct cache_stream {
+    block_t next;		/* Block that would continue the stream */
+    uint32_t window;		/* Blocks read on its next miss */
+};
+
 struct device {
     struct disk *disk;
 
     /* the cache stuff */
     char *cache_data;
     struct cache *cache_head;
+    struct cache **cache_hash;	/* Hash buckets, indexed by block */
+    uint32_t cache_hash_mask;
     uint16_t cache_block_size;
-    uint16_t cache_entries;
+    uint32_t cache_entries;
     uint32_t cache_size;
+
+    /* sequential read-ahead, see get_cache() */
+    uint32_t cache_ra_max;	/* Most blocks read on a miss, 0 = off */
+    block_t cache_ra_limit;	/* Never read ahead at or past this block */
+    struct cache_stream cache_streams[CACHE_RA_STREAMS]; /* MRU first */
+    struct cache_stats cache_stats;
 };
 
 /*
@@ -148,6 +174,8 @@ static inline bool not_whitespace(char c)
 struct inode *alloc_inode(struct fs_info *fs, uint32_t ino, size_t data);
 static inline void free_inode(struct inode * inode)
 {
+    if (inode->fs && inode->fs->fs_ops->destroy_inode)
+	inode->fs->fs_ops->destroy_inode(inode);
     free(inode);
 }
 
@@ -12,6 +12,7 @@
 FILE_LICENCE ( GPL2_OR_LATER );
 
 #include <gpxe/tcpip.h>
+#include <gpxe/netdevice.h>
 
 /**
  * A TCP header
@@ -54,6 +55,71 @@ struct tcp_mss_option {
 /** Code for the TCP MSS option */
 #define TCP_OPTION_MSS 2
 
+/** TCP window scale option */
+struct tcp_window_scale_option {
+	uint8_t kind;
+	uint8_t length;
+	uint8_t scale;
+} __attribute__ (( packed ));
+
+/** Padded TCP window scale option (used for sending) */
+struct tcp_window_scale_padded_option {
+	uint8_t nop[1];
+	struct tcp_window_scale_option wsopt;
+} __attribute__ (( packed ));
+
+/** Code for the TCP window scale option */
+#define TCP_OPTION_WS 3
+
+/** Largest window scale allowed by RFC 7323 */
+#define TCP_MAX_WINDOW_SCALE 14
+
+/** TCP selective acknowledgement permitted option */
+struct tcp_sack_permitted_option {
+	uint8_t kind;
+	uint8_t length;
+} __attribute__ (( packed ));
+
+/** Padded TCP selective acknowledgement permitted option (used for
+ * sending)
+ */
+struct tcp_sack_permitted_padded_option {
+	uint8_t nop[2];
+	struct tcp_sack_permitted_option spopt;
+} __attribute__ (( packed ));
+
+/** Code for the TCP selective acknowledgement permitted option */
+#define TCP_OPTION_SACK_PERMITTED 4
+
+/** TCP selective acknowledgement option */
+struct tcp_sack_option {
+	uint8_t kind;
+	uint8_t length;
+} __attribute__ (( packed ));
+
+/** TCP selective acknowledgement block */
+struct tcp_sack_block {
+	uint32_t left;
+	uint32_t right;
+} __attribute__ (( packed ));
+
+/** Padded TCP selective acknowledgement option (used for sending) */
+struct tcp_sack_padded_option {
+	uint8_t nop[2];
+	struct tcp_sack_option sackopt;
+} __attribute__ (( packed ));
+
+/** Code for the TCP selective acknowledgement option */
+#define TCP_OPTION_SACK 5
+
+/**
+ * Maximum number of selective acknowledgement blocks we send
+ *
+ * Three blocks are all that fit in the option space alongside the
+ * timestamp option.
+ */
+#define TCP_SACK_MAX 3
+
 /** TCP timestamp option */
 struct tcp_timestamp_option {
 	uint8_t kind;
@@ -75,12 +141,40 @@ struct tcp_timestamp_padded_option {
 struct tcp_options {
 	/** MSS option, if present */
 	const struct tcp_mss_option *mssopt;
+	/** Window scale option, if present */
+	const struct tcp_window_scale_option *wsopt;
+	/** SACK permitted option, if present */
+	const struct tcp_sack_permitted_option *spopt;
 	/** Timestampe option, if present */
 	const struct tcp_timestamp_option *tsopt;
 };
 
 /** @} */
 
+/**
+ * Internal header prepended to a received packet held on the
+ * out-of-order receive queue
+ */
+struct tcp_rx_queued_header {
+	/** SEQ value, in host-endian order
+	 *
+	 * This represents the SEQ value at the time the packet is
+	 * enqueued, and so excludes the SYN, if present.
+	 */
+	uint32_t seq;
+	/** Next SEQ value, in host-endian order */
+	uint32_t nxt;
+	/** Flags
+	 *
+	 * Only FIN is valid within this flags byte; all other flags
+	 * have already been processed by the time the packet is
+	 * enqueued.
+	 */
+	uint8_t flags;
+	/** Reserved */
+	uint8_t reserved[3];
+};
+
 /*
  * TCP flags
  */
@@ -258,7 +352,14 @@ struct tcp_options {
 #define TCP_MIN_PORT 1
 
 /* Some IOB constants */
-#define MAX_HDR_LEN	100
+/**
+ * Headroom reserved in TCP transmit buffers
+ *
+ * Room for the longest link-layer header, an IPv6 header and a TCP
+ * header carrying the full 40 bytes of options (timestamps plus three
+ * SACK blocks).
+ */
+#define MAX_HDR_LEN	( MAX_LL_HEADER_LEN + 40 + 20 + 40 )
 #define MAX_IOB_LEN	1500
 #define MIN_IOB_LEN	MAX_HDR_LEN + 100 /* To account for padding by LL */
 
@@ -269,25 +370,40 @@ struct tcp_options {
  * have.  This is not strictly accurate (since it ignores any space
  * already allocated as RX buffers), but it will do for now.
  *
- * Since we don't store out-of-order received packets, the
- * retransmission penalty is that the whole window contents must be
- * resent.  This suggests keeping the window size small, but bear in
- * mind that the maximum bandwidth on any link is limited to
+ * Out-of-order packets are held on a receive queue and reported to
+ * the peer with selective acknowledgements, so a lost packet costs
+ * a retransmission of only the missing data rather than of the whole
+ * window.  Bear in mind that the maximum bandwidth on any link is
+ * limited to
  *
  *    max_bandwidth = ( tcp_window / round_trip_time )
  *
- * With a 48kB window, which probably accurately reflects our amount
- * of free memory, and a WAN RTT of say 200ms, this gives a maximum
- * bandwidth of 240kB/s.  This is sufficiently close to realistic that
- * we will need to be careful that our advertised window doesn't end
- * up limiting WAN download speeds.
+ * With a 64kB window and a WAN RTT of say 200ms, this gives a maximum
+ * bandwidth of 320kB/s.  We therefore allow a larger window, using
+ * window scaling, whenever free memory permits.
+ *
+ * The window is kept a multiple of four, to ensure that payloads
+ * remain dword-aligned.
+ */
+#define TCP_MAX_WINDOW_SIZE	( 256 * 1024 )
+
+/**
+ * Maximum unscaled advertised TCP window size
+ *
+ * Used when the peer does not support window scaling, and in SYNs.
+ * Since the window goes into a 16-bit field and we cannot actually
+ * use 65536, we use a window size of (65536-4) to ensure that
+ * payloads remain dword-aligned.
+ */
+#define TCP_MAX_UNSCALED_WINDOW_SIZE ( 65536 - 4 )
+
+/**
+ * Receive window scale
  *
- * Finally, since the window goes into a 16-bit field and we cannot
- * actually use 65536, we use a window size of (65536-4) to ensure
- * that payloads remain dword-aligned.
+ * The shift we ask the peer to apply to our advertised window.  A
+ * shift of 9 allows a window of up to 32MB in units of 512 bytes.
  */
-#define TCP_MAX_WINDOW_SIZE	( 65536 - 4 )
-//#define TCP_MAX_WINDOW_SIZE	4096
+#define TCP_RX_WINDOW_SCALE 9
 
 /**
  * Path MTU
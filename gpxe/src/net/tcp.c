@@ -79,9 +79,33 @@ struct tcp_connection {
 	uint32_t ts_recent;
 	/** Timestamps enabled */
 	int timestamps;
+	/** Send window scale
+	 *
+	 * Equivalent to Snd.Wind.Shift in RFC 7323 terminology.
+	 */
+	unsigned int snd_win_scale;
+	/** Receive window scale
+	 *
+	 * Equivalent to Rcv.Wind.Shift in RFC 7323 terminology.
+	 */
+	unsigned int rcv_win_scale;
+	/** Selective acknowledgements enabled */
+	int sack;
+	/** Start of most recently queued out-of-order packet
+	 *
+	 * The SACK block containing this is reported first, as per
+	 * RFC 2018.
+	 */
+	uint32_t sack_seq;
 
 	/** Transmit queue */
 	struct list_head queue;
+	/** Receive queue
+	 *
+	 * Packets received ahead of RCV.NXT, each with a struct
+	 * tcp_rx_queued_header prepended, sorted by sequence number.
+	 */
+	struct list_head rx_queue;
 	/** Retransmission timer */
 	struct retry_timer timer;
 };
@@ -97,6 +121,20 @@ static void tcp_expired ( struct retry_timer *timer, int over );
 static int tcp_rx_ack ( struct tcp_connection *tcp, uint32_t ack,
 			uint32_t win );
 
+/**
+ * Compare TCP sequence numbers
+ *
+ * @v seq1		Sequence number 1
+ * @v seq2		Sequence number 2
+ * @ret diff		Sequence difference
+ *
+ * The difference is negative if @c seq1 is before @c seq2, taking
+ * sequence number wraparound into account.
+ */
+static inline int32_t tcp_cmp ( uint32_t seq1, uint32_t seq2 ) {
+	return ( ( int32_t ) ( seq1 - seq2 ) );
+}
+
 /**
  * Name TCP state
  *
@@ -230,6 +268,7 @@ static int tcp_open ( struct xfer_interface *xfer, struct sockaddr *peer,
 	tcp_dump_state ( tcp );
 	tcp->snd_seq = random();
 	INIT_LIST_HEAD ( &tcp->queue );
+	INIT_LIST_HEAD ( &tcp->rx_queue );
 	tcp->timer.expired = tcp_expired;
 	memcpy ( &tcp->peer, st_peer, sizeof ( tcp->peer ) );
 
@@ -287,6 +326,12 @@ static void tcp_close ( struct tcp_connection *tcp, int rc ) {
 			free_iob ( iobuf );
 		}
 
+		/* Free any unprocessed received I/O buffers */
+		list_for_each_entry_safe ( iobuf, tmp, &tcp->rx_queue, list ) {
+			list_del ( &iobuf->list );
+			free_iob ( iobuf );
+		}
+
 		/* Remove from list and drop reference */
 		stop_timer ( &tcp->timer );
 		list_del ( &tcp->list );
@@ -379,6 +424,79 @@ static size_t tcp_process_queue ( struct tcp_connection *tcp, size_t max_len,
 	return len;
 }
 
+/**
+ * Add selective acknowledgement block
+ *
+ * @v tcp		TCP connection
+ * @v sack		SACK block list
+ * @v count		Number of blocks already in list
+ * @v block		Block to add
+ * @ret count		New number of blocks in list
+ */
+static unsigned int tcp_sack_add ( struct tcp_connection *tcp,
+				   struct tcp_sack_block *sack,
+				   unsigned int count,
+				   struct tcp_sack_block *block ) {
+
+	/* Report the block holding the most recent packet first */
+	if ( ( tcp_cmp ( tcp->sack_seq, block->left ) >= 0 ) &&
+	     ( tcp_cmp ( tcp->sack_seq, block->right ) < 0 ) ) {
+		if ( count == TCP_SACK_MAX )
+			count--;
+		memmove ( &sack[1], &sack[0], ( count * sizeof ( sack[0] ) ) );
+		memcpy ( &sack[0], block, sizeof ( sack[0] ) );
+		return ( count + 1 );
+	}
+
+	/* Otherwise, report the block only if there is room */
+	if ( count == TCP_SACK_MAX )
+		return count;
+	memcpy ( &sack[count], block, sizeof ( sack[count] ) );
+	return ( count + 1 );
+}
+
+/**
+ * Construct selective acknowledgement blocks
+ *
+ * @v tcp		TCP connection
+ * @v sack		SACK block list to fill in (in host-endian order)
+ * @ret count		Number of blocks
+ *
+ * Describes the contents of the receive queue as up to @c
+ * TCP_SACK_MAX contiguous blocks.
+ */
+static unsigned int tcp_sack ( struct tcp_connection *tcp,
+			       struct tcp_sack_block *sack ) {
+	struct io_buffer *queued;
+	struct tcp_rx_queued_header *tcpqhdr;
+	struct tcp_sack_block block;
+	unsigned int count = 0;
+	int have_block = 0;
+
+	list_for_each_entry ( queued, &tcp->rx_queue, list ) {
+		tcpqhdr = queued->data;
+
+		/* Extend current block if this packet is contiguous */
+		if ( have_block &&
+		     ( tcp_cmp ( tcpqhdr->seq, block.right ) <= 0 ) ) {
+			if ( tcp_cmp ( tcpqhdr->nxt, block.right ) > 0 )
+				block.right = tcpqhdr->nxt;
+			continue;
+		}
+
+		/* Otherwise, start a new block */
+		if ( have_block )
+			count = tcp_sack_add ( tcp, sack, count, &block );
+		block.left = tcpqhdr->seq;
+		block.right = tcpqhdr->nxt;
+		have_block = 1;
+	}
+	if ( have_block )
+		count = tcp_sack_add ( tcp, sack, count, &block );
+
+	return count;
+}
+
 /**
  * Transmit any outstanding data
  *
@@ -395,13 +513,21 @@ static int tcp_xmit ( struct tcp_connection *tcp, int force_send ) {
 	struct io_buffer *iobuf;
 	struct tcp_header *tcphdr;
 	struct tcp_mss_option *mssopt;
+	struct tcp_window_scale_padded_option *wsopt;
+	struct tcp_sack_permitted_padded_option *spopt;
 	struct tcp_timestamp_padded_option *tsopt;
+	struct tcp_sack_padded_option *sackopt;
+	struct tcp_sack_block sack[TCP_SACK_MAX];
+	struct tcp_sack_block *sackblk;
+	unsigned int sack_count = 0;
+	unsigned int i;
 	void *payload;
 	unsigned int flags;
 	size_t len = 0;
 	uint32_t seq_len;
 	uint32_t app_win;
 	uint32_t max_rcv_win;
+	uint32_t rcv_win;
 	int rc;
 
 	/* If retransmission timer is already running, do nothing */
@@ -467,6 +593,31 @@ static int tcp_xmit ( struct tcp_connection *tcp, int force_send ) {
 		mssopt->kind = TCP_OPTION_MSS;
 		mssopt->length = sizeof ( *mssopt );
 		mssopt->mss = htons ( TCP_MSS );
+		wsopt = iob_push ( iobuf, sizeof ( *wsopt ) );
+		memset ( wsopt->nop, TCP_OPTION_NOP, sizeof ( wsopt->nop ) );
+		wsopt->wsopt.kind = TCP_OPTION_WS;
+		wsopt->wsopt.length = sizeof ( wsopt->wsopt );
+		wsopt->wsopt.scale = TCP_RX_WINDOW_SCALE;
+		spopt = iob_push ( iobuf, sizeof ( *spopt ) );
+		memset ( spopt->nop, TCP_OPTION_NOP, sizeof ( spopt->nop ) );
+		spopt->spopt.kind = TCP_OPTION_SACK_PERMITTED;
+		spopt->spopt.length = sizeof ( spopt->spopt );
+	}
+	if ( tcp->sack && ! ( flags & TCP_SYN ) )
+		sack_count = tcp_sack ( tcp, sack );
+	if ( sack_count ) {
+		sackblk = iob_push ( iobuf, ( sack_count *
+					      sizeof ( *sackblk ) ) );
+		for ( i = 0 ; i < sack_count ; i++ ) {
+			sackblk[i].left = htonl ( sack[i].left );
+			sackblk[i].right = htonl ( sack[i].right );
+		}
+		sackopt = iob_push ( iobuf, sizeof ( *sackopt ) );
+		memset ( sackopt->nop, TCP_OPTION_NOP, sizeof ( sackopt->nop ) );
+		sackopt->sackopt.kind = TCP_OPTION_SACK;
+		sackopt->sackopt.length = ( sizeof ( sackopt->sackopt ) +
+					    ( sack_count *
+					      sizeof ( *sackblk ) ) );
 	}
 	if ( ( flags & TCP_SYN ) || tcp->timestamps ) {
 		tsopt = iob_push ( iobuf, sizeof ( *tsopt ) );
@@ -478,6 +629,15 @@ static int tcp_xmit ( struct tcp_connection *tcp, int force_send ) {
 	}
 	if ( ! ( flags & TCP_SYN ) )
 		flags |= TCP_PSH;
+
+	/* Calculate advertised window.  The window in a SYN is never
+	 * scaled.
+	 */
+	rcv_win = tcp->rcv_win;
+	if ( ! ( flags & TCP_SYN ) )
+		rcv_win >>= tcp->rcv_win_scale;
+	if ( rcv_win > TCP_MAX_UNSCALED_WINDOW_SIZE )
+		rcv_win = TCP_MAX_UNSCALED_WINDOW_SIZE;
 	tcphdr = iob_push ( iobuf, sizeof ( *tcphdr ) );
 	memset ( tcphdr, 0, sizeof ( *tcphdr ) );
 	tcphdr->src = tcp->local_port;
@@ -486,7 +646,7 @@ static int tcp_xmit ( struct tcp_connection *tcp, int force_send ) {
 	tcphdr->ack = htonl ( tcp->rcv_ack );
 	tcphdr->hlen = ( ( payload - iobuf->data ) << 2 );
 	tcphdr->flags = flags;
-	tcphdr->win = htons ( tcp->rcv_win );
+	tcphdr->win = htons ( rcv_win );
 	tcphdr->csum = tcpip_chksum ( iobuf->data, iob_len ( iobuf ) );
 
 	/* Dump header */
@@ -578,7 +738,7 @@ static int tcp_xmit_reset ( struct tcp_connection *tcp,
 	tcphdr->ack = in_tcphdr->seq;
 	tcphdr->hlen = ( ( sizeof ( *tcphdr ) / 4 ) << 4 );
 	tcphdr->flags = ( TCP_RST | TCP_ACK );
-	tcphdr->win = htons ( TCP_MAX_WINDOW_SIZE );
+	tcphdr->win = htons ( TCP_MAX_UNSCALED_WINDOW_SIZE );
 	tcphdr->csum = tcpip_chksum ( iobuf->data, iob_len ( iobuf ) );
 
 	/* Dump header */
@@ -653,6 +813,18 @@ static void tcp_rx_opts ( struct tcp_connection *tcp, const void *data,
 		case TCP_OPTION_MSS:
 			options->mssopt = data;
 			break;
+		case TCP_OPTION_WS:
+			options->wsopt = data;
+			break;
+		case TCP_OPTION_SACK_PERMITTED:
+			options->spopt = data;
+			break;
+		case TCP_OPTION_SACK:
+			/* We never have more than one packet in
+			 * flight, so there is nothing to gain from
+			 * the peer's SACK blocks.
+			 */
+			break;
 		case TCP_OPTION_TS:
 			options->tsopt = data;
 			break;
@@ -696,6 +868,15 @@ static int tcp_rx_syn ( struct tcp_connection *tcp, uint32_t seq,
 		tcp->rcv_ack = seq;
 		if ( options->tsopt )
 			tcp->timestamps = 1;
+		if ( options->wsopt ) {
+			/* We always send a window scale in our SYN */
+			tcp->snd_win_scale = options->wsopt->scale;
+			if ( tcp->snd_win_scale > TCP_MAX_WINDOW_SCALE )
+				tcp->snd_win_scale = TCP_MAX_WINDOW_SCALE;
+			tcp->rcv_win_scale = TCP_RX_WINDOW_SCALE;
+		}
+		if ( options->spopt )
+			tcp->sack = 1;
 	}
 
 	/* Ignore duplicate SYN */
@@ -876,6 +1057,118 @@ static int tcp_rx_rst ( struct tcp_connection *tcp, uint32_t seq ) {
 	return -ECONNRESET;
 }
 
+/**
+ * Enqueue received TCP packet
+ *
+ * @v tcp		TCP connection
+ * @v seq		SEQ value (in host-endian order)
+ * @v flags		TCP flags
+ * @v iobuf		I/O buffer
+ *
+ * This function takes ownership of the I/O buffer.  Packets are held
+ * on the receive queue, in sequence order, until all preceding data
+ * has been received.
+ */
+static void tcp_rx_enqueue ( struct tcp_connection *tcp, uint32_t seq,
+			     unsigned int flags, struct io_buffer *iobuf ) {
+	struct tcp_rx_queued_header *tcpqhdr;
+	struct io_buffer *queued;
+	uint32_t seq_len;
+	uint32_t nxt;
+
+	/* Calculate remaining flags and sequence length.  Note that
+	 * SYN, if present, has already been processed by this point.
+	 */
+	flags &= TCP_FIN;
+	seq_len = ( iob_len ( iobuf ) + ( flags ? 1 : 0 ) );
+	nxt = ( seq + seq_len );
+
+	/* Discard immediately (to save memory) if:
+	 *
+	 * a) we have not yet received a SYN (and so have no defined
+	 *    receive window), or
+	 * b) there is no further content to process, or
+	 * c) the packet lies entirely before RCV.NXT, or
+	 * d) the packet is out of order and starts beyond the
+	 *    receive window.
+	 */
+	if ( ( ! ( tcp->tcp_state & TCP_STATE_RCVD ( TCP_SYN ) ) ) ||
+	     ( seq_len == 0 ) ||
+	     ( tcp_cmp ( nxt, tcp->rcv_ack ) <= 0 ) ||
+	     ( ( tcp_cmp ( seq, tcp->rcv_ack ) > 0 ) &&
+	       ( ( seq - tcp->rcv_ack ) >= tcp->rcv_win ) ) ) {
+		free_iob ( iobuf );
+		return;
+	}
+
+	/* Remember the most recent out-of-order packet for SACK */
+	if ( tcp_cmp ( seq, tcp->rcv_ack ) > 0 ) {
+		DBGC2 ( tcp, "TCP %p queued out-of-order %08x..%08x\n",
+			tcp, seq, nxt );
+		tcp->sack_seq = seq;
+	}
+
+	/* Add internal header */
+	tcpqhdr = iob_push ( iobuf, sizeof ( *tcpqhdr ) );
+	tcpqhdr->seq = seq;
+	tcpqhdr->nxt = nxt;
+	tcpqhdr->flags = flags;
+
+	/* Add to RX queue, after any packets starting at or before it */
+	list_for_each_entry ( queued, &tcp->rx_queue, list ) {
+		tcpqhdr = queued->data;
+		if ( tcp_cmp ( seq, tcpqhdr->seq ) < 0 )
+			break;
+	}
+	list_add_tail ( &iobuf->list, &queued->list );
+}
+
+/**
+ * Process receive queue
+ *
+ * @v tcp		TCP connection
+ *
+ * Delivers all queued packets up to the first gap in the sequence
+ * space.
+ */
+static void tcp_process_rx_queue ( struct tcp_connection *tcp ) {
+	struct io_buffer *iobuf;
+	struct tcp_rx_queued_header *tcpqhdr;
+	uint32_t seq;
+	unsigned int flags;
+	size_t len;
+
+	/* We cannot use list_for_each_entry() here, since delivering
+	 * data may cause the application to close the connection.
+	 */
+	while ( ! list_empty ( &tcp->rx_queue ) ) {
+		iobuf = list_entry ( tcp->rx_queue.next, struct io_buffer,
+				     list );
+
+		/* Stop processing when we hit the first gap */
+		tcpqhdr = iobuf->data;
+		if ( tcp_cmp ( tcpqhdr->seq, tcp->rcv_ack ) > 0 )
+			break;
+
+		/* Strip internal header and remove from RX queue */
+		list_del ( &iobuf->list );
+		seq = tcpqhdr->seq;
+		flags = tcpqhdr->flags;
+		iob_pull ( iobuf, sizeof ( *tcpqhdr ) );
+		len = iob_len ( iobuf );
+
+		/* Handle new data, if any */
+		tcp_rx_data ( tcp, seq, iob_disown ( iobuf ) );
+		seq += len;
+
+		/* Handle FIN, if present */
+		if ( flags & TCP_FIN ) {
+			tcp_rx_fin ( tcp, seq );
+			seq++;
+		}
+	}
+}
+
 /**
  * Process received packet
  *
@@ -900,6 +1193,7 @@ static int tcp_rx ( struct io_buffer *iobuf,
 	uint32_t win;
 	unsigned int flags;
 	size_t len;
+	int in_order;
 	int rc;
 
 	/* Sanity check packet */
@@ -958,6 +1252,12 @@ static int tcp_rx ( struct io_buffer *iobuf,
 		goto discard;
 	}
 
+	/* Scale the peer's window.  The window in a SYN is never
+	 * scaled.
+	 */
+	if ( ! ( flags & TCP_SYN ) )
+		win <<= tcp->snd_win_scale;
+
 	/* Handle ACK, if present */
 	if ( flags & TCP_ACK ) {
 		if ( ( rc = tcp_rx_ack ( tcp, ack, win ) ) != 0 ) {
@@ -978,18 +1278,24 @@ static int tcp_rx ( struct io_buffer *iobuf,
 			goto discard;
 	}
 
-	/* Handle new data, if any */
-	tcp_rx_data ( tcp, seq, iobuf );
-	seq += len;
+	/* Note whether the packet covers RCV.NXT, for the timestamp
+	 * update below.  Packets entirely before or after it must not
+	 * update TS.Recent.
+	 */
+	in_order = ( ( tcp_cmp ( seq, tcp->rcv_ack ) <= 0 ) &&
+		     ( tcp_cmp ( ( seq + len ), tcp->rcv_ack ) >= 0 ) );
 
-	/* Handle FIN, if present */
-	if ( flags & TCP_FIN ) {
-		tcp_rx_fin ( tcp, seq );
+	/* Enqueue received data and FIN, and process the receive
+	 * queue
+	 */
+	tcp_rx_enqueue ( tcp, seq, flags, iob_disown ( iobuf ) );
+	tcp_process_rx_queue ( tcp );
+	seq += len;
+	if ( flags & TCP_FIN )
 		seq++;
-	}
 
 	/* Update timestamp, if present and applicable */
-	if ( ( seq == tcp->rcv_ack ) && options.tsopt )
+	if ( in_order && options.tsopt )
 		tcp->ts_recent = ntohl ( options.tsopt->tsval );
 
 	/* Dump out any state change as a result of the received packet */
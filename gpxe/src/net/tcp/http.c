@@ -44,6 +44,7 @@ FILE_LICENCE ( GPL2_OR_LATER );
 #include <gpxe/linebuf.h>
 #include <gpxe/features.h>
 #include <gpxe/base64.h>
+#include <gpxe/list.h>
 #include <gpxe/http.h>
 
 FEATURE ( FEATURE_PROTOCOL, "HTTP", DHCP_EB_FEATURE_HTTP, 1 );
@@ -52,10 +53,17 @@ FEATURE ( FEATURE_PROTOCOL, "HTTP", DHCP_EB_FEATURE_HTTP, 1 );
 enum http_rx_state {
 	HTTP_RX_RESPONSE = 0,
 	HTTP_RX_HEADER,
+	HTTP_RX_CHUNK_LEN,
 	HTTP_RX_DATA,
+	HTTP_RX_TRAILER,
+	HTTP_RX_IDLE,
 	HTTP_RX_DEAD,
 };
 
+/** An HTTP socket filter (e.g. TLS) */
+typedef int ( * http_filter_t ) ( struct xfer_interface *xfer,
+				  struct xfer_interface **next );
+
 /**
  * An HTTP request
  *
@@ -68,8 +76,14 @@ struct http_request {
 
 	/** URI being fetched */
 	struct uri *uri;
+	/** Server port */
+	unsigned int port;
+	/** Filter to apply to socket, or NULL */
+	http_filter_t filter;
 	/** Transport layer interface */
 	struct xfer_interface socket;
+	/** Socket was taken from the idle connection pool */
+	int reused;
 
 	/** TX process */
 	struct process process;
@@ -78,6 +92,14 @@ struct http_request {
 	unsigned int response;
 	/** HTTP Content-Length */
 	size_t content_length;
+	/** Content-Length header was present */
+	int has_length;
+	/** Response uses chunked transfer encoding */
+	int chunked;
+	/** Remaining length of current chunk */
+	size_t chunk_len;
+	/** Server will keep the connection open after the response */
+	int keepalive;
 	/** Received length */
 	size_t rx_len;
 	/** RX state */
@@ -86,6 +108,36 @@ struct http_request {
 	struct line_buffer linebuf;
 };
 
+/**
+ * An idle persistent HTTP connection
+ *
+ * Connections whose response has been read completely are kept here,
+ * so that the next request to the same server can skip the TCP
+ * handshake and slow start.
+ */
+struct http_connection {
+	/** Reference count */
+	struct refcnt refcnt;
+	/** List of idle connections */
+	struct list_head list;
+	/** Transport layer interface */
+	struct xfer_interface socket;
+	/** Server host name */
+	char *host;
+	/** Server port */
+	unsigned int port;
+	/** Filter applied to socket, or NULL */
+	http_filter_t filter;
+};
+
+/** Maximum number of idle connections kept */
+#define HTTP_MAX_IDLE 4
+
+/** Idle connections, most recently used first */
+static LIST_HEAD ( http_idle );
+
+static int http_connect ( struct http_request *http, int reuse );
+
 /**
  * Free HTTP request
  *
@@ -100,6 +152,163 @@ static void http_free ( struct refcnt *refcnt ) {
 	free ( http );
 };
 
+/**
+ * Free idle HTTP connection
+ *
+ * @v refcnt		Reference counter
+ */
+static void http_conn_free ( struct refcnt *refcnt ) {
+	struct http_connection *conn =
+		container_of ( refcnt, struct http_connection, refcnt );
+
+	free ( conn->host );
+	free ( conn );
+}
+
+/**
+ * Close idle HTTP connection
+ *
+ * @v conn		Idle HTTP connection
+ * @v rc		Reason for close
+ */
+static void http_conn_close ( struct http_connection *conn, int rc ) {
+
+	DBGC ( conn, "HTTP %p idle connection to %s:%d closed: %s\n",
+	       conn, conn->host, conn->port, strerror ( rc ) );
+
+	/* Remove from pool, close socket and drop pool's reference */
+	list_del ( &conn->list );
+	xfer_nullify ( &conn->socket );
+	xfer_close ( &conn->socket, rc );
+	ref_put ( &conn->refcnt );
+}
+
+/**
+ * Idle HTTP connection closed by network stack
+ *
+ * @v socket		Transport layer interface
+ * @v rc		Reason for close
+ */
+static void http_conn_socket_close ( struct xfer_interface *socket, int rc ) {
+	struct http_connection *conn =
+		container_of ( socket, struct http_connection, socket );
+
+	http_conn_close ( conn, rc );
+}
+
+/**
+ * Handle data arriving on idle HTTP connection
+ *
+ * @v socket		Transport layer interface
+ * @v iobuf		I/O buffer
+ * @v meta		Data transfer metadata
+ * @ret rc		Return status code
+ *
+ * Nothing may arrive while no request is outstanding; if something
+ * does, we can no longer tell where the next response starts.
+ */
+static int http_conn_socket_deliver_iob ( struct xfer_interface *socket,
+					  struct io_buffer *iobuf,
+					  struct xfer_metadata *meta __unused ) {
+	struct http_connection *conn =
+		container_of ( socket, struct http_connection, socket );
+
+	free_iob ( iobuf );
+	http_conn_close ( conn, -EIO );
+	return -EIO;
+}
+
+/** Idle HTTP connection socket operations */
+static struct xfer_interface_operations http_conn_socket_operations = {
+	.close		= http_conn_socket_close,
+	.vredirect	= ignore_xfer_vredirect,
+	.window		= unlimited_xfer_window,
+	.alloc_iob	= default_xfer_alloc_iob,
+	.deliver_iob	= http_conn_socket_deliver_iob,
+	.deliver_raw	= xfer_deliver_as_iob,
+};
+
+/**
+ * Move a socket from one transport layer interface to another
+ *
+ * @v from		Interface currently plugged into the socket
+ * @v to		Interface to plug into the socket instead
+ */
+static void http_move_socket ( struct xfer_interface *from,
+			       struct xfer_interface *to ) {
+	struct xfer_interface *dest = xfer_get_dest ( from );
+
+	xfer_plug_plug ( to, dest );
+	xfer_put ( dest );
+	xfer_unplug ( from );
+}
+
+/**
+ * Keep HTTP request's connection for reuse
+ *
+ * @v http		HTTP request
+ * @ret rc		Return status code
+ */
+static int http_idle_put ( struct http_request *http ) {
+	struct http_connection *conn;
+	unsigned int count = 0;
+
+	/* Allocate and populate idle connection */
+	conn = zalloc ( sizeof ( *conn ) );
+	if ( ! conn )
+		return -ENOMEM;
+	conn->refcnt.free = http_conn_free;
+	xfer_init ( &conn->socket, &http_conn_socket_operations,
+		    &conn->refcnt );
+	conn->host = strdup ( http->uri->host );
+	if ( ! conn->host ) {
+		ref_put ( &conn->refcnt );
+		return -ENOMEM;
+	}
+	conn->port = http->port;
+	conn->filter = http->filter;
+
+	/* Take over the socket and add to pool */
+	http_move_socket ( &http->socket, &conn->socket );
+	list_add ( &conn->list, &http_idle );
+	DBGC ( conn, "HTTP %p keeping connection to %s:%d from HTTP %p\n",
+	       conn, conn->host, conn->port, http );
+
+	/* Close the least recently used connection if there are too many */
+	list_for_each_entry ( conn, &http_idle, list ) {
+		if ( ++count > HTTP_MAX_IDLE ) {
+			http_conn_close ( conn, 0 );
+			break;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Reuse an idle connection for HTTP request, if possible
+ *
+ * @v http		HTTP request
+ * @ret rc		Return status code
+ */
+static int http_idle_get ( struct http_request *http ) {
+	struct http_connection *conn;
+
+	list_for_each_entry ( conn, &http_idle, list ) {
+		if ( ( conn->port == http->port ) &&
+		     ( conn->filter == http->filter ) &&
+		     ( strcasecmp ( conn->host, http->uri->host ) == 0 ) ) {
+			DBGC ( http, "HTTP %p reusing connection HTTP %p\n",
+			       http, conn );
+			http_move_socket ( &conn->socket, &http->socket );
+			list_del ( &conn->list );
+			ref_put ( &conn->refcnt );
+			return 0;
+		}
+	}
+	return -ENOENT;
+}
+
 /**
  * Mark HTTP request as complete
  *
@@ -108,6 +317,12 @@ static void http_free ( struct refcnt *refcnt ) {
  */
 static void http_done ( struct http_request *http, int rc ) {
 
+	/* The connection can be reused only if the whole response,
+	 * and nothing more, has been received
+	 */
+	if ( http->rx_state != HTTP_RX_IDLE )
+		http->keepalive = 0;
+
 	/* Prevent further processing of any current packet */
 	http->rx_state = HTTP_RX_DEAD;
 
@@ -124,9 +339,15 @@ static void http_done ( struct http_request *http, int rc ) {
 	/* Remove process */
 	process_del ( &http->process );
 
-	/* Close all data transfer interfaces */
-	xfer_nullify ( &http->socket );
-	xfer_close ( &http->socket, rc );
+	/* Keep the connection for the next request if possible, and
+	 * close all data transfer interfaces
+	 */
+	if ( ! ( http->keepalive && ( rc == 0 ) &&
+		 ( http_idle_put ( http ) == 0 ) ) ) {
+		xfer_nullify ( &http->socket );
+		xfer_close ( &http->socket, rc );
+	}
+	http->keepalive = 0;
 	xfer_nullify ( &http->xfer );
 	xfer_close ( &http->xfer, rc );
 }
@@ -171,6 +392,9 @@ static int http_rx_response ( struct http_request *http, char *response ) {
 	if ( strncmp ( response, "HTTP/", 5 ) != 0 )
 		return -EIO;
 
+	/* Connections persist by default from HTTP/1.1 onwards */
+	http->keepalive = ( strncmp ( response, "HTTP/1.0", 8 ) != 0 );
+
 	/* Locate and check response code */
 	spc = strchr ( response, ' ' );
 	if ( ! spc )
@@ -223,6 +447,7 @@ static int http_rx_content_length ( struct http_request *http,
 		       http, value );
 		return -EIO;
 	}
+	http->has_length = 1;
 
 	/* Use seek() to notify recipient of filesize */
 	xfer_seek ( &http->xfer, http->content_length, SEEK_SET );
@@ -231,6 +456,44 @@ static int http_rx_content_length ( struct http_request *http,
 	return 0;
 }
 
+/**
+ * Handle HTTP Transfer-Encoding header
+ *
+ * @v http		HTTP request
+ * @v value		HTTP header value
+ * @ret rc		Return status code
+ */
+static int http_rx_transfer_encoding ( struct http_request *http,
+				       const char *value ) {
+
+	if ( strcasecmp ( value, "chunked" ) != 0 ) {
+		DBGC ( http, "HTTP %p unsupported Transfer-Encoding \"%s\"\n",
+		       http, value );
+		return -ENOTSUP;
+	}
+	http->chunked = 1;
+
+	return 0;
+}
+
+/**
+ * Handle HTTP Connection header
+ *
+ * @v http		HTTP request
+ * @v value		HTTP header value
+ * @ret rc		Return status code
+ */
+static int http_rx_connection ( struct http_request *http,
+				const char *value ) {
+
+	if ( strcasecmp ( value, "close" ) == 0 )
+		http->keepalive = 0;
+	if ( strcasecmp ( value, "keep-alive" ) == 0 )
+		http->keepalive = 1;
+
+	return 0;
+}
+
 /** An HTTP header handler */
 struct http_header_handler {
 	/** Name (e.g. "Content-Length") */
@@ -256,6 +519,14 @@ static struct http_header_handler http_header_handlers[] = {
 		.header = "Content-Length",
 		.rx = http_rx_content_length,
 	},
+	{
+		.header = "Transfer-Encoding",
+		.rx = http_rx_transfer_encoding,
+	},
+	{
+		.header = "Connection",
+		.rx = http_rx_connection,
+	},
 	{ NULL, NULL }
 };
 
@@ -276,7 +547,15 @@ static int http_rx_header ( struct http_request *http, char *header ) {
 	if ( ! header[0] ) {
 		DBGC ( http, "HTTP %p start of data\n", http );
 		empty_line_buffer ( &http->linebuf );
-		http->rx_state = HTTP_RX_DATA;
+		if ( http->chunked ) {
+			/* Content-Length must be ignored */
+			http->content_length = 0;
+			http->rx_state = HTTP_RX_CHUNK_LEN;
+		} else if ( http->has_length && ! http->content_length ) {
+			http->rx_state = HTTP_RX_IDLE;
+		} else {
+			http->rx_state = HTTP_RX_DATA;
+		}
 		return 0;
 	}
 
@@ -302,6 +581,55 @@ static int http_rx_header ( struct http_request *http, char *header ) {
 	return 0;
 }
 
+/**
+ * Handle HTTP chunk length line
+ *
+ * @v http		HTTP request
+ * @v length		Chunk length line
+ * @ret rc		Return status code
+ */
+static int http_rx_chunk_len ( struct http_request *http, char *length ) {
+	char *endp;
+
+	/* Skip the blank line that ends the previous chunk's data */
+	if ( ! length[0] )
+		return 0;
+
+	/* Parse length, ignoring any chunk extensions */
+	http->chunk_len = strtoul ( length, &endp, 16 );
+	if ( ( endp == length ) ||
+	     ( *endp && ( *endp != ';' ) && ( *endp != ' ' ) ) ) {
+		DBGC ( http, "HTTP %p invalid chunk length \"%s\"\n",
+		       http, length );
+		return -EIO;
+	}
+
+	/* A zero-length chunk is the last, and precedes the trailer */
+	if ( http->chunk_len ) {
+		http->rx_state = HTTP_RX_DATA;
+	} else {
+		http->rx_state = HTTP_RX_TRAILER;
+	}
+	return 0;
+}
+
+/**
+ * Handle HTTP trailer line
+ *
+ * @v http		HTTP request
+ * @v trailer		HTTP trailer line
+ * @ret rc		Return status code
+ */
+static int http_rx_trailer ( struct http_request *http, char *trailer ) {
+
+	/* Trailer headers are ignored; an empty line ends the response */
+	if ( ! trailer[0] ) {
+		empty_line_buffer ( &http->linebuf );
+		http->rx_state = HTTP_RX_IDLE;
+	}
+	return 0;
+}
+
 /** An HTTP line-based data handler */
 struct http_line_handler {
 	/** Handle line
@@ -317,6 +645,8 @@ struct http_line_handler {
 static struct http_line_handler http_line_handlers[] = {
 	[HTTP_RX_RESPONSE]	= { .rx = http_rx_response },
 	[HTTP_RX_HEADER]	= { .rx = http_rx_header },
+	[HTTP_RX_CHUNK_LEN]	= { .rx = http_rx_chunk_len },
+	[HTTP_RX_TRAILER]	= { .rx = http_rx_trailer },
 };
 
 /**
@@ -328,24 +658,44 @@ static struct http_line_handler http_line_handlers[] = {
  */
 static int http_rx_data ( struct http_request *http,
 			  struct io_buffer *iobuf ) {
+	size_t len = iob_len ( iobuf );
 	int rc;
 
 	/* Update received length */
-	http->rx_len += iob_len ( iobuf );
+	http->rx_len += len;
 
 	/* Hand off data buffer */
 	if ( ( rc = xfer_deliver_iob ( &http->xfer, iobuf ) ) != 0 )
 		return rc;
 
-	/* If we have reached the content-length, stop now */
-	if ( http->content_length &&
-	     ( http->rx_len >= http->content_length ) ) {
-		http_done ( http, 0 );
+	/* Move on at the end of the chunk, or of the content */
+	if ( http->chunked ) {
+		http->chunk_len -= len;
+		if ( ! http->chunk_len )
+			http->rx_state = HTTP_RX_CHUNK_LEN;
+	} else if ( http->content_length &&
+		    ( http->rx_len >= http->content_length ) ) {
+		http->rx_state = HTTP_RX_IDLE;
 	}
 
 	return 0;
 }
 
+/**
+ * Calculate length of data that belongs to the current chunk or content
+ *
+ * @v http		HTTP request
+ * @ret len		Maximum length of data
+ */
+static size_t http_rx_data_len ( struct http_request *http ) {
+
+	if ( http->chunked )
+		return http->chunk_len;
+	if ( http->content_length )
+		return ( http->content_length - http->rx_len );
+	return ~( ( size_t ) 0 );
+}
+
 /**
  * Handle new data arriving via HTTP connection
  *
@@ -360,23 +710,46 @@ static int http_socket_deliver_iob ( struct xfer_interface *socket,
 	struct http_request *http =
 		container_of ( socket, struct http_request, socket );
 	struct http_line_handler *lh;
+	struct io_buffer *data;
+	size_t data_len;
 	char *line;
 	ssize_t len;
 	int rc = 0;
 
-	while ( iob_len ( iobuf ) ) {
+	while ( iobuf && iob_len ( iobuf ) ) {
 		switch ( http->rx_state ) {
+		case HTTP_RX_IDLE:
 		case HTTP_RX_DEAD:
 			/* Do no further processing */
 			goto done;
 		case HTTP_RX_DATA:
 			/* Once we're into the data phase, just fill
-			 * the data buffer
+			 * the data buffer.  Any data beyond the end
+			 * of the current chunk is copied out, so that
+			 * the rest of the buffer can be parsed.
 			 */
-			rc = http_rx_data ( http, iob_disown ( iobuf ) );
-			goto done;
+			data_len = http_rx_data_len ( http );
+			if ( iob_len ( iobuf ) <= data_len ) {
+				rc = http_rx_data ( http,
+						    iob_disown ( iobuf ) );
+			} else {
+				data = alloc_iob ( data_len );
+				if ( ! data ) {
+					rc = -ENOMEM;
+					goto done;
+				}
+				memcpy ( iob_put ( data, data_len ),
+					 iobuf->data, data_len );
+				iob_pull ( iobuf, data_len );
+				rc = http_rx_data ( http, data );
+			}
+			if ( rc != 0 )
+				goto done;
+			break;
 		case HTTP_RX_RESPONSE:
 		case HTTP_RX_HEADER:
+		case HTTP_RX_CHUNK_LEN:
+		case HTTP_RX_TRAILER:
 			/* In the other phases, buffer and process a
 			 * line at a time
 			 */
@@ -403,8 +776,17 @@ static int http_socket_deliver_iob ( struct xfer_interface *socket,
 	}
 
  done:
-	if ( rc )
+	if ( rc ) {
 		http_done ( http, rc );
+	} else if ( http->rx_state == HTTP_RX_IDLE ) {
+		/* Response is complete.  We never send a second
+		 * request before the first is answered, so anything
+		 * more leaves the connection in an unknown state.
+		 */
+		if ( iobuf && iob_len ( iobuf ) )
+			http->keepalive = 0;
+		http_done ( http, 0 );
+	}
 	free_iob ( iobuf );
 	return rc;
 }
@@ -452,8 +834,9 @@ static void http_step ( struct process *process ) {
 
 		/* Send GET request */
 		if ( ( rc = xfer_printf ( &http->socket,
-					  "GET %s%s HTTP/1.0\r\n"
+					  "GET %s%s HTTP/1.1\r\n"
 					  "User-Agent: gPXE/" VERSION "\r\n"
+					  "Connection: keep-alive\r\n"
 					  "%s%s%s"
 					  "Host: %s\r\n"
 					  "\r\n",
@@ -481,7 +864,21 @@ static void http_socket_close ( struct xfer_interface *socket, int rc ) {
 
 	DBGC ( http, "HTTP %p socket closed: %s\n",
 	       http, strerror ( rc ) );
-	
+
+	/* The server may have closed an idle connection just as we
+	 * reused it.  If nothing at all has been received, retry once
+	 * on a new connection.
+	 */
+	if ( http->reused && ( http->rx_state == HTTP_RX_RESPONSE ) &&
+	     ( http->linebuf.len == 0 ) ) {
+		DBGC ( http, "HTTP %p retrying on new connection\n", http );
+		xfer_unplug ( &http->socket );
+		if ( ( rc = http_connect ( http, 0 ) ) == 0 ) {
+			process_add ( &http->process );
+			return;
+		}
+	}
+
 	http_done ( http, rc );
 }
 
@@ -521,6 +918,39 @@ static struct xfer_interface_operations http_xfer_operations = {
 	.deliver_raw	= ignore_xfer_deliver_raw,
 };
 
+/**
+ * Connect HTTP request to server
+ *
+ * @v http		HTTP request
+ * @v reuse		Use an idle connection, if one is available
+ * @ret rc		Return status code
+ */
+static int http_connect ( struct http_request *http, int reuse ) {
+	struct sockaddr_tcpip server;
+	struct xfer_interface *socket;
+	int rc;
+
+	/* Use an idle connection to the same server, if possible */
+	http->reused = ( reuse && ( http_idle_get ( http ) == 0 ) );
+	if ( http->reused )
+		return 0;
+
+	/* Open socket */
+	memset ( &server, 0, sizeof ( server ) );
+	server.st_port = htons ( http->port );
+	socket = &http->socket;
+	if ( http->filter ) {
+		if ( ( rc = http->filter ( socket, &socket ) ) != 0 )
+			return rc;
+	}
+	if ( ( rc = xfer_open_named_socket ( socket, SOCK_STREAM,
+					     ( struct sockaddr * ) &server,
+					     http->uri->host, NULL ) ) != 0 )
+		return rc;
+
+	return 0;
+}
+
 /**
  * Initiate an HTTP connection, with optional filter
  *
@@ -535,8 +965,6 @@ int http_open_filter ( struct xfer_interface *xfer, struct uri *uri,
 		       int ( * filter ) ( struct xfer_interface *xfer,
 					  struct xfer_interface **next ) ) {
 	struct http_request *http;
-	struct sockaddr_tcpip server;
-	struct xfer_interface *socket;
 	int rc;
 
 	/* Sanity checks */
@@ -553,17 +981,11 @@ int http_open_filter ( struct xfer_interface *xfer, struct uri *uri,
 	xfer_init ( &http->socket, &http_socket_operations, &http->refcnt );
 	process_init ( &http->process, http_step, &http->refcnt );
 
-	/* Open socket */
-	memset ( &server, 0, sizeof ( server ) );
-	server.st_port = htons ( uri_port ( http->uri, default_port ) );
-	socket = &http->socket;
-	if ( filter ) {
-		if ( ( rc = filter ( socket, &socket ) ) != 0 )
-			goto err;
-	}
-	if ( ( rc = xfer_open_named_socket ( socket, SOCK_STREAM,
-					     ( struct sockaddr * ) &server,
-					     uri->host, NULL ) ) != 0 )
+	http->port = uri_port ( http->uri, default_port );
+	http->filter = filter;
+
+	/* Open socket, or reuse an idle one */
+	if ( ( rc = http_connect ( http, 1 ) ) != 0 )
 		goto err;
 
 	/* Attach to parent interface, mortalise self, and return */